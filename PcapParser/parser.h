@@ -32,8 +32,8 @@ class PcapParser {
     bool first_packet;
     char buffer[BUFFER_LEN];
     PacketStatistics::PacketStatistics ps;
-    std::map<SketchLab::FlowKey<flowkey_len>, uint32_t> flow_map;
-    std::set<SketchLab::FlowKey<flowkey_len>> flow_set;
+    SketchLab::FlatHashMap<flowkey_len, uint32_t> flow_map;
+    SketchLab::FlatHashSet<flowkey_len> flow_set;
 
     /* Util functions */
     inline bool getFileEndian();
@@ -430,12 +430,12 @@ int PcapParser<flowkey_len>::pcapParse() {
         else if (ret == 0) {
             fillFlowKey();
             fillValue();
-            typename std::map<SketchLab::FlowKey<flowkey_len>, uint32_t>::iterator map_iter = flow_map.find(key_content);
+            auto map_iter = flow_map.find(key_content);
             if (map_iter != flow_map.end()) {
                 map_iter->second += 1;
             }
             else if (flow_cnt < 0 || total_flows < flow_cnt){
-                flow_map[key_content] = 1;
+                flow_map.emplace(key_content, 1);
                 total_flows += 1;
             }
             else {
@@ -11,6 +11,7 @@
 #include <iomanip>
 #include <set>
 #include <map>
+#include <memory>
 #include <vector>
 #include <numeric>
 #include <algorithm>
@@ -20,6 +21,7 @@
 #include <arpa/inet.h>
 #include "PacketHeader.h"
 #include "FlowKey.h"
+#include "FlatHashMap.h"
 #include "value.h"
 // #include "parameters.h"
 #include "INIReader.h"
@@ -0,0 +1,112 @@
+#ifndef SKETCHLAB_CPP_COUNTERHEAP_H
+#define SKETCHLAB_CPP_COUNTERHEAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace SketchLab {
+
+/*
+ * Binary min-heap of counters for summaries that evict their smallest
+ * counter (SpaceSaving, MisraGries).
+ *
+ * Each counter belongs to a slot in [0, capacity), the index of its entry in
+ * the owner's own arrays, and the heap remembers where every slot sits, so a
+ * slot's count can be changed in place in O(log capacity); a unit increment
+ * usually sifts only a level or two. All storage is sized at construction.
+ */
+template <typename count_t> class CounterHeap {
+public:
+  struct Node {
+    count_t count_;
+    int32_t slot_;
+  };
+
+private:
+  int32_t size_;
+  std::vector<Node> heap_;   // heap_[0, size_) is the heap
+  std::vector<int32_t> pos_; // heap position of each slot
+
+  void place(int32_t pos, const Node &node) {
+    heap_[pos] = node;
+    pos_[node.slot_] = pos;
+  }
+  void siftUp(int32_t pos);
+  void siftDown(int32_t pos);
+
+public:
+  explicit CounterHeap(int32_t capacity)
+      : size_(0), heap_(capacity), pos_(capacity) {}
+
+  int32_t size() const { return size_; }
+  // the smallest counter; the heap must not be empty
+  const Node &top() const { return heap_[0]; }
+  // counters in heap order, pos in [0, size())
+  const Node &operator[](int32_t pos) const { return heap_[pos]; }
+  count_t count(int32_t slot) const { return heap_[pos_[slot]].count_; }
+
+  // slot must not be in the heap, and the heap must not be full
+  void push(int32_t slot, count_t count) {
+    place(size_, Node{count, slot});
+    siftUp(size_++);
+  }
+  void add(int32_t slot, count_t delta) {
+    int32_t pos = pos_[slot];
+    heap_[pos].count_ += delta;
+    if (delta < 0) {
+      siftUp(pos);
+    } else {
+      siftDown(pos);
+    }
+  }
+  // removes the smallest counter and returns its slot
+  int32_t pop() {
+    int32_t slot = heap_[0].slot_;
+    if (--size_ > 0) {
+      place(0, heap_[size_]);
+      siftDown(0);
+    }
+    return slot;
+  }
+  void clear() { size_ = 0; }
+  std::size_t bytes() const {
+    return heap_.size() * sizeof(Node) + pos_.size() * sizeof(int32_t);
+  }
+};
+
+template <typename count_t> void CounterHeap<count_t>::siftUp(int32_t pos) {
+  Node node = heap_[pos];
+  while (pos > 0) {
+    int32_t parent = (pos - 1) >> 1;
+    if (!(node.count_ < heap_[parent].count_)) {
+      break;
+    }
+    place(pos, heap_[parent]);
+    pos = parent;
+  }
+  place(pos, node);
+}
+
+template <typename count_t> void CounterHeap<count_t>::siftDown(int32_t pos) {
+  Node node = heap_[pos];
+  for (;;) {
+    int32_t child = 2 * pos + 1;
+    if (child >= size_) {
+      break;
+    }
+    if (child + 1 < size_ && heap_[child + 1].count_ < heap_[child].count_) {
+      ++child;
+    }
+    if (!(heap_[child].count_ < node.count_)) {
+      break;
+    }
+    place(pos, heap_[child]);
+    pos = child;
+  }
+  place(pos, node);
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_COUNTERHEAP_H
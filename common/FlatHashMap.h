@@ -0,0 +1,525 @@
+#ifndef SKETCHLAB_CPP_FLATHASHMAP_H
+#define SKETCHLAB_CPP_FLATHASHMAP_H
+
+#include "FlowKey.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace SketchLab {
+
+/*
+ * Open-addressing hash table keyed by FlowKey.
+ *
+ * Layout follows SwissTable: one control byte per slot (empty / deleted /
+ * 7-bit hash tag) stored apart from the slots, so a probe scans a dense byte
+ * array and only touches a slot whose tag matches. Slots live in one flat
+ * array and are never allocated per entry; erase leaves a tombstone so that
+ * erasing while iterating is safe, as with std::map.
+ *
+ * The interface mirrors the subset of std::map used in this repo (find, emplace,
+ * operator[], erase, count, iteration over pair<key, value>), but iteration
+ * order is unspecified.
+ *
+ * A table built with `fixed == true` never grows: it is sized for `capacity`
+ * entries up front and throws std::length_error when that is exceeded.
+ */
+namespace FlatHash {
+
+const uint8_t CTRL_EMPTY = 0x80;
+const uint8_t CTRL_DELETED = 0xFE;
+
+inline uint64_t Mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+template <int32_t key_len> inline uint64_t HashKey(const FlowKey<key_len> &key) {
+  const uint8_t *data = key.cKey();
+  uint64_t h = 0x9e3779b97f4a7c15ULL ^ static_cast<uint64_t>(key_len);
+  int32_t i = 0;
+  for (; i + 8 <= key_len; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    h = (h ^ word) * 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+  }
+  if (i < key_len) {
+    uint64_t word = 0;
+    if (key_len >= 8) {
+      // the last 8 bytes, overlapping the previous word: a partial copy
+      // would be stored in pieces and reloaded whole, which stalls store
+      // forwarding
+      std::memcpy(&word, data + key_len - 8, 8);
+    } else {
+      std::memcpy(&word, data + i, key_len - i);
+    }
+    h = (h ^ word) * 0xbf58476d1ce4e5b9ULL;
+  }
+  return Mix(h);
+}
+
+inline std::size_t RoundUpPow2(std::size_t n) {
+  std::size_t cap = 8;
+  while (cap < n) {
+    cap <<= 1;
+  }
+  return cap;
+}
+
+} // namespace FlatHash
+
+template <int32_t key_len, typename V> class FlatHashMap {
+public:
+  typedef FlowKey<key_len> key_type;
+  typedef V mapped_type;
+  typedef std::pair<FlowKey<key_len>, V> value_type;
+
+private:
+  template <bool is_const> class Iter {
+    friend class FlatHashMap;
+    template <bool> friend class Iter;
+    typedef typename std::conditional<is_const, const FlatHashMap *,
+                                      FlatHashMap *>::type table_ptr;
+    table_ptr table_;
+    std::size_t pos_;
+
+    Iter(table_ptr table, std::size_t pos) : table_(table), pos_(pos) {
+      skip();
+    }
+    void skip() {
+      while (pos_ < table_->capacity_ &&
+             (table_->ctrl_[pos_] & FlatHash::CTRL_EMPTY)) {
+        ++pos_;
+      }
+    }
+
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef typename FlatHashMap::value_type value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef typename std::conditional<is_const, const value_type *,
+                                      value_type *>::type pointer;
+    typedef typename std::conditional<is_const, const value_type &,
+                                      value_type &>::type reference;
+
+    Iter() : table_(nullptr), pos_(0) {}
+    // iterator -> const_iterator
+    template <bool other_const,
+              typename = typename std::enable_if<is_const && !other_const>::type>
+    Iter(const Iter<other_const> &other)
+        : table_(other.table_), pos_(other.pos_) {}
+
+    reference operator*() const { return table_->slots_[pos_]; }
+    pointer operator->() const { return &table_->slots_[pos_]; }
+    Iter &operator++() {
+      ++pos_;
+      skip();
+      return *this;
+    }
+    Iter operator++(int) {
+      Iter old = *this;
+      ++*this;
+      return old;
+    }
+    bool operator==(const Iter &other) const { return pos_ == other.pos_; }
+    bool operator!=(const Iter &other) const { return pos_ != other.pos_; }
+  };
+
+public:
+  typedef Iter<false> iterator;
+  typedef Iter<true> const_iterator;
+
+  explicit FlatHashMap(std::size_t capacity = 0, bool fixed = false);
+  FlatHashMap(const FlatHashMap &other);
+  FlatHashMap(FlatHashMap &&other) noexcept;
+  FlatHashMap &operator=(FlatHashMap other) noexcept;
+  void swap(FlatHashMap &other) noexcept;
+  ~FlatHashMap();
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, capacity_); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, capacity_); }
+
+  iterator find(const key_type &key);
+  const_iterator find(const key_type &key) const;
+  std::size_t count(const key_type &key) const {
+    return findPos(key) != capacity_;
+  }
+  std::pair<iterator, bool> emplace(const key_type &key, const V &val);
+  std::pair<iterator, bool> insert(const value_type &kv) {
+    return emplace(kv.first, kv.second);
+  }
+  V &operator[](const key_type &key) { return emplace(key, V()).first->second; }
+  iterator erase(iterator it);
+  std::size_t erase(const key_type &key);
+
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  std::size_t capacity() const { return capacity_; }
+  void reserve(std::size_t n);
+  void clear();
+  // memory footprint of slots + control bytes
+  std::size_t bytes() const {
+    return capacity_ * (sizeof(value_type) + sizeof(uint8_t));
+  }
+
+private:
+  std::size_t capacity_; // power of two (or 0)
+  std::size_t size_;
+  std::size_t used_;     // full + deleted slots
+  std::size_t limit_;    // max used_ before rehash
+  std::size_t max_size_; // entry limit of a fixed table
+  bool fixed_;
+  uint8_t *ctrl_;
+  value_type *slots_;
+
+  std::size_t findPos(const key_type &key) const;
+  void allocate(std::size_t capacity);
+  void rehash(std::size_t capacity);
+};
+
+template <int32_t key_len, typename V>
+FlatHashMap<key_len, V>::FlatHashMap(std::size_t capacity, bool fixed)
+    : capacity_(0), size_(0), used_(0), limit_(0), max_size_(capacity),
+      fixed_(fixed), ctrl_(nullptr), slots_(nullptr) {
+  if (capacity > 0) {
+    std::size_t cap = FlatHash::RoundUpPow2(capacity);
+    while (cap - cap / 8 < capacity) {
+      cap <<= 1;
+    }
+    allocate(cap);
+  }
+}
+
+template <int32_t key_len, typename V>
+FlatHashMap<key_len, V>::FlatHashMap(const FlatHashMap &other)
+    : capacity_(0), size_(0), used_(0), limit_(0),
+      max_size_(other.max_size_), fixed_(other.fixed_), ctrl_(nullptr),
+      slots_(nullptr) {
+  if (other.capacity_ > 0) {
+    allocate(other.capacity_);
+    std::copy(other.ctrl_, other.ctrl_ + capacity_, ctrl_);
+    std::copy(other.slots_, other.slots_ + capacity_, slots_);
+    size_ = other.size_;
+    used_ = other.used_;
+  }
+}
+
+template <int32_t key_len, typename V>
+FlatHashMap<key_len, V>::FlatHashMap(FlatHashMap &&other) noexcept
+    : capacity_(other.capacity_), size_(other.size_), used_(other.used_),
+      limit_(other.limit_), max_size_(other.max_size_), fixed_(other.fixed_),
+      ctrl_(other.ctrl_), slots_(other.slots_) {
+  other.capacity_ = other.size_ = other.used_ = other.limit_ = 0;
+  other.ctrl_ = nullptr;
+  other.slots_ = nullptr;
+}
+
+template <int32_t key_len, typename V>
+FlatHashMap<key_len, V> &
+FlatHashMap<key_len, V>::operator=(FlatHashMap other) noexcept {
+  other.swap(*this);
+  return *this;
+}
+
+template <int32_t key_len, typename V>
+void FlatHashMap<key_len, V>::swap(FlatHashMap &other) noexcept {
+  using std::swap;
+  swap(capacity_, other.capacity_);
+  swap(size_, other.size_);
+  swap(used_, other.used_);
+  swap(limit_, other.limit_);
+  swap(max_size_, other.max_size_);
+  swap(fixed_, other.fixed_);
+  swap(ctrl_, other.ctrl_);
+  swap(slots_, other.slots_);
+}
+
+template <int32_t key_len, typename V> FlatHashMap<key_len, V>::~FlatHashMap() {
+  delete[] ctrl_;
+  delete[] slots_;
+}
+
+template <int32_t key_len, typename V>
+void FlatHashMap<key_len, V>::allocate(std::size_t capacity) {
+  capacity_ = capacity;
+  ctrl_ = new uint8_t[capacity_];
+  std::fill(ctrl_, ctrl_ + capacity_, FlatHash::CTRL_EMPTY);
+  slots_ = new value_type[capacity_];
+  // keep load factor under 7/8
+  limit_ = capacity_ - capacity_ / 8;
+}
+
+template <int32_t key_len, typename V>
+std::size_t FlatHashMap<key_len, V>::findPos(const key_type &key) const {
+  if (size_ == 0) {
+    return capacity_;
+  }
+  uint64_t h = FlatHash::HashKey(key);
+  uint8_t tag = h & 0x7F;
+  std::size_t mask = capacity_ - 1;
+  for (std::size_t pos = (h >> 7) & mask;; pos = (pos + 1) & mask) {
+    uint8_t c = ctrl_[pos];
+    if (c == tag && slots_[pos].first == key) {
+      return pos;
+    }
+    if (c == FlatHash::CTRL_EMPTY) {
+      return capacity_;
+    }
+  }
+}
+
+template <int32_t key_len, typename V>
+typename FlatHashMap<key_len, V>::iterator
+FlatHashMap<key_len, V>::find(const key_type &key) {
+  return iterator(this, findPos(key));
+}
+
+template <int32_t key_len, typename V>
+typename FlatHashMap<key_len, V>::const_iterator
+FlatHashMap<key_len, V>::find(const key_type &key) const {
+  return const_iterator(this, findPos(key));
+}
+
+template <int32_t key_len, typename V>
+std::pair<typename FlatHashMap<key_len, V>::iterator, bool>
+FlatHashMap<key_len, V>::emplace(const key_type &key, const V &val) {
+  if (capacity_ == 0) {
+    allocate(8);
+  }
+  uint64_t h = FlatHash::HashKey(key);
+  uint8_t tag = h & 0x7F;
+  std::size_t mask = capacity_ - 1;
+  std::size_t slot = capacity_;
+  for (std::size_t pos = (h >> 7) & mask;; pos = (pos + 1) & mask) {
+    uint8_t c = ctrl_[pos];
+    if (c == tag && slots_[pos].first == key) {
+      return {iterator(this, pos), false};
+    }
+    if (c == FlatHash::CTRL_DELETED && slot == capacity_) {
+      slot = pos; // reuse the first tombstone on the probe path
+    } else if (c == FlatHash::CTRL_EMPTY) {
+      if (slot == capacity_) {
+        slot = pos;
+      }
+      break;
+    }
+  }
+  if (fixed_ && size_ >= max_size_) {
+    throw std::length_error("FlatHashMap: fixed capacity exceeded");
+  }
+  if (ctrl_[slot] == FlatHash::CTRL_EMPTY) {
+    if (used_ + 1 > limit_) {
+      // too many tombstones: rebuild in place; otherwise grow
+      rehash(fixed_ || size_ * 2 < limit_ ? capacity_ : capacity_ << 1);
+      return emplace(key, val);
+    }
+    ++used_;
+  }
+  ctrl_[slot] = tag;
+  slots_[slot].first = key;
+  slots_[slot].second = val;
+  ++size_;
+  return {iterator(this, slot), true};
+}
+
+template <int32_t key_len, typename V>
+typename FlatHashMap<key_len, V>::iterator
+FlatHashMap<key_len, V>::erase(iterator it) {
+  ctrl_[it.pos_] = FlatHash::CTRL_DELETED;
+  --size_;
+  ++it;
+  return it;
+}
+
+template <int32_t key_len, typename V>
+std::size_t FlatHashMap<key_len, V>::erase(const key_type &key) {
+  std::size_t pos = findPos(key);
+  if (pos == capacity_) {
+    return 0;
+  }
+  ctrl_[pos] = FlatHash::CTRL_DELETED;
+  --size_;
+  return 1;
+}
+
+template <int32_t key_len, typename V>
+void FlatHashMap<key_len, V>::rehash(std::size_t capacity) {
+  uint8_t *old_ctrl = ctrl_;
+  value_type *old_slots = slots_;
+  std::size_t old_capacity = capacity_;
+
+  allocate(capacity);
+  std::size_t mask = capacity_ - 1;
+  for (std::size_t i = 0; i < old_capacity; ++i) {
+    if (old_ctrl[i] & FlatHash::CTRL_EMPTY) {
+      continue;
+    }
+    uint64_t h = FlatHash::HashKey(old_slots[i].first);
+    std::size_t pos = (h >> 7) & mask;
+    while (ctrl_[pos] != FlatHash::CTRL_EMPTY) {
+      pos = (pos + 1) & mask;
+    }
+    ctrl_[pos] = h & 0x7F;
+    slots_[pos] = old_slots[i];
+  }
+  used_ = size_;
+  delete[] old_ctrl;
+  delete[] old_slots;
+}
+
+template <int32_t key_len, typename V>
+void FlatHashMap<key_len, V>::reserve(std::size_t n) {
+  if (n <= limit_ || fixed_) {
+    return;
+  }
+  std::size_t cap = FlatHash::RoundUpPow2(n);
+  while (cap - cap / 8 < n) {
+    cap <<= 1;
+  }
+  rehash(cap);
+}
+
+template <int32_t key_len, typename V> void FlatHashMap<key_len, V>::clear() {
+  std::fill(ctrl_, ctrl_ + capacity_, FlatHash::CTRL_EMPTY);
+  size_ = used_ = 0;
+}
+
+template <int32_t key_len> class FlatHashSet {
+  // the stored byte is unused; a set is a map without payload
+  FlatHashMap<key_len, uint8_t> table_;
+
+public:
+  typedef FlowKey<key_len> key_type;
+  typedef FlowKey<key_len> value_type;
+
+  class const_iterator {
+    friend class FlatHashSet;
+    typename FlatHashMap<key_len, uint8_t>::const_iterator it_;
+    const_iterator(typename FlatHashMap<key_len, uint8_t>::const_iterator it)
+        : it_(it) {}
+
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef FlowKey<key_len> value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const value_type *pointer;
+    typedef const value_type &reference;
+
+    reference operator*() const { return it_->first; }
+    pointer operator->() const { return &it_->first; }
+    const_iterator &operator++() {
+      ++it_;
+      return *this;
+    }
+    bool operator==(const const_iterator &other) const {
+      return it_ == other.it_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return it_ != other.it_;
+    }
+  };
+  typedef const_iterator iterator;
+
+  explicit FlatHashSet(std::size_t capacity = 0, bool fixed = false)
+      : table_(capacity, fixed) {}
+
+  const_iterator begin() const { return table_.begin(); }
+  const_iterator end() const { return table_.end(); }
+  const_iterator find(const key_type &key) const { return table_.find(key); }
+  std::size_t count(const key_type &key) const { return table_.count(key); }
+  // returns true if the key was not present
+  bool insert(const key_type &key) { return table_.emplace(key, 0).second; }
+  bool emplace(const key_type &key) { return insert(key); }
+  std::size_t erase(const key_type &key) { return table_.erase(key); }
+
+  std::size_t size() const { return table_.size(); }
+  bool empty() const { return table_.empty(); }
+  std::size_t capacity() const { return table_.capacity(); }
+  void reserve(std::size_t n) { table_.reserve(n); }
+  void clear() { table_.clear(); }
+  std::size_t bytes() const { return table_.bytes(); }
+};
+
+/*
+ * Index from key hashes to slots of an array the caller owns, for tables that
+ * keep their entries in place (e.g. ordered by a heap) and need only a
+ * lookup. Linear probing over (hash, slot) cells at a load of at most 1/2;
+ * erase shifts later cells of the run back instead of leaving a tombstone,
+ * so nothing is allocated after construction however many keys come and go.
+ */
+class SlotIndex {
+  struct Cell {
+    uint32_t hash_;
+    int32_t slot_; // -1 when empty
+  };
+  uint32_t mask_;
+  std::vector<Cell> cells_;
+
+public:
+  // room for capacity slots
+  explicit SlotIndex(std::size_t capacity)
+      : mask_(static_cast<uint32_t>(FlatHash::RoundUpPow2(2 * capacity) - 1)),
+        cells_(mask_ + 1) {
+    clear();
+  }
+
+  // a slot inserted with hash for which match(slot) holds, -1 if none
+  template <typename Pred> int32_t find(uint32_t hash, Pred match) const {
+    for (uint32_t i = hash & mask_;; i = (i + 1) & mask_) {
+      if (cells_[i].slot_ < 0) {
+        return -1;
+      }
+      if (cells_[i].hash_ == hash && match(cells_[i].slot_)) {
+        return cells_[i].slot_;
+      }
+    }
+  }
+  void insert(uint32_t hash, int32_t slot) {
+    uint32_t i = hash & mask_;
+    while (cells_[i].slot_ >= 0) {
+      i = (i + 1) & mask_;
+    }
+    cells_[i].hash_ = hash;
+    cells_[i].slot_ = slot;
+  }
+  // slot must have been inserted with hash
+  void erase(uint32_t hash, int32_t slot) {
+    uint32_t i = hash & mask_;
+    while (cells_[i].slot_ != slot) {
+      i = (i + 1) & mask_;
+    }
+    // move back every later cell of the run whose home is not in (i, j]
+    for (uint32_t j = (i + 1) & mask_; cells_[j].slot_ >= 0;
+         j = (j + 1) & mask_) {
+      if (((j - cells_[j].hash_) & mask_) >= ((j - i) & mask_)) {
+        cells_[i] = cells_[j];
+        i = j;
+      }
+    }
+    cells_[i].slot_ = -1;
+  }
+  std::size_t bytes() const { return (mask_ + 1) * sizeof(Cell); }
+  void clear() {
+    for (uint32_t i = 0; i <= mask_; ++i) {
+      cells_[i].slot_ = -1;
+    }
+  }
+};
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_FLATHASHMAP_H
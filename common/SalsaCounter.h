@@ -0,0 +1,139 @@
+#ifndef SKETCHLAB_CPP_SALSACOUNTER_H
+#define SKETCHLAB_CPP_SALSACOUNTER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+namespace SketchLab {
+
+/*
+ * Self-adjusting counter array (SALSA).
+ *
+ * Every counter starts as 8 bits. When a counter overflows it is merged with
+ * its aligned neighbour into one 16-bit counter, and a 16-bit counter that
+ * overflows is merged with the neighbouring pair into one 32-bit counter.
+ * 32-bit counters saturate. Merge state costs one bit per pair and one bit
+ * per quad (0.75 bit per counter).
+ *
+ * Merging takes the maximum of the merged counters (max-merge), which keeps
+ * every counter an upper bound of what was added to each of its members, so
+ * Count-Min and conservative update stay one-sided. It is not suitable for
+ * signed sketches such as CountSketch.
+ */
+class SalsaCounterArray {
+  int32_t num_counters_; // multiple of 4
+  uint8_t *arr_;
+  uint8_t *merged16_; // bit per aligned pair
+  uint8_t *merged32_; // bit per aligned quad
+
+  static bool getBit(const uint8_t *bits, int32_t pos) {
+    return (bits[pos >> 3] >> (pos & 7)) & 1;
+  }
+  static void setBit(uint8_t *bits, int32_t pos) {
+    bits[pos >> 3] |= (1 << (pos & 7));
+  }
+  uint16_t load16(int32_t i) const {
+    uint16_t v;
+    std::memcpy(&v, arr_ + i, sizeof(v));
+    return v;
+  }
+  uint32_t load32(int32_t i) const {
+    uint32_t v;
+    std::memcpy(&v, arr_ + i, sizeof(v));
+    return v;
+  }
+  void store16(int32_t i, uint16_t v) { std::memcpy(arr_ + i, &v, sizeof(v)); }
+  void store32(int32_t i, uint32_t v) { std::memcpy(arr_ + i, &v, sizeof(v)); }
+
+  // value of the pair starting at i (even) at whatever width it has now
+  uint32_t pairMax(int32_t i) const {
+    if (getBit(merged16_, i >> 1)) {
+      return load16(i);
+    }
+    return std::max(arr_[i], arr_[i + 1]);
+  }
+
+public:
+  explicit SalsaCounterArray(int32_t num_counters)
+      : num_counters_((num_counters + 3) & ~3) {
+    arr_ = new uint8_t[num_counters_]();
+    merged16_ = new uint8_t[(num_counters_ / 2 + 7) / 8]();
+    merged32_ = new uint8_t[(num_counters_ / 4 + 7) / 8]();
+  }
+  ~SalsaCounterArray() {
+    delete[] arr_;
+    delete[] merged16_;
+    delete[] merged32_;
+  }
+  SalsaCounterArray(const SalsaCounterArray &) = delete;
+  SalsaCounterArray &operator=(const SalsaCounterArray &) = delete;
+
+  // current width of counter i in bits
+  int32_t width(int32_t i) const {
+    if (getBit(merged32_, i >> 2)) {
+      return 32;
+    }
+    return getBit(merged16_, i >> 1) ? 16 : 8;
+  }
+
+  uint32_t get(int32_t i) const {
+    if (getBit(merged32_, i >> 2)) {
+      return load32(i & ~3);
+    }
+    if (getBit(merged16_, i >> 1)) {
+      return load16(i & ~1);
+    }
+    return arr_[i];
+  }
+
+  // Raise counter i to val (val >= get(i)), promoting it on overflow
+  void set(int32_t i, uint64_t val) {
+    if (getBit(merged32_, i >> 2)) {
+      store32(i & ~3, static_cast<uint32_t>(std::min<uint64_t>(
+                          val, std::numeric_limits<uint32_t>::max())));
+      return;
+    }
+    if (getBit(merged16_, i >> 1)) {
+      if (val <= std::numeric_limits<uint16_t>::max()) {
+        store16(i & ~1, static_cast<uint16_t>(val));
+        return;
+      }
+    } else if (val <= std::numeric_limits<uint8_t>::max()) {
+      arr_[i] = static_cast<uint8_t>(val);
+      return;
+    } else {
+      // 8 -> 16 bits
+      val = std::max<uint64_t>(val, arr_[i ^ 1]);
+      setBit(merged16_, i >> 1);
+      if (val <= std::numeric_limits<uint16_t>::max()) {
+        store16(i & ~1, static_cast<uint16_t>(val));
+        return;
+      }
+    }
+    // 16 -> 32 bits, merge with the other pair of the quad
+    val = std::max<uint64_t>(val, pairMax((i & ~3) + ((i & 2) ^ 2)));
+    setBit(merged32_, i >> 2);
+    store32(i & ~3, static_cast<uint32_t>(std::min<uint64_t>(
+                        val, std::numeric_limits<uint32_t>::max())));
+  }
+
+  void add(int32_t i, uint64_t val) { set(i, get(i) + val); }
+
+  int32_t count() const { return num_counters_; }
+  std::size_t size() const {
+    return sizeof(SalsaCounterArray) + num_counters_ +
+           (num_counters_ / 2 + 7) / 8 + (num_counters_ / 4 + 7) / 8;
+  }
+  void clear() {
+    std::fill(arr_, arr_ + num_counters_, 0);
+    std::fill(merged16_, merged16_ + (num_counters_ / 2 + 7) / 8, 0);
+    std::fill(merged32_, merged32_ + (num_counters_ / 4 + 7) / 8, 0);
+  }
+};
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_SALSACOUNTER_H
@@ -5,6 +5,15 @@
 #ifndef SKETCHLAB_CPP_UTIL_H
 #define SKETCHLAB_CPP_UTIL_H
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 namespace SketchLab {
 namespace Util {
 
@@ -32,6 +41,199 @@ int NextPrime(int n) {
   return n;
 }
 
+// Number of row indices a batched update keeps on the stack per chunk
+const int BATCH_INDEX_LIMIT = 2048;
+
+// Hint the counter at addr into cache before it is read / written
+inline void Prefetch(const void *addr) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(addr, 1, 3);
+#else
+  (void)addr;
+#endif
+}
+
+// MurmurHash3 finalizer. Estimators that read individual hash bits (rank,
+// register index) need every bit mixed; AwareHash leaves the low bits weak.
+inline uint64_t Mix64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Bit scans of a 64-bit word; x must be non-zero for the zero counts
+inline int CountTrailingZeros(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(x);
+#else
+  int n = 0;
+  for (; !(x & 1); x >>= 1) {
+    ++n;
+  }
+  return n;
+#endif
+}
+
+inline int CountLeadingZeros(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_clzll(x);
+#else
+  int n = 0;
+  for (; !(x >> 63); x <<= 1) {
+    ++n;
+  }
+  return n;
+#endif
+}
+
+inline int PopCount(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(x);
+#else
+  int n = 0;
+  for (; x; x &= x - 1) {
+    ++n;
+  }
+  return n;
+#endif
+}
+
+// Set bits in words[0, n). With AVX2 four words at a time by nibble table
+// lookups (Mula, Kurz and Lemire, "Faster population counts using AVX2
+// instructions", 2018), which also beats the libgcc fallback PopCount
+// compiles to without -mpopcnt.
+inline int64_t PopCountArray(const uint64_t *words, size_t n) {
+  int64_t count = 0;
+  size_t i = 0;
+#ifdef __AVX2__
+  const __m256i table =
+      _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4, //
+                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 4 <= n; i += 4) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(words + i));
+    __m256i bytes = _mm256_add_epi8(
+        _mm256_shuffle_epi8(table, _mm256_and_si256(v, low)),
+        _mm256_shuffle_epi8(table,
+                            _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+    // byte sums fit, so widen every vector straight into 64-bit lanes
+    acc = _mm256_add_epi64(acc,
+                           _mm256_sad_epu8(bytes, _mm256_setzero_si256()));
+  }
+  count += _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+           _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+#endif
+  for (; i < n; ++i) {
+    count += PopCount(words[i]);
+  }
+  return count;
+}
+
+// Upper bound on sketch depth for code that keeps one value per row on the
+// stack (conservative update, median estimation)
+const int MAX_DEPTH = 32;
+
+// Hash functors are plain seeds, so two sketches hash alike iff their
+// functors are bytewise equal (e.g. one sketch is a copy of the other)
+template <typename hash_t>
+bool SameHashes(const hash_t *a, const hash_t *b, int n) {
+  return std::memcmp(a, b, n * sizeof(hash_t)) == 0;
+}
+
+namespace Detail {
+template <typename T> inline void SortPair(T &a, T &b) {
+  T lo = std::min(a, b);
+  b = std::max(a, b);
+  a = lo;
+}
+} // namespace Detail
+
+// Median of values[0, n), reorders values. For even n it is the mean of the
+// two middle values. Odd n up to 9 use median selection networks, other
+// small n insertion sort and the rest nth_element; none of them allocates.
+template <typename T> T Median(T *v, int n) {
+  using Detail::SortPair;
+  switch (n) {
+  case 1:
+    return v[0];
+  case 3:
+    SortPair(v[0], v[1]);
+    SortPair(v[1], v[2]);
+    SortPair(v[0], v[1]);
+    return v[1];
+  case 5:
+    SortPair(v[0], v[1]);
+    SortPair(v[3], v[4]);
+    SortPair(v[0], v[3]);
+    SortPair(v[1], v[4]);
+    SortPair(v[1], v[2]);
+    SortPair(v[2], v[3]);
+    SortPair(v[1], v[2]);
+    return v[2];
+  case 7:
+    SortPair(v[0], v[5]);
+    SortPair(v[0], v[3]);
+    SortPair(v[1], v[6]);
+    SortPair(v[2], v[4]);
+    SortPair(v[0], v[1]);
+    SortPair(v[3], v[5]);
+    SortPair(v[2], v[6]);
+    SortPair(v[2], v[3]);
+    SortPair(v[3], v[6]);
+    SortPair(v[4], v[5]);
+    SortPair(v[1], v[4]);
+    SortPair(v[1], v[3]);
+    SortPair(v[3], v[4]);
+    return v[3];
+  case 9:
+    SortPair(v[1], v[2]);
+    SortPair(v[4], v[5]);
+    SortPair(v[7], v[8]);
+    SortPair(v[0], v[1]);
+    SortPair(v[3], v[4]);
+    SortPair(v[6], v[7]);
+    SortPair(v[1], v[2]);
+    SortPair(v[4], v[5]);
+    SortPair(v[7], v[8]);
+    SortPair(v[0], v[3]);
+    SortPair(v[5], v[8]);
+    SortPair(v[4], v[7]);
+    SortPair(v[3], v[6]);
+    SortPair(v[1], v[4]);
+    SortPair(v[2], v[5]);
+    SortPair(v[4], v[7]);
+    SortPair(v[4], v[2]);
+    SortPair(v[6], v[4]);
+    SortPair(v[4], v[2]);
+    return v[4];
+  default:
+    break;
+  }
+  if (n <= 16) {
+    // insertion sort beats nth_element's setup cost at this size
+    for (int i = 1; i < n; ++i) {
+      T x = v[i];
+      int j = i;
+      for (; j > 0 && x < v[j - 1]; --j) {
+        v[j] = v[j - 1];
+      }
+      v[j] = x;
+    }
+    return (n & 1) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+  }
+  std::nth_element(v, v + n / 2, v + n);
+  if (n & 1) {
+    return v[n / 2];
+  }
+  // lower middle is the largest of the left part
+  return (*std::max_element(v, v + n / 2) + v[n / 2]) / 2;
+}
+
 } // namespace Util
 } // namespace SketchLab
 
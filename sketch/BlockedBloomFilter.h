@@ -0,0 +1,186 @@
+#ifndef SKETCHLAB_CPP_BLOCKEDBLOOMFILTER_H
+#define SKETCHLAB_CPP_BLOCKEDBLOOMFILTER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "hash.h"
+#include "util.h"
+
+namespace SketchLab {
+
+/*
+ * Split-block Bloom filter.
+ *
+ * The bit array is cut into 256-bit blocks of eight 32-bit lanes. A key is
+ * hashed once: the hash picks a block, and all num_hash_ bits are set inside
+ * that block, so an insert or query costs one hash call and one cache miss no
+ * matter how many bits a key has. Bit j of the key goes to lane
+ * l = (j + r) % 8 at position (h * SALT[l + (j & ~7)]) >> 27, where h and r
+ * come from the same hash; with AVX2 the eight lanes of the mask are computed
+ * at once.
+ *
+ * Keeping a key inside one block makes the false positive rate somewhat higher
+ * than BloomFilter with the same number of bits (block loads vary), most
+ * noticeably for large num_hash_; in return the probe cost is flat. num_hash_
+ * is limited to 16, i.e. at most two bits per lane.
+ *
+ * Interface and constructor arguments are those of BloomFilter, so either can
+ * be the filter of TwoLevel and FlowRadar.
+ */
+template <typename hash_t> class BlockedBloomFilter {
+  static const int32_t LANES = 8;
+  static const int32_t BLOCK_BYTES = LANES * sizeof(uint32_t);
+  static const int32_t MAX_HASH = 2 * LANES;
+  static const uint32_t SALT[MAX_HASH];
+
+  int32_t num_blocks_;
+  int32_t num_hash_;
+  hash_t *hash_fns_;
+
+  uint8_t *raw_;
+  uint32_t *arr_; // num_blocks_ * LANES, BLOCK_BYTES aligned
+
+  template <int32_t key_len>
+  uint32_t *locate(const FlowKey<key_len> &flowkey, uint32_t &h,
+                   uint32_t &r) const;
+#ifdef __AVX2__
+  __m256i makeMask(uint32_t h, uint32_t r) const;
+#endif
+
+public:
+  BlockedBloomFilter(int32_t nbits, int32_t num_hash);
+  ~BlockedBloomFilter();
+  BlockedBloomFilter(const BlockedBloomFilter &) = delete;
+  BlockedBloomFilter(BlockedBloomFilter &&) = delete;
+  BlockedBloomFilter &operator=(BlockedBloomFilter) = delete;
+
+  template <int32_t key_len> void insert(const FlowKey<key_len> &flowkey);
+  template <int32_t key_len> bool query(const FlowKey<key_len> &flowkey) const;
+  std::size_t size() const;
+  void clear();
+};
+
+template <typename hash_t>
+const uint32_t BlockedBloomFilter<hash_t>::SALT[MAX_HASH] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+    0x9e3779b1U, 0x85ebca77U, 0xc2b2ae3dU, 0x27d4eb2fU,
+    0x165667b1U, 0xcc9e2d51U, 0x1b873593U, 0x7feb352dU};
+
+template <typename hash_t>
+BlockedBloomFilter<hash_t>::BlockedBloomFilter(int32_t nbits, int32_t num_hash)
+    : num_hash_(num_hash) {
+  if (num_hash_ <= 0 || num_hash_ > MAX_HASH) {
+    throw std::invalid_argument("BlockedBloomFilter: num_hash must be in [1, " +
+                                std::to_string(MAX_HASH) + "]");
+  }
+  num_blocks_ = Util::NextPrime(
+      std::max<int32_t>(1, (nbits + BLOCK_BYTES * 8 - 1) / (BLOCK_BYTES * 8)));
+  hash_fns_ = new hash_t[1];
+  // Allocate one aligned region, so no block straddles a cache line
+  raw_ = new uint8_t[static_cast<size_t>(num_blocks_) * BLOCK_BYTES +
+                     BLOCK_BYTES]();
+  arr_ = reinterpret_cast<uint32_t *>(
+      (reinterpret_cast<uintptr_t>(raw_) + BLOCK_BYTES - 1) &
+      ~static_cast<uintptr_t>(BLOCK_BYTES - 1));
+}
+
+template <typename hash_t> BlockedBloomFilter<hash_t>::~BlockedBloomFilter() {
+  delete[] hash_fns_;
+  delete[] raw_;
+}
+
+template <typename hash_t>
+template <int32_t key_len>
+uint32_t *BlockedBloomFilter<hash_t>::locate(const FlowKey<key_len> &flowkey,
+                                             uint32_t &h, uint32_t &r) const {
+  uint64_t hash = hash_fns_[0](flowkey);
+  int64_t block = hash % num_blocks_;
+  // the raw high bits are the well mixed ones; spread them over h and r
+  uint64_t mixed = hash * 0x9e3779b97f4a7c15ULL;
+  h = static_cast<uint32_t>(mixed >> 32);
+  r = static_cast<uint32_t>(mixed >> 29) & (LANES - 1);
+  return arr_ + block * LANES;
+}
+
+#ifdef __AVX2__
+template <typename hash_t>
+__m256i BlockedBloomFilter<hash_t>::makeMask(uint32_t h, uint32_t r) const {
+  const __m256i hv = _mm256_set1_epi32(h);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i rank = _mm256_and_si256(
+      _mm256_sub_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                       _mm256_set1_epi32(r)),
+      _mm256_set1_epi32(LANES - 1));
+  __m256i mask = _mm256_setzero_si256();
+  for (int32_t j = 0; j < num_hash_; j += LANES) {
+    __m256i salt = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(SALT + j));
+    __m256i pos = _mm256_srli_epi32(_mm256_mullo_epi32(hv, salt), 27);
+    // lanes whose rank is below the remaining bit count get one more bit
+    __m256i used = _mm256_cmpgt_epi32(_mm256_set1_epi32(num_hash_ - j), rank);
+    mask = _mm256_or_si256(
+        mask, _mm256_and_si256(used, _mm256_sllv_epi32(one, pos)));
+  }
+  return mask;
+}
+#endif
+
+template <typename hash_t>
+template <int32_t key_len>
+void BlockedBloomFilter<hash_t>::insert(const FlowKey<key_len> &flowkey) {
+  uint32_t h, r;
+  uint32_t *block = locate(flowkey, h, r);
+#ifdef __AVX2__
+  __m256i *p = reinterpret_cast<__m256i *>(block);
+  _mm256_store_si256(p, _mm256_or_si256(_mm256_load_si256(p), makeMask(h, r)));
+#else
+  for (int32_t j = 0; j < num_hash_; ++j) {
+    int32_t l = (j + r) & (LANES - 1);
+    block[l] |= 1U << ((h * SALT[(j & ~(LANES - 1)) + l]) >> 27);
+  }
+#endif
+}
+
+template <typename hash_t>
+template <int32_t key_len>
+bool BlockedBloomFilter<hash_t>::query(const FlowKey<key_len> &flowkey) const {
+  uint32_t h, r;
+  const uint32_t *block = locate(flowkey, h, r);
+#ifdef __AVX2__
+  return _mm256_testc_si256(
+      _mm256_load_si256(reinterpret_cast<const __m256i *>(block)),
+      makeMask(h, r));
+#else
+  for (int32_t j = 0; j < num_hash_; ++j) {
+    int32_t l = (j + r) & (LANES - 1);
+    if (!((block[l] >> ((h * SALT[(j & ~(LANES - 1)) + l]) >> 27)) & 1)) {
+      return false;
+    }
+  }
+  return true;
+#endif
+}
+
+template <typename hash_t>
+std::size_t BlockedBloomFilter<hash_t>::size() const {
+  return sizeof(BlockedBloomFilter<hash_t>) // Instance
+         + num_blocks_ * BLOCK_BYTES        // arr_
+         + sizeof(hash_t);                  // hash_fns
+}
+
+template <typename hash_t> void BlockedBloomFilter<hash_t>::clear() {
+  std::fill(arr_, arr_ + static_cast<size_t>(num_blocks_) * LANES, 0);
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_BLOCKEDBLOOMFILTER_H
@@ -0,0 +1,141 @@
+#ifndef SKETCHLAB_CPP_BLOCKEDCMSKETCH_H
+#define SKETCHLAB_CPP_BLOCKEDCMSKETCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+
+#include "hash.h"
+#include "util.h"
+
+namespace SketchLab {
+
+/*
+ * Cache-line blocked Count-Min.
+ *
+ * The key is first hashed to one 64-byte block; each of the `depth_` rows owns
+ * a disjoint slice of `slice_` counters inside that block and the key picks one
+ * counter per slice. An update or query therefore touches one cache line
+ * instead of `depth_`.
+ *
+ * Accuracy trade-off versus CMSketch with the same memory: the expected error
+ * per row is unchanged (N / total counters per row), but rows are no longer
+ * independent -- two keys in different blocks never collide, while two keys in
+ * the same block collide in row i with probability 1 / slice_. The
+ * min-over-rows therefore only averages out collisions among the keys sharing
+ * a block, and the tail bound loosens as depth_ grows relative to the number
+ * of counters per block. Counters are `T` (typically uint8_t/uint16_t) and
+ * saturate at their maximum instead of wrapping, so heavy flows are reported
+ * as at least the saturation value.
+ */
+template <typename T, typename hash_t> class BlockedCMSketch {
+  static const int32_t BLOCK_BYTES = 64;
+  static const int32_t COUNTERS_PER_BLOCK = BLOCK_BYTES / sizeof(T);
+
+  int32_t depth_;
+  int32_t num_blocks_;
+  int32_t slice_; // counters per row inside a block
+
+  hash_t *hash_fns_; // [0]: block, [1]: positions inside the block
+
+  uint8_t *raw_;
+  T *counter_; // num_blocks_ * COUNTERS_PER_BLOCK, 64-byte aligned
+
+  template <int32_t key_len>
+  T *locate(const FlowKey<key_len> &flowkey, uint32_t &h1, uint32_t &h2) const;
+
+public:
+  BlockedCMSketch(int32_t depth, int32_t width);
+  ~BlockedCMSketch();
+  BlockedCMSketch(const BlockedCMSketch &) = delete;
+  BlockedCMSketch(BlockedCMSketch &&) = delete;
+  BlockedCMSketch &operator=(BlockedCMSketch) = delete;
+
+  template <int32_t key_len>
+  void update(const FlowKey<key_len> &flowkey, T val);
+  template <int32_t key_len> T query(const FlowKey<key_len> &flowkey) const;
+  size_t size() const;
+  void clear();
+};
+
+// width keeps the CMSketch meaning: depth * width counters in total
+template <typename T, typename hash_t>
+BlockedCMSketch<T, hash_t>::BlockedCMSketch(int32_t depth, int32_t width)
+    : depth_(depth) {
+  if (depth_ <= 0 || depth_ > COUNTERS_PER_BLOCK) {
+    throw std::invalid_argument("BlockedCMSketch: depth must be in [1, " +
+                                std::to_string(COUNTERS_PER_BLOCK) + "]");
+  }
+  slice_ = COUNTERS_PER_BLOCK / depth_;
+  num_blocks_ = Util::NextPrime(
+      std::max<int64_t>(1, static_cast<int64_t>(depth) * width /
+                               COUNTERS_PER_BLOCK));
+
+  hash_fns_ = new hash_t[2];
+  // Allocate one aligned region, so every block is exactly one cache line
+  raw_ = new uint8_t[num_blocks_ * BLOCK_BYTES + BLOCK_BYTES]();
+  counter_ = reinterpret_cast<T *>(
+      (reinterpret_cast<uintptr_t>(raw_) + BLOCK_BYTES - 1) &
+      ~static_cast<uintptr_t>(BLOCK_BYTES - 1));
+}
+
+template <typename T, typename hash_t>
+BlockedCMSketch<T, hash_t>::~BlockedCMSketch() {
+  delete[] hash_fns_;
+  delete[] raw_;
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+T *BlockedCMSketch<T, hash_t>::locate(const FlowKey<key_len> &flowkey,
+                                      uint32_t &h1, uint32_t &h2) const {
+  int32_t block = hash_fns_[0](flowkey) % num_blocks_;
+  uint64_t h = hash_fns_[1](flowkey);
+  // double hashing: position in row i is (h1 + i * h2) % slice_
+  h1 = static_cast<uint32_t>(h);
+  h2 = static_cast<uint32_t>((h * 0x9e3779b97f4a7c15ULL) >> 32) | 1;
+  return counter_ + static_cast<int64_t>(block) * COUNTERS_PER_BLOCK;
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+void BlockedCMSketch<T, hash_t>::update(const FlowKey<key_len> &flowkey,
+                                        T val) {
+  uint32_t h1, h2;
+  T *block = locate(flowkey, h1, h2);
+  for (int32_t i = 0; i < depth_; ++i, h1 += h2) {
+    T &c = block[i * slice_ + h1 % slice_];
+    // saturate instead of wrapping around
+    c = (std::numeric_limits<T>::max() - c < val) ? std::numeric_limits<T>::max()
+                                                  : c + val;
+  }
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+T BlockedCMSketch<T, hash_t>::query(const FlowKey<key_len> &flowkey) const {
+  uint32_t h1, h2;
+  const T *block = locate(flowkey, h1, h2);
+  T min_val = std::numeric_limits<T>::max();
+  for (int32_t i = 0; i < depth_; ++i, h1 += h2) {
+    min_val = std::min(min_val, block[i * slice_ + h1 % slice_]);
+  }
+  return min_val;
+}
+
+template <typename T, typename hash_t>
+size_t BlockedCMSketch<T, hash_t>::size() const {
+  return sizeof(BlockedCMSketch<T, hash_t>) // Instance
+         + 2 * sizeof(hash_t)               // hash_fns
+         + num_blocks_ * BLOCK_BYTES;       // counter
+}
+
+template <typename T, typename hash_t>
+void BlockedCMSketch<T, hash_t>::clear() {
+  std::fill(counter_, counter_ + num_blocks_ * COUNTERS_PER_BLOCK, 0);
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_BLOCKEDCMSKETCH_H
@@ -0,0 +1,263 @@
+#ifndef SKETCHLAB_CPP_BLOCKEDCOUNTINGBLOOMFILTER_H
+#define SKETCHLAB_CPP_BLOCKEDCOUNTINGBLOOMFILTER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "hash.h"
+#include "util.h"
+
+namespace SketchLab {
+
+/*
+ * Cache-line blocked counting Bloom filter with BITS-bit counters (8 or 16).
+ *
+ * One hash picks a 64-byte block; the num_hash_ counters of a key are
+ * (a + j * b) % COUNTERS_PER_BLOCK inside it with b odd, so they are distinct
+ * and live in one cache line. With AVX2 the key becomes a lane mask over the
+ * whole block, and insert / remove are one saturating add / subtract per half
+ * block.
+ *
+ * Counters saturate and then stick, as in CountingBloomFilter: lost increments
+ * are counted in overflows() and remove() skips saturated counters. Like
+ * BlockedBloomFilter it trades a somewhat higher false positive rate for one
+ * memory access per operation.
+ */
+template <typename hash_t, int32_t BITS = 8> class BlockedCountingBloomFilter {
+  static_assert(BITS == 8 || BITS == 16, "counters are 8 or 16 bits");
+  typedef typename std::conditional<BITS == 8, uint8_t, uint16_t>::type
+      counter_t;
+
+  static const int32_t BLOCK_BYTES = 64;
+  static const int32_t COUNTERS_PER_BLOCK = BLOCK_BYTES / sizeof(counter_t);
+  static const int32_t LOG_COUNTERS = BITS == 8 ? 6 : 5;
+  static const counter_t MAX_VAL = static_cast<counter_t>(~counter_t(0));
+
+  int32_t num_blocks_;
+  int32_t num_hash_;
+  hash_t *hash_fns_;
+  int64_t overflows_;
+
+  uint8_t *raw_;
+  counter_t *counter_; // num_blocks_ * COUNTERS_PER_BLOCK, 64-byte aligned
+
+  template <int32_t key_len>
+  counter_t *locate(const FlowKey<key_len> &flowkey, uint32_t &a,
+                    uint32_t &b) const;
+#ifdef __AVX2__
+  // All ones on the counters of the key, one register per half block
+  void makeHit(uint32_t a, uint32_t b, __m256i *hit) const;
+#endif
+
+public:
+  BlockedCountingBloomFilter(int32_t nbuckets, int32_t num_hash);
+  ~BlockedCountingBloomFilter();
+  BlockedCountingBloomFilter(const BlockedCountingBloomFilter &) = delete;
+  BlockedCountingBloomFilter(BlockedCountingBloomFilter &&) = delete;
+  BlockedCountingBloomFilter &
+  operator=(BlockedCountingBloomFilter) = delete;
+
+  template <int32_t key_len> void insert(const FlowKey<key_len> &flowkey);
+  template <int32_t key_len> void remove(const FlowKey<key_len> &flowkey);
+  template <int32_t key_len> bool query(const FlowKey<key_len> &flowkey) const;
+  // Increments dropped because the counter was saturated, since clear()
+  int64_t overflows() const { return overflows_; }
+  std::size_t size() const;
+  void clear();
+};
+
+template <typename hash_t, int32_t BITS>
+BlockedCountingBloomFilter<hash_t, BITS>::BlockedCountingBloomFilter(
+    int32_t nbuckets, int32_t num_hash)
+    : num_hash_(num_hash), overflows_(0) {
+  if (num_hash_ <= 0 || num_hash_ > COUNTERS_PER_BLOCK) {
+    throw std::invalid_argument(
+        "BlockedCountingBloomFilter: num_hash must be in [1, " +
+        std::to_string(COUNTERS_PER_BLOCK) + "]");
+  }
+  num_blocks_ = Util::NextPrime(std::max<int32_t>(
+      1, (nbuckets + COUNTERS_PER_BLOCK - 1) / COUNTERS_PER_BLOCK));
+  hash_fns_ = new hash_t[1];
+  // Allocate one aligned region, so every block is exactly one cache line
+  raw_ = new uint8_t[static_cast<size_t>(num_blocks_) * BLOCK_BYTES +
+                     BLOCK_BYTES]();
+  counter_ = reinterpret_cast<counter_t *>(
+      (reinterpret_cast<uintptr_t>(raw_) + BLOCK_BYTES - 1) &
+      ~static_cast<uintptr_t>(BLOCK_BYTES - 1));
+}
+
+template <typename hash_t, int32_t BITS>
+BlockedCountingBloomFilter<hash_t, BITS>::~BlockedCountingBloomFilter() {
+  delete[] hash_fns_;
+  delete[] raw_;
+}
+
+template <typename hash_t, int32_t BITS>
+template <int32_t key_len>
+typename BlockedCountingBloomFilter<hash_t, BITS>::counter_t *
+BlockedCountingBloomFilter<hash_t, BITS>::locate(
+    const FlowKey<key_len> &flowkey, uint32_t &a, uint32_t &b) const {
+  uint64_t hash = hash_fns_[0](flowkey);
+  int64_t block = hash % num_blocks_;
+  // the top bits of the product are the well mixed ones
+  uint64_t mixed = hash * 0x9e3779b97f4a7c15ULL;
+  a = static_cast<uint32_t>(mixed >> (64 - LOG_COUNTERS));
+  b = static_cast<uint32_t>(mixed >> (64 - 2 * LOG_COUNTERS)) | 1;
+  return counter_ + block * COUNTERS_PER_BLOCK;
+}
+
+#ifdef __AVX2__
+template <typename hash_t, int32_t BITS>
+void BlockedCountingBloomFilter<hash_t, BITS>::makeHit(uint32_t a, uint32_t b,
+                                                       __m256i *hit) const {
+  const int32_t lanes = COUNTERS_PER_BLOCK / 2;
+  __m256i idx_lo, idx_hi;
+  if (BITS == 8) {
+    idx_lo = _mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14,
+                              15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26,
+                              27, 28, 29, 30, 31);
+    idx_hi = _mm256_add_epi8(idx_lo, _mm256_set1_epi8(lanes));
+  } else {
+    idx_lo = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+                               14, 15);
+    idx_hi = _mm256_add_epi16(idx_lo, _mm256_set1_epi16(lanes));
+  }
+  __m256i hit_lo = _mm256_setzero_si256(), hit_hi = _mm256_setzero_si256();
+  for (int32_t j = 0; j < num_hash_; ++j, a += b) {
+    int32_t pos = a & (COUNTERS_PER_BLOCK - 1);
+    if (BITS == 8) {
+      __m256i p = _mm256_set1_epi8(static_cast<char>(pos));
+      hit_lo = _mm256_or_si256(hit_lo, _mm256_cmpeq_epi8(idx_lo, p));
+      hit_hi = _mm256_or_si256(hit_hi, _mm256_cmpeq_epi8(idx_hi, p));
+    } else {
+      __m256i p = _mm256_set1_epi16(static_cast<short>(pos));
+      hit_lo = _mm256_or_si256(hit_lo, _mm256_cmpeq_epi16(idx_lo, p));
+      hit_hi = _mm256_or_si256(hit_hi, _mm256_cmpeq_epi16(idx_hi, p));
+    }
+  }
+  hit[0] = hit_lo;
+  hit[1] = hit_hi;
+}
+#endif
+
+template <typename hash_t, int32_t BITS>
+template <int32_t key_len>
+void BlockedCountingBloomFilter<hash_t, BITS>::insert(
+    const FlowKey<key_len> &flowkey) {
+  uint32_t a, b;
+  counter_t *block = locate(flowkey, a, b);
+#ifdef __AVX2__
+  __m256i hit[2];
+  makeHit(a, b, hit);
+  const __m256i full = _mm256_set1_epi8(-1);
+  const __m256i one = BITS == 8 ? _mm256_set1_epi8(1) : _mm256_set1_epi16(1);
+  for (int32_t h = 0; h < 2; ++h) {
+    __m256i *p = reinterpret_cast<__m256i *>(block) + h;
+    __m256i v = _mm256_load_si256(p);
+    __m256i lost = _mm256_and_si256(
+        hit[h], BITS == 8 ? _mm256_cmpeq_epi8(v, full)
+                          : _mm256_cmpeq_epi16(v, full));
+    overflows_ += __builtin_popcount(_mm256_movemask_epi8(lost)) /
+                  static_cast<int32_t>(sizeof(counter_t));
+    __m256i inc = _mm256_and_si256(hit[h], one);
+    v = BITS == 8 ? _mm256_adds_epu8(v, inc) : _mm256_adds_epu16(v, inc);
+    _mm256_store_si256(p, v);
+  }
+#else
+  for (int32_t j = 0; j < num_hash_; ++j, a += b) {
+    counter_t &c = block[a & (COUNTERS_PER_BLOCK - 1)];
+    if (c < MAX_VAL) {
+      ++c;
+    } else {
+      ++overflows_;
+    }
+  }
+#endif
+}
+
+template <typename hash_t, int32_t BITS>
+template <int32_t key_len>
+void BlockedCountingBloomFilter<hash_t, BITS>::remove(
+    const FlowKey<key_len> &flowkey) {
+  uint32_t a, b;
+  counter_t *block = locate(flowkey, a, b);
+#ifdef __AVX2__
+  __m256i hit[2];
+  makeHit(a, b, hit);
+  const __m256i full = _mm256_set1_epi8(-1);
+  const __m256i one = BITS == 8 ? _mm256_set1_epi8(1) : _mm256_set1_epi16(1);
+  for (int32_t h = 0; h < 2; ++h) {
+    __m256i *p = reinterpret_cast<__m256i *>(block) + h;
+    __m256i v = _mm256_load_si256(p);
+    // saturated counters stay put; subs clamps counters already at zero
+    __m256i stuck = BITS == 8 ? _mm256_cmpeq_epi8(v, full)
+                              : _mm256_cmpeq_epi16(v, full);
+    __m256i dec = _mm256_andnot_si256(stuck, _mm256_and_si256(hit[h], one));
+    v = BITS == 8 ? _mm256_subs_epu8(v, dec) : _mm256_subs_epu16(v, dec);
+    _mm256_store_si256(p, v);
+  }
+#else
+  for (int32_t j = 0; j < num_hash_; ++j, a += b) {
+    counter_t &c = block[a & (COUNTERS_PER_BLOCK - 1)];
+    if (c > 0 && c < MAX_VAL) {
+      --c;
+    }
+  }
+#endif
+}
+
+template <typename hash_t, int32_t BITS>
+template <int32_t key_len>
+bool BlockedCountingBloomFilter<hash_t, BITS>::query(
+    const FlowKey<key_len> &flowkey) const {
+  uint32_t a, b;
+  const counter_t *block = locate(flowkey, a, b);
+#ifdef __AVX2__
+  __m256i hit[2];
+  makeHit(a, b, hit);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i *p = reinterpret_cast<const __m256i *>(block);
+  __m256i empty_lo = BITS == 8
+                         ? _mm256_cmpeq_epi8(_mm256_load_si256(p), zero)
+                         : _mm256_cmpeq_epi16(_mm256_load_si256(p), zero);
+  __m256i empty_hi = BITS == 8
+                         ? _mm256_cmpeq_epi8(_mm256_load_si256(p + 1), zero)
+                         : _mm256_cmpeq_epi16(_mm256_load_si256(p + 1), zero);
+  return _mm256_testz_si256(empty_lo, hit[0]) &&
+         _mm256_testz_si256(empty_hi, hit[1]);
+#else
+  for (int32_t j = 0; j < num_hash_; ++j, a += b) {
+    if (block[a & (COUNTERS_PER_BLOCK - 1)] == 0) {
+      return false;
+    }
+  }
+  return true;
+#endif
+}
+
+template <typename hash_t, int32_t BITS>
+std::size_t BlockedCountingBloomFilter<hash_t, BITS>::size() const {
+  return sizeof(BlockedCountingBloomFilter<hash_t, BITS>) // Instance
+         + num_blocks_ * BLOCK_BYTES                      // counter
+         + sizeof(hash_t);                                // hash_fns
+}
+
+template <typename hash_t, int32_t BITS>
+void BlockedCountingBloomFilter<hash_t, BITS>::clear() {
+  std::fill(counter_,
+            counter_ + static_cast<size_t>(num_blocks_) * COUNTERS_PER_BLOCK,
+            0);
+  overflows_ = 0;
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_BLOCKEDCOUNTINGBLOOMFILTER_H
@@ -33,6 +33,14 @@ public:
 
   template <int32_t key_len> void insert(const FlowKey<key_len> &flowkey);
   template <int32_t key_len> bool query(const FlowKey<key_len> &flowkey) const;
+  // Hash a batch first and prefetch its bytes, then set / test them. Bit
+  // k % 64 of found[k / 64] is query(flowkeys[k]); found holds (n + 63) / 64
+  // words.
+  template <int32_t key_len>
+  void insertBatch(const FlowKey<key_len> *flowkeys, size_t n);
+  template <int32_t key_len>
+  void queryBatch(const FlowKey<key_len> *flowkeys, uint64_t *found,
+                  size_t n) const;
   std::size_t size() const;
   void clear();
 };
@@ -69,6 +77,65 @@ bool BloomFilter<hash_t>::query(const FlowKey<key_len> &flowkey) const {
   }
   return true;
 }
+template <typename hash_t>
+template <int32_t key_len>
+void BloomFilter<hash_t>::insertBatch(const FlowKey<key_len> *flowkeys,
+                                      size_t n) {
+  if (num_hash_ > Util::BATCH_INDEX_LIMIT) {
+    // one key's positions would not fit the chunk buffer
+    for (size_t k = 0; k < n; ++k) {
+      insert(flowkeys[k]);
+    }
+    return;
+  }
+  int32_t pos[Util::BATCH_INDEX_LIMIT];
+  const size_t chunk = Util::BATCH_INDEX_LIMIT / num_hash_;
+  for (size_t base = 0; base < n; base += chunk) {
+    size_t m = std::min(chunk, n - base);
+    int32_t *p = pos;
+    for (size_t k = 0; k < m; ++k) {
+      for (int32_t i = 0; i < num_hash_; ++i, ++p) {
+        *p = hash_fns_[i](flowkeys[base + k]) % nbits_;
+        Util::Prefetch(arr_ + BYTE(*p));
+      }
+    }
+    for (int32_t *q = pos; q != p; ++q) {
+      setBit(*q);
+    }
+  }
+}
+template <typename hash_t>
+template <int32_t key_len>
+void BloomFilter<hash_t>::queryBatch(const FlowKey<key_len> *flowkeys,
+                                     uint64_t *found, size_t n) const {
+  std::fill(found, found + (n + 63) / 64, 0);
+  if (num_hash_ > Util::BATCH_INDEX_LIMIT) {
+    for (size_t k = 0; k < n; ++k) {
+      found[k >> 6] |= static_cast<uint64_t>(query(flowkeys[k])) << (k & 63);
+    }
+    return;
+  }
+  int32_t pos[Util::BATCH_INDEX_LIMIT];
+  const size_t chunk = Util::BATCH_INDEX_LIMIT / num_hash_;
+  for (size_t base = 0; base < n; base += chunk) {
+    size_t m = std::min(chunk, n - base);
+    int32_t *p = pos;
+    for (size_t k = 0; k < m; ++k) {
+      for (int32_t i = 0; i < num_hash_; ++i, ++p) {
+        *p = hash_fns_[i](flowkeys[base + k]) % nbits_;
+        Util::Prefetch(arr_ + BYTE(*p));
+      }
+    }
+    p = pos;
+    for (size_t k = base; k < base + m; ++k, p += num_hash_) {
+      uint8_t all = 1;
+      for (int32_t i = 0; i < num_hash_; ++i) {
+        all &= getBit(p[i]);
+      }
+      found[k >> 6] |= static_cast<uint64_t>(all) << (k & 63);
+    }
+  }
+}
 template <typename hash_t> std::size_t BloomFilter<hash_t>::size() const {
   return sizeof(BloomFilter<hash_t>)   // Instance
          + nbytes_ * sizeof(uint8_t)   // arr_
@@ -6,38 +6,75 @@
 #define SKETCHLAB_CPP_CMSKETCH_H
 
 #include <algorithm>
+#include <limits>
 #include <memory>
+#include <stdexcept>
+#include <vector>
 
 #include "hash.h"
 #include "util.h"
 
 namespace SketchLab {
 
-template <typename T, typename hash_t> class CMSketch {
+template <typename T, typename hash_t, int32_t DEPTH = 0> class CMSketch {
 
   int32_t depth_;
   int32_t width_;
 
-  hash_t *hash_fns_;
+  // Row count; a compile-time constant when DEPTH > 0, so the per-row
+  // loops unroll and their indices stay in registers
+  int32_t depth() const { return DEPTH > 0 ? DEPTH : depth_; }
+
+  std::vector<hash_t> hash_fns_;
 
   T **counter_;
 
+  void checkCompatible(const CMSketch &other) const;
+
 public:
   CMSketch(int32_t depth, int32_t width);
+  CMSketch(const CMSketch &other);
+  CMSketch(CMSketch &&) = delete;
   ~CMSketch();
+  CMSketch &operator=(const CMSketch &) = delete;
 
   template <int32_t key_len>
   void update(const FlowKey<key_len> &flowkey, T val);
   template <int32_t key_len> T query(const FlowKey<key_len> &flowkey) const;
+  // Hash a batch first and prefetch its counters, then apply / read them.
+  // Results are identical to calling update / query once per key in order.
+  template <int32_t key_len>
+  void updateBatch(const FlowKey<key_len> *flowkeys, const T *vals, size_t n);
+  template <int32_t key_len>
+  void queryBatch(const FlowKey<key_len> *flowkeys, T *results,
+                  size_t n) const;
+  // Linear arithmetic on sketches with the same depth, width and hash
+  // functions, i.e. copies of one sketch (copy it, then clear() it to start
+  // a new epoch). Operands that differ throw std::invalid_argument.
+  bool compatible(const CMSketch &other) const;
+  CMSketch &operator+=(const CMSketch &other);
+  CMSketch &operator-=(const CMSketch &other);
+  CMSketch &operator*=(double scale);
+  // *this = coeffs[0] * sketches[0] + ... + coeffs[n - 1] * sketches[n - 1]
+  void combine(const double *coeffs, const CMSketch *const *sketches,
+               int32_t n);
+
   size_t size() const;
   void clear();
 };
 
-template <typename T, typename hash_t>
-CMSketch<T, hash_t>::CMSketch(int32_t depth, int32_t width)
+// Depth fixed at compile time, e.g. CMSketchN<T, hash_t, 4>
+template <typename T, typename hash_t, int32_t depth>
+using CMSketchN = CMSketch<T, hash_t, depth>;
+
+template <typename T, typename hash_t, int32_t DEPTH>
+CMSketch<T, hash_t, DEPTH>::CMSketch(int32_t depth, int32_t width)
     : depth_(depth), width_(Util::NextPrime(width)) {
+  if (DEPTH > 0 && depth != DEPTH) {
+    throw std::invalid_argument("CMSketch: depth does not match DEPTH");
+  }
 
-  hash_fns_ = new hash_t[depth_];
+  hash_fns_.resize(depth_);
   // Allocate continuous memory
   counter_ = new T *[depth_];
   counter_[0] = new T[depth_ * width_](); // Init with zero
@@ -46,42 +83,186 @@ CMSketch<T, hash_t>::CMSketch(int32_t depth, int32_t width)
   }
 }
 
-template <typename T, typename hash_t> CMSketch<T, hash_t>::~CMSketch() {
-  delete[] hash_fns_;
+template <typename T, typename hash_t, int32_t DEPTH>
+CMSketch<T, hash_t, DEPTH>::CMSketch(const CMSketch &other)
+    : depth_(other.depth_), width_(other.width_),
+      hash_fns_(other.hash_fns_) {
+  counter_ = new T *[depth_];
+  counter_[0] = new T[depth_ * width_];
+  for (int32_t i = 1; i < depth_; ++i) {
+    counter_[i] = counter_[i - 1] + width_;
+  }
+  std::copy(other.counter_[0], other.counter_[0] + depth_ * width_,
+            counter_[0]);
+}
 
+template <typename T, typename hash_t, int32_t DEPTH>
+CMSketch<T, hash_t, DEPTH>::~CMSketch() {
   delete[] counter_[0];
   delete[] counter_;
 }
 
-template <typename T, typename hash_t>
+template <typename T, typename hash_t, int32_t DEPTH>
 template <int32_t key_len>
-void CMSketch<T, hash_t>::update(const FlowKey<key_len> &flowkey, T val) {
-  for (int32_t i = 0; i < depth_; ++i) {
+void CMSketch<T, hash_t, DEPTH>::update(const FlowKey<key_len> &flowkey,
+                                        T val) {
+  for (int32_t i = 0; i < depth(); ++i) {
     int32_t index = hash_fns_[i](flowkey) % width_;
     counter_[i][index] += val;
   }
 }
 
-template <typename T, typename hash_t>
+template <typename T, typename hash_t, int32_t DEPTH>
 template <int32_t key_len>
-T CMSketch<T, hash_t>::query(const FlowKey<key_len> &flowkey) const {
+T CMSketch<T, hash_t, DEPTH>::query(const FlowKey<key_len> &flowkey) const {
   T min_val = std::numeric_limits<T>::max();
-  for (int32_t i = 0; i < depth_; ++i) {
+  for (int32_t i = 0; i < depth(); ++i) {
     int32_t idx = hash_fns_[i](flowkey) % width_;
     min_val = std::min(min_val, counter_[i][idx]);
   }
   return min_val;
 }
 
-template <typename T, typename hash_t>
-size_t CMSketch<T, hash_t>::size() const {
-  return sizeof(CMSketch<T, hash_t>)    // Instance
-         + depth_ * sizeof(hash_t)      // hash_fns
-         + depth_ * width_ * sizeof(T); // counter
+template <typename T, typename hash_t, int32_t DEPTH>
+template <int32_t key_len>
+void CMSketch<T, hash_t, DEPTH>::updateBatch(const FlowKey<key_len> *flowkeys,
+                                             const T *vals, size_t n) {
+  if (depth() > Util::BATCH_INDEX_LIMIT) {
+    // one key's indices would not fit the chunk buffer
+    for (size_t k = 0; k < n; ++k) {
+      update(flowkeys[k], vals[k]);
+    }
+    return;
+  }
+  int32_t index[Util::BATCH_INDEX_LIMIT];
+  const size_t chunk = std::max(1, Util::BATCH_INDEX_LIMIT / depth());
+  for (size_t base = 0; base < n; base += chunk) {
+    size_t m = std::min(chunk, n - base);
+    for (size_t k = 0; k < m; ++k) {
+      for (int32_t i = 0; i < depth(); ++i) {
+        int32_t idx = hash_fns_[i](flowkeys[base + k]) % width_;
+        index[k * depth() + i] = idx;
+        Util::Prefetch(&counter_[i][idx]);
+      }
+    }
+    for (size_t k = 0; k < m; ++k) {
+      for (int32_t i = 0; i < depth(); ++i) {
+        counter_[i][index[k * depth() + i]] += vals[base + k];
+      }
+    }
+  }
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+template <int32_t key_len>
+void CMSketch<T, hash_t, DEPTH>::queryBatch(const FlowKey<key_len> *flowkeys,
+                                            T *results, size_t n) const {
+  if (depth() > Util::BATCH_INDEX_LIMIT) {
+    // one key's indices would not fit the chunk buffer
+    for (size_t k = 0; k < n; ++k) {
+      results[k] = query(flowkeys[k]);
+    }
+    return;
+  }
+  int32_t index[Util::BATCH_INDEX_LIMIT];
+  const size_t chunk = std::max(1, Util::BATCH_INDEX_LIMIT / depth());
+  for (size_t base = 0; base < n; base += chunk) {
+    size_t m = std::min(chunk, n - base);
+    for (size_t k = 0; k < m; ++k) {
+      for (int32_t i = 0; i < depth(); ++i) {
+        int32_t idx = hash_fns_[i](flowkeys[base + k]) % width_;
+        index[k * depth() + i] = idx;
+        Util::Prefetch(&counter_[i][idx]);
+      }
+    }
+    for (size_t k = 0; k < m; ++k) {
+      T min_val = std::numeric_limits<T>::max();
+      for (int32_t i = 0; i < depth(); ++i) {
+        min_val = std::min(min_val, counter_[i][index[k * depth() + i]]);
+      }
+      results[base + k] = min_val;
+    }
+  }
 }
 
-template <typename T, typename hash_t> void CMSketch<T, hash_t>::clear() {
-  std::fill(counter_[0], counter_[0] + depth_ * width_, 0);
+template <typename T, typename hash_t, int32_t DEPTH>
+size_t CMSketch<T, hash_t, DEPTH>::size() const {
+  return sizeof(CMSketch<T, hash_t, DEPTH>) // Instance
+         + depth() * sizeof(hash_t)         // hash_fns
+         + depth() * width_ * sizeof(T);    // counter
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void CMSketch<T, hash_t, DEPTH>::clear() {
+  std::fill(counter_[0], counter_[0] + depth() * width_, 0);
+}
+
+
+template <typename T, typename hash_t, int32_t DEPTH>
+bool CMSketch<T, hash_t, DEPTH>::compatible(const CMSketch &other) const {
+  return depth() == other.depth() && width_ == other.width_ &&
+         Util::SameHashes(hash_fns_.data(), other.hash_fns_.data(), depth());
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void CMSketch<T, hash_t, DEPTH>::checkCompatible(const CMSketch &other) const {
+  if (!compatible(other)) {
+    throw std::invalid_argument(
+        "CMSketch: operands differ in dimensions or hash functions");
+  }
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+CMSketch<T, hash_t, DEPTH> &
+CMSketch<T, hash_t, DEPTH>::operator+=(const CMSketch &other) {
+  checkCompatible(other);
+  T *dst = counter_[0];
+  const T *src = other.counter_[0];
+  // plain contiguous loop, left to the auto-vectorizer
+  for (int64_t i = 0, n = int64_t(depth()) * width_; i < n; ++i) {
+    dst[i] += src[i];
+  }
+  return *this;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+CMSketch<T, hash_t, DEPTH> &
+CMSketch<T, hash_t, DEPTH>::operator-=(const CMSketch &other) {
+  checkCompatible(other);
+  T *dst = counter_[0];
+  const T *src = other.counter_[0];
+  for (int64_t i = 0, n = int64_t(depth()) * width_; i < n; ++i) {
+    dst[i] -= src[i];
+  }
+  return *this;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+CMSketch<T, hash_t, DEPTH> &
+CMSketch<T, hash_t, DEPTH>::operator*=(double scale) {
+  T *dst = counter_[0];
+  for (int64_t i = 0, n = int64_t(depth()) * width_; i < n; ++i) {
+    dst[i] = static_cast<T>(dst[i] * scale);
+  }
+  return *this;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void CMSketch<T, hash_t, DEPTH>::combine(const double *coeffs,
+                                         const CMSketch *const *sketches,
+                                         int32_t n) {
+  for (int32_t k = 0; k < n; ++k) {
+    checkCompatible(*sketches[k]);
+  }
+  // counter by counter, so *this may also appear among the operands
+  T *dst = counter_[0];
+  for (int64_t i = 0, m = int64_t(depth()) * width_; i < m; ++i) {
+    double acc = 0;
+    for (int32_t k = 0; k < n; ++k) {
+      acc += coeffs[k] * sketches[k]->counter_[0][i];
+    }
+    dst[i] = static_cast<T>(acc);
+  }
 }
 
 } // namespace SketchLab
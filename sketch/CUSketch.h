@@ -6,18 +6,38 @@
 #include <algorithm>
 #include <limits>
 #include <memory>
+#include <stdexcept>
 
 namespace SketchLab {
 
-template <typename T, typename hash_t> class CUSketch {
+/*
+ * Conservative-update sketch.
+ *
+ * update() keeps its row offsets on the stack, so it does not touch shared
+ * scratch state; depth is limited to MAX_DEPTH for that. The batched forms
+ * hash a whole chunk and prefetch its counters before applying it.
+ */
+template <typename T, typename hash_t, int32_t DEPTH = 0> class CUSketch {
+public:
+  static const int32_t MAX_DEPTH = Util::MAX_DEPTH;
 
+private:
   int32_t depth_;
   int32_t width_;
 
+  // Row count; a compile-time constant when DEPTH > 0, so the per-row
+  // loops unroll and their indices stay in registers
+  int32_t depth() const { return DEPTH > 0 ? DEPTH : depth_; }
+
   hash_t *hash_fns_;
 
   T **counter_;
-  int32_t *indexs_;
+
+  // offset[i] = i * width_ + column of row i, relative to counter_[0]
+  template <int32_t key_len>
+  void locate(const FlowKey<key_len> &flowkey, int32_t *offset) const;
+  T gatherMin(const int32_t *offset) const;
+  void scatterMax(const int32_t *offset, T val);
 
 public:
   CUSketch(int32_t depth, int32_t width);
@@ -26,13 +46,31 @@ public:
   template <int32_t key_len>
   void update(const FlowKey<key_len> &flowkey, T val);
   template <int32_t key_len> T query(const FlowKey<key_len> &flowkey) const;
+  // Hash a batch first and prefetch its counters, then apply / read them.
+  // Results are identical to calling update / query once per key in order.
+  template <int32_t key_len>
+  void updateBatch(const FlowKey<key_len> *flowkeys, const T *vals, size_t n);
+  template <int32_t key_len>
+  void queryBatch(const FlowKey<key_len> *flowkeys, T *results,
+                  size_t n) const;
   size_t size() const;
   void clear();
 };
 
-template <typename T, typename hash_t>
-CUSketch<T, hash_t>::CUSketch(int32_t depth, int32_t width)
+// Depth fixed at compile time, e.g. CUSketchN<T, hash_t, 4>
+template <typename T, typename hash_t, int32_t depth>
+using CUSketchN = CUSketch<T, hash_t, depth>;
+
+template <typename T, typename hash_t, int32_t DEPTH>
+CUSketch<T, hash_t, DEPTH>::CUSketch(int32_t depth, int32_t width)
     : depth_(depth), width_(Util::NextPrime(width)) {
+  if (DEPTH > 0 && depth != DEPTH) {
+    throw std::invalid_argument("CUSketch: depth does not match DEPTH");
+  }
+  if (depth_ <= 0 || depth_ > MAX_DEPTH) {
+    throw std::invalid_argument("CUSketch: depth must be in [1, " +
+                                std::to_string(MAX_DEPTH) + "]");
+  }
 
   hash_fns_ = new hash_t[depth_];
 
@@ -42,52 +80,121 @@ CUSketch<T, hash_t>::CUSketch(int32_t depth, int32_t width)
   for (int32_t i = 1; i < depth_; ++i) {
     counter_[i] = counter_[i - 1] + width_;
   }
-  indexs_ = new int32_t[depth_];
 }
 
-template <typename T, typename hash_t> CUSketch<T, hash_t>::~CUSketch() {
+template <typename T, typename hash_t, int32_t DEPTH>
+CUSketch<T, hash_t, DEPTH>::~CUSketch() {
   delete[] hash_fns_;
 
   delete[] counter_[0];
   delete[] counter_;
-  delete[] indexs_;
 }
 
-template <typename T, typename hash_t>
+template <typename T, typename hash_t, int32_t DEPTH>
 template <int32_t key_len>
-void CUSketch<T, hash_t>::update(const FlowKey<key_len> &flowkey, T val) {
+void CUSketch<T, hash_t, DEPTH>::locate(const FlowKey<key_len> &flowkey,
+                                        int32_t *offset) const {
+  for (int32_t i = 0; i < depth(); ++i) {
+    offset[i] = i * width_ + hash_fns_[i](flowkey) % width_;
+  }
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+T CUSketch<T, hash_t, DEPTH>::gatherMin(const int32_t *offset) const {
+  const T *base = counter_[0];
   T min_val = std::numeric_limits<T>::max();
-  for (int32_t i = 0; i < depth_; ++i) {
-    int32_t idx = hash_fns_[i](flowkey) % width_;
-    indexs_[i] = idx;
-    min_val = std::min(min_val, counter_[i][idx]);
+  for (int32_t i = 0; i < depth(); ++i) {
+    min_val = std::min(min_val, base[offset[i]]);
+  }
+  return min_val;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void CUSketch<T, hash_t, DEPTH>::scatterMax(const int32_t *offset, T val) {
+  T *base = counter_[0];
+  for (int32_t i = 0; i < depth(); ++i) {
+    // branch-free: whether a row gets raised is unpredictable
+    base[offset[i]] = std::max(val, base[offset[i]]);
   }
-  min_val += val;
-  for (int32_t i = 0; i < depth_; ++i) {
-    counter_[i][indexs_[i]] = std::max(min_val, counter_[i][indexs_[i]]);
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+template <int32_t key_len>
+void CUSketch<T, hash_t, DEPTH>::update(const FlowKey<key_len> &flowkey,
+                                        T val) {
+  int32_t offset[MAX_DEPTH];
+  T min_val = std::numeric_limits<T>::max();
+  // read each row as soon as it is hashed, the loads overlap the next hash
+  for (int32_t i = 0; i < depth(); ++i) {
+    offset[i] = i * width_ + hash_fns_[i](flowkey) % width_;
+    min_val = std::min(min_val, counter_[0][offset[i]]);
   }
+  scatterMax(offset, min_val + val);
 }
 
-template <typename T, typename hash_t>
+template <typename T, typename hash_t, int32_t DEPTH>
 template <int32_t key_len>
-T CUSketch<T, hash_t>::query(const FlowKey<key_len> &flowkey) const {
+T CUSketch<T, hash_t, DEPTH>::query(const FlowKey<key_len> &flowkey) const {
   T min_val = std::numeric_limits<T>::max();
-  for (int32_t i = 0; i < depth_; ++i) {
+  for (int32_t i = 0; i < depth(); ++i) {
     int32_t idx = hash_fns_[i](flowkey) % width_;
     min_val = std::min(min_val, counter_[i][idx]);
   }
   return min_val;
 }
 
-template <typename T, typename hash_t>
-size_t CUSketch<T, hash_t>::size() const {
-  return sizeof(CUSketch<T, hash_t>)    // Instance
-         + depth_ * sizeof(hash_t)      // hash_fns
-         + depth_ * width_ * sizeof(T); // counter
+template <typename T, typename hash_t, int32_t DEPTH>
+template <int32_t key_len>
+void CUSketch<T, hash_t, DEPTH>::updateBatch(const FlowKey<key_len> *flowkeys,
+                                             const T *vals, size_t n) {
+  int32_t offset[Util::BATCH_INDEX_LIMIT];
+  const size_t chunk = Util::BATCH_INDEX_LIMIT / depth();
+  for (size_t base = 0; base < n; base += chunk) {
+    size_t m = std::min(chunk, n - base);
+    for (size_t k = 0; k < m; ++k) {
+      locate(flowkeys[base + k], offset + k * depth());
+      for (int32_t i = 0; i < depth(); ++i) {
+        Util::Prefetch(counter_[0] + offset[k * depth() + i]);
+      }
+    }
+    // conservative update depends on the order, so apply key by key
+    for (size_t k = 0; k < m; ++k) {
+      const int32_t *row = offset + k * depth();
+      scatterMax(row, gatherMin(row) + vals[base + k]);
+    }
+  }
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+template <int32_t key_len>
+void CUSketch<T, hash_t, DEPTH>::queryBatch(const FlowKey<key_len> *flowkeys,
+                                            T *results, size_t n) const {
+  int32_t offset[Util::BATCH_INDEX_LIMIT];
+  const size_t chunk = Util::BATCH_INDEX_LIMIT / depth();
+  for (size_t base = 0; base < n; base += chunk) {
+    size_t m = std::min(chunk, n - base);
+    for (size_t k = 0; k < m; ++k) {
+      locate(flowkeys[base + k], offset + k * depth());
+      for (int32_t i = 0; i < depth(); ++i) {
+        Util::Prefetch(counter_[0] + offset[k * depth() + i]);
+      }
+    }
+    for (size_t k = 0; k < m; ++k) {
+      results[base + k] = gatherMin(offset + k * depth());
+    }
+  }
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+size_t CUSketch<T, hash_t, DEPTH>::size() const {
+  return sizeof(CUSketch<T, hash_t, DEPTH>) // Instance
+         + depth() * sizeof(hash_t)         // hash_fns
+         + depth() * width_ * sizeof(T);    // counter
 }
 
-template <typename T, typename hash_t> void CUSketch<T, hash_t>::clear() {
-  std::fill(counter_[0], counter_[0] + depth_ * width_, 0);
+template <typename T, typename hash_t, int32_t DEPTH>
+void CUSketch<T, hash_t, DEPTH>::clear() {
+  std::fill(counter_[0], counter_[0] + depth() * width_, 0);
 }
 
 } // namespace SketchLab
@@ -0,0 +1,174 @@
+#ifndef SKETCHLAB_CPP_CONCURRENTCMSKETCH_H
+#define SKETCHLAB_CPP_CONCURRENTCMSKETCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <type_traits>
+
+#include "FlatHashMap.h"
+#include "hash.h"
+#include "util.h"
+
+namespace SketchLab {
+
+/*
+ * Count-Min shared by several writer threads.
+ *
+ * Counters are std::atomic<T> updated with relaxed fetch_add, so any number of
+ * threads may call update() and query() concurrently on one instance. A query
+ * racing with updates sees each row at some point in time; since counters only
+ * grow, the result is never above the value after all finished updates and
+ * never below the value before them.
+ *
+ * Writer is an optional per-thread front end: it aggregates updates of the
+ * same key in a small direct-mapped buffer and pushes them to the shared
+ * counters on eviction or flush(). Heavy flows then cost one atomic add per
+ * row per eviction instead of per packet, which removes most cache-line
+ * ping-pong between cores. Until flushed, buffered counts are invisible to
+ * query().
+ *
+ * clear() must not run concurrently with other operations.
+ */
+template <typename T, typename hash_t> class ConcurrentCMSketch {
+  static_assert(std::is_integral<T>::value,
+                "ConcurrentCMSketch needs an integral counter type");
+
+  int32_t depth_;
+  int32_t width_;
+
+  hash_t *hash_fns_;
+
+  std::atomic<T> *counter_; // depth_ * width_, row major
+
+public:
+  ConcurrentCMSketch(int32_t depth, int32_t width);
+  ~ConcurrentCMSketch();
+  ConcurrentCMSketch(const ConcurrentCMSketch &) = delete;
+  ConcurrentCMSketch(ConcurrentCMSketch &&) = delete;
+  ConcurrentCMSketch &operator=(ConcurrentCMSketch) = delete;
+
+  template <int32_t key_len>
+  void update(const FlowKey<key_len> &flowkey, T val);
+  template <int32_t key_len> T query(const FlowKey<key_len> &flowkey) const;
+  size_t size() const;
+  void clear();
+
+  template <int32_t key_len> class Writer {
+    struct Pending {
+      FlowKey<key_len> flowkey;
+      T val;
+    };
+    ConcurrentCMSketch &sketch_;
+    int32_t num_slots_;
+    Pending *slots_;
+
+  public:
+    Writer(ConcurrentCMSketch &sketch, int32_t num_slots = 64);
+    ~Writer();
+    Writer(const Writer &) = delete;
+    Writer &operator=(const Writer &) = delete;
+
+    void update(const FlowKey<key_len> &flowkey, T val);
+    void flush();
+  };
+};
+
+template <typename T, typename hash_t>
+ConcurrentCMSketch<T, hash_t>::ConcurrentCMSketch(int32_t depth, int32_t width)
+    : depth_(depth), width_(Util::NextPrime(width)) {
+
+  hash_fns_ = new hash_t[depth_];
+  // Allocate continuous memory
+  counter_ = new std::atomic<T>[depth_ * width_];
+  clear();
+}
+
+template <typename T, typename hash_t>
+ConcurrentCMSketch<T, hash_t>::~ConcurrentCMSketch() {
+  delete[] hash_fns_;
+  delete[] counter_;
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+void ConcurrentCMSketch<T, hash_t>::update(const FlowKey<key_len> &flowkey,
+                                           T val) {
+  for (int32_t i = 0; i < depth_; ++i) {
+    int32_t index = hash_fns_[i](flowkey) % width_;
+    counter_[i * width_ + index].fetch_add(val, std::memory_order_relaxed);
+  }
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+T ConcurrentCMSketch<T, hash_t>::query(const FlowKey<key_len> &flowkey) const {
+  T min_val = std::numeric_limits<T>::max();
+  for (int32_t i = 0; i < depth_; ++i) {
+    int32_t idx = hash_fns_[i](flowkey) % width_;
+    min_val = std::min(min_val,
+                       counter_[i * width_ + idx].load(std::memory_order_relaxed));
+  }
+  return min_val;
+}
+
+template <typename T, typename hash_t>
+size_t ConcurrentCMSketch<T, hash_t>::size() const {
+  return sizeof(ConcurrentCMSketch<T, hash_t>)       // Instance
+         + depth_ * sizeof(hash_t)                   // hash_fns
+         + depth_ * width_ * sizeof(std::atomic<T>); // counter
+}
+
+template <typename T, typename hash_t>
+void ConcurrentCMSketch<T, hash_t>::clear() {
+  for (int32_t i = 0; i < depth_ * width_; ++i) {
+    counter_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+ConcurrentCMSketch<T, hash_t>::Writer<key_len>::Writer(
+    ConcurrentCMSketch &sketch, int32_t num_slots)
+    : sketch_(sketch), num_slots_(num_slots) {
+  slots_ = new Pending[num_slots_]();
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+ConcurrentCMSketch<T, hash_t>::Writer<key_len>::~Writer() {
+  flush();
+  delete[] slots_;
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+void ConcurrentCMSketch<T, hash_t>::Writer<key_len>::update(
+    const FlowKey<key_len> &flowkey, T val) {
+  Pending &slot = slots_[FlatHash::HashKey(flowkey) % num_slots_];
+  if (slot.val != 0 && slot.flowkey == flowkey) {
+    slot.val += val;
+    return;
+  }
+  // evict the previous key of this slot
+  if (slot.val != 0) {
+    sketch_.update(slot.flowkey, slot.val);
+  }
+  slot.flowkey = flowkey;
+  slot.val = val;
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+void ConcurrentCMSketch<T, hash_t>::Writer<key_len>::flush() {
+  for (int32_t i = 0; i < num_slots_; ++i) {
+    if (slots_[i].val != 0) {
+      sketch_.update(slots_[i].flowkey, slots_[i].val);
+      slots_[i].val = 0;
+    }
+  }
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_CONCURRENTCMSKETCH_H
@@ -3,93 +3,274 @@
 
 #include <algorithm>
 #include <memory>
+#include <stdexcept>
+#include <vector>
 
 #include "hash.h"
 #include "util.h"
 
 namespace SketchLab {
 
-template <typename T, typename hash_t> class CountSketch {
+template <typename T, typename hash_t, int32_t DEPTH = 0> class CountSketch {
 private:
   int depth_;
   int width_;
 
-  hash_t *hash_fns_;
+  // Row count; a compile-time constant when DEPTH > 0, so the per-row
+  // loops unroll and their indices stay in registers
+  int32_t depth() const { return DEPTH > 0 ? DEPTH : depth_; }
+
+  std::vector<hash_t> hash_fns_;
 
   T **arr_;
-  T *values_;
+
+  T median(T *values) const;
+
+  void checkCompatible(const CountSketch &other) const;
 
 public:
   CountSketch(int depth, int width);
   ~CountSketch();
-  CountSketch(const CountSketch &) = delete;
+  CountSketch(const CountSketch &other);
   CountSketch(CountSketch &&) = delete;
   CountSketch &operator=(CountSketch) = delete;
 
   template <int32_t key_len>
   void update(const FlowKey<key_len> &flowkey, T val);
   template <int32_t key_len> T query(const FlowKey<key_len> &flowkey) const;
+  // Hash a batch first and prefetch its counters, then apply / read them.
+  // Results are identical to calling update / query once per key in order.
+  template <int32_t key_len>
+  void updateBatch(const FlowKey<key_len> *flowkeys, const T *vals, size_t n);
+  template <int32_t key_len>
+  void queryBatch(const FlowKey<key_len> *flowkeys, T *results,
+                  size_t n) const;
+  // Linear arithmetic on sketches with the same depth, width and hash
+  // functions, i.e. copies of one sketch (copy it, then clear() it to start
+  // a new epoch). Operands that differ throw std::invalid_argument.
+  bool compatible(const CountSketch &other) const;
+  CountSketch &operator+=(const CountSketch &other);
+  CountSketch &operator-=(const CountSketch &other);
+  CountSketch &operator*=(double scale);
+  // *this = coeffs[0] * sketches[0] + ... + coeffs[n - 1] * sketches[n - 1]
+  void combine(const double *coeffs, const CountSketch *const *sketches,
+               int32_t n);
+
   std::size_t size() const;
   void clear();
 };
 
-template <typename T, typename hash_t>
-CountSketch<T, hash_t>::CountSketch(int depth, int width)
+// Depth fixed at compile time, e.g. CountSketchN<T, hash_t, 4>
+template <typename T, typename hash_t, int32_t depth>
+using CountSketchN = CountSketch<T, hash_t, depth>;
+
+template <typename T, typename hash_t, int32_t DEPTH>
+CountSketch<T, hash_t, DEPTH>::CountSketch(int depth, int width)
     : depth_(depth), width_(Util::NextPrime(width)) {
+  if (DEPTH > 0 && depth != DEPTH) {
+    throw std::invalid_argument("CountSketch: depth does not match DEPTH");
+  }
+  if (depth_ <= 0 || depth_ > Util::MAX_DEPTH) {
+    throw std::invalid_argument("CountSketch: depth must be in [1, " +
+                                std::to_string(Util::MAX_DEPTH) + "]");
+  }
 
   // hash funcs
-  hash_fns_ = new hash_t[depth_ << 1];
+  hash_fns_.resize(depth_ << 1);
 
   // Allocate continuous memory
   arr_ = new T *[depth_];
-  arr_[0] = new T[depth_ * width_];
+  arr_[0] = new T[depth_ * width_](); // Init with zero
   for (int i = 1; i < depth_; ++i) {
     arr_[i] = arr_[i - 1] + width_;
   }
-  values_ = new T[depth_];
 }
 
-template <typename T, typename hash_t> CountSketch<T, hash_t>::~CountSketch() {
-  delete[] hash_fns_;
+template <typename T, typename hash_t, int32_t DEPTH>
+CountSketch<T, hash_t, DEPTH>::CountSketch(const CountSketch &other)
+    : depth_(other.depth_), width_(other.width_),
+      hash_fns_(other.hash_fns_) {
+  arr_ = new T *[depth_];
+  arr_[0] = new T[depth_ * width_];
+  for (int32_t i = 1; i < depth_; ++i) {
+    arr_[i] = arr_[i - 1] + width_;
+  }
+  std::copy(other.arr_[0], other.arr_[0] + depth_ * width_, arr_[0]);
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+CountSketch<T, hash_t, DEPTH>::~CountSketch() {
   delete[] arr_[0];
   delete[] arr_;
-  delete[] values_;
 }
 
-template <typename T, typename hash_t>
+template <typename T, typename hash_t, int32_t DEPTH>
 template <int32_t key_len>
-void CountSketch<T, hash_t>::update(const FlowKey<key_len> &flowkey, T val) {
-  for (int i = 0; i < depth_; ++i) {
+void CountSketch<T, hash_t, DEPTH>::update(const FlowKey<key_len> &flowkey,
+                                           T val) {
+  for (int i = 0; i < depth(); ++i) {
     int idx = hash_fns_[i](flowkey) % width_;
     arr_[i][idx] +=
-        val * (static_cast<int>(hash_fns_[depth_ + i](flowkey) & 1) * 2 - 1);
+        val * (static_cast<int>(hash_fns_[depth() + i](flowkey) & 1) * 2 - 1);
   }
 }
 
-template <typename T, typename hash_t>
+template <typename T, typename hash_t, int32_t DEPTH>
 template <int32_t key_len>
-T CountSketch<T, hash_t>::query(const FlowKey<key_len> &flowkey) const {
-  for (int i = 0; i < depth_; ++i) {
+T CountSketch<T, hash_t, DEPTH>::query(const FlowKey<key_len> &flowkey) const {
+  T values[Util::MAX_DEPTH];
+  for (int i = 0; i < depth(); ++i) {
     int idx = hash_fns_[i](flowkey) % width_;
-    values_[i] = arr_[i][idx] *
-                 (static_cast<int>(hash_fns_[depth_ + i](flowkey) & 1) * 2 - 1);
+    values[i] = arr_[i][idx] *
+                (static_cast<int>(hash_fns_[depth() + i](flowkey) & 1) * 2 - 1);
+  }
+  return median(values);
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+T CountSketch<T, hash_t, DEPTH>::median(T *values) const {
+  return std::abs(Util::Median(values, depth()));
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+template <int32_t key_len>
+void CountSketch<T, hash_t, DEPTH>::updateBatch(
+    const FlowKey<key_len> *flowkeys, const T *vals, size_t n) {
+  int32_t index[Util::BATCH_INDEX_LIMIT];
+  int sign[Util::BATCH_INDEX_LIMIT];
+  const size_t chunk = std::max(1, Util::BATCH_INDEX_LIMIT / depth());
+  for (size_t base = 0; base < n; base += chunk) {
+    size_t m = std::min(chunk, n - base);
+    for (size_t k = 0; k < m; ++k) {
+      for (int i = 0; i < depth(); ++i) {
+        int idx = hash_fns_[i](flowkeys[base + k]) % width_;
+        index[k * depth() + i] = idx;
+        sign[k * depth() + i] =
+            static_cast<int>(hash_fns_[depth() + i](flowkeys[base + k]) & 1) *
+                2 -
+            1;
+        Util::Prefetch(&arr_[i][idx]);
+      }
+    }
+    for (size_t k = 0; k < m; ++k) {
+      for (int i = 0; i < depth(); ++i) {
+        arr_[i][index[k * depth() + i]] +=
+            vals[base + k] * sign[k * depth() + i];
+      }
+    }
   }
-  std::sort(values_, values_ + depth_);
-  if (!(depth_ & 1)) { //偶数
-    return std::abs((values_[depth_ / 2 - 1] + values_[depth_ / 2]) / 2);
-  } else { //奇数
-    return std::abs(values_[depth_ / 2]);
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+template <int32_t key_len>
+void CountSketch<T, hash_t, DEPTH>::queryBatch(const FlowKey<key_len> *flowkeys,
+                                               T *results, size_t n) const {
+  int32_t index[Util::BATCH_INDEX_LIMIT];
+  int sign[Util::BATCH_INDEX_LIMIT];
+  T values[Util::MAX_DEPTH];
+  const size_t chunk = std::max(1, Util::BATCH_INDEX_LIMIT / depth());
+  for (size_t base = 0; base < n; base += chunk) {
+    size_t m = std::min(chunk, n - base);
+    for (size_t k = 0; k < m; ++k) {
+      for (int i = 0; i < depth(); ++i) {
+        int idx = hash_fns_[i](flowkeys[base + k]) % width_;
+        index[k * depth() + i] = idx;
+        sign[k * depth() + i] =
+            static_cast<int>(hash_fns_[depth() + i](flowkeys[base + k]) & 1) *
+                2 -
+            1;
+        Util::Prefetch(&arr_[i][idx]);
+      }
+    }
+    for (size_t k = 0; k < m; ++k) {
+      for (int i = 0; i < depth(); ++i) {
+        values[i] = arr_[i][index[k * depth() + i]] * sign[k * depth() + i];
+      }
+      results[base + k] = median(values);
+    }
+  }
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+std::size_t CountSketch<T, hash_t, DEPTH>::size() const {
+  return sizeof(CountSketch<T, hash_t, DEPTH>) +
+         (depth() << 1) * sizeof(hash_t) +
+         depth() * width_ * sizeof(T);
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void CountSketch<T, hash_t, DEPTH>::clear() {
+  std::fill(arr_[0], arr_[0] + depth() * width_, 0);
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+bool CountSketch<T, hash_t, DEPTH>::compatible(const CountSketch &other) const {
+  return depth() == other.depth() && width_ == other.width_ &&
+         Util::SameHashes(hash_fns_.data(), other.hash_fns_.data(),
+                          depth() << 1);
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void CountSketch<T, hash_t, DEPTH>::checkCompatible(
+    const CountSketch &other) const {
+  if (!compatible(other)) {
+    throw std::invalid_argument(
+        "CountSketch: operands differ in dimensions or hash functions");
+  }
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+CountSketch<T, hash_t, DEPTH> &
+CountSketch<T, hash_t, DEPTH>::operator+=(const CountSketch &other) {
+  checkCompatible(other);
+  T *dst = arr_[0];
+  const T *src = other.arr_[0];
+  // plain contiguous loop, left to the auto-vectorizer
+  for (int64_t i = 0, n = int64_t(depth()) * width_; i < n; ++i) {
+    dst[i] += src[i];
   }
+  return *this;
 }
 
-template <typename T, typename hash_t>
-std::size_t CountSketch<T, hash_t>::size() const {
-  return sizeof(CountSketch<T, hash_t>) + (depth_ << 1) * sizeof(hash_t) +
-         depth_ * width_ * sizeof(T);
+template <typename T, typename hash_t, int32_t DEPTH>
+CountSketch<T, hash_t, DEPTH> &
+CountSketch<T, hash_t, DEPTH>::operator-=(const CountSketch &other) {
+  checkCompatible(other);
+  T *dst = arr_[0];
+  const T *src = other.arr_[0];
+  for (int64_t i = 0, n = int64_t(depth()) * width_; i < n; ++i) {
+    dst[i] -= src[i];
+  }
+  return *this;
 }
 
-template <typename T, typename hash_t> void CountSketch<T, hash_t>::clear() {
-  std::fill(arr_[0], arr_[0] + depth_ * width_, 0);
+template <typename T, typename hash_t, int32_t DEPTH>
+CountSketch<T, hash_t, DEPTH> &
+CountSketch<T, hash_t, DEPTH>::operator*=(double scale) {
+  T *dst = arr_[0];
+  for (int64_t i = 0, n = int64_t(depth()) * width_; i < n; ++i) {
+    dst[i] = static_cast<T>(dst[i] * scale);
+  }
+  return *this;
 }
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void CountSketch<T, hash_t, DEPTH>::combine(const double *coeffs,
+                                            const CountSketch *const *sketches,
+                                            int32_t n) {
+  for (int32_t k = 0; k < n; ++k) {
+    checkCompatible(*sketches[k]);
+  }
+  // counter by counter, so *this may also appear among the operands
+  T *dst = arr_[0];
+  for (int64_t i = 0, m = int64_t(depth()) * width_; i < m; ++i) {
+    double acc = 0;
+    for (int32_t k = 0; k < n; ++k) {
+      acc += coeffs[k] * sketches[k]->arr_[0][i];
+    }
+    dst[i] = static_cast<T>(acc);
+  }
+}
+
 } // namespace SketchLab
 #endif
\ No newline at end of file
@@ -6,18 +6,35 @@
 
 #include <algorithm>
 #include <cstddef>
+#include <cstring>
 namespace SketchLab {
-template <typename hash_t> class CountingBloomFilter {
+/*
+ * Counting Bloom filter with BITS-bit counters (4, 8 or 16).
+ *
+ * A counter that reaches its maximum sticks there: further inserts are
+ * counted in overflows() and remove() leaves it alone, so saturation can only
+ * cause false positives, never false negatives.
+ */
+template <typename hash_t, int32_t BITS = 4> class CountingBloomFilter {
+  static_assert(BITS == 4 || BITS == 8 || BITS == 16,
+                "counters are 4, 8 or 16 bits");
 
 private:
-  int32_t nbuckets_; //每个槽4bit
+  static const uint32_t MAX_VAL = (1U << BITS) - 1;
+
+  int32_t nbuckets_;
   int32_t num_hash_;
   int32_t nbytes_;
   uint8_t *arr_;
   hash_t *hash_fns_;
+  int64_t overflows_; // increments lost to saturated counters
 
-  inline void setVal(int32_t idx, uint8_t val);
-  inline uint8_t getVal(int32_t idx) const;
+  inline void setVal(int32_t idx, uint32_t val);
+  inline uint32_t getVal(int32_t idx) const;
+  inline const uint8_t *addrOf(int32_t idx) const {
+    return arr_ + ((static_cast<int64_t>(idx) * BITS) >> 3);
+  }
+  inline void increment(int32_t idx);
 
 public:
   CountingBloomFilter(int32_t nbuckets, int32_t num_hash);
@@ -29,91 +46,190 @@ public:
   template <int32_t key_len> void insert(const FlowKey<key_len> &flowkey);
   template <int32_t key_len> void remove(const FlowKey<key_len> &flowkey);
   template <int32_t key_len> bool query(const FlowKey<key_len> &flowkey) const;
+  // Hash a batch first and prefetch its counters, then update / test them.
+  // Bit k % 64 of found[k / 64] is query(flowkeys[k]); found holds
+  // (n + 63) / 64 words.
+  template <int32_t key_len>
+  void insertBatch(const FlowKey<key_len> *flowkeys, size_t n);
+  template <int32_t key_len>
+  void queryBatch(const FlowKey<key_len> *flowkeys, uint64_t *found,
+                  size_t n) const;
+  // Increments dropped because the counter was saturated, since clear()
+  int64_t overflows() const { return overflows_; }
   std::size_t size() const;
   void clear();
 };
 
-template <typename hash_t>
-inline void CountingBloomFilter<hash_t>::setVal(int32_t idx, uint8_t val) {
-  int32_t k = (idx >> 1);
-  if (idx & 1) {
-    arr_[k] &= 0xF0;
-    arr_[k] |= val;
+template <typename hash_t, int32_t BITS>
+inline void CountingBloomFilter<hash_t, BITS>::setVal(int32_t idx,
+                                                      uint32_t val) {
+  if (BITS == 4) {
+    int32_t k = (idx >> 1);
+    if (idx & 1) {
+      arr_[k] &= 0xF0;
+      arr_[k] |= val;
+    } else {
+      arr_[k] &= 0xF;
+      arr_[k] |= (val << 4);
+    }
+  } else if (BITS == 8) {
+    arr_[idx] = static_cast<uint8_t>(val);
+  } else {
+    uint16_t v = static_cast<uint16_t>(val);
+    std::memcpy(arr_ + 2 * static_cast<int64_t>(idx), &v, sizeof(v));
+  }
+}
+
+template <typename hash_t, int32_t BITS>
+inline uint32_t CountingBloomFilter<hash_t, BITS>::getVal(int32_t idx) const {
+  if (BITS == 4) {
+    int32_t k = (idx >> 1);
+    return ((idx & 1) ? arr_[k] : (arr_[k] >> 4)) & 0xF;
+  } else if (BITS == 8) {
+    return arr_[idx];
   } else {
-    arr_[k] &= 0xF;
-    arr_[k] |= (val << 4);
+    uint16_t v;
+    std::memcpy(&v, arr_ + 2 * static_cast<int64_t>(idx), sizeof(v));
+    return v;
   }
 }
 
-template <typename hash_t>
-inline uint8_t CountingBloomFilter<hash_t>::getVal(int32_t idx) const {
-  int32_t k = (idx >> 1);
-  return ((idx & 1) ? arr_[k] : (arr_[k] >> 4)) & 0xF;
+template <typename hash_t, int32_t BITS>
+inline void CountingBloomFilter<hash_t, BITS>::increment(int32_t idx) {
+  uint32_t val = getVal(idx);
+  if (val < MAX_VAL) {
+    setVal(idx, val + 1);
+  } else {
+    ++overflows_;
+  }
 }
 
-template <typename hash_t>
-CountingBloomFilter<hash_t>::CountingBloomFilter(int32_t nbuckets, int32_t num_hash)
-    : nbuckets_(nbuckets), num_hash_(num_hash) {
+template <typename hash_t, int32_t BITS>
+CountingBloomFilter<hash_t, BITS>::CountingBloomFilter(int32_t nbuckets,
+                                                       int32_t num_hash)
+    : nbuckets_(nbuckets), num_hash_(num_hash), overflows_(0) {
   nbuckets_ = Util::NextPrime(nbuckets_);
-  nbytes_ = (nbuckets_ + 1) >> 1; //大于2的质数一定是奇数
+  nbytes_ = (static_cast<int64_t>(nbuckets_) * BITS + 7) >> 3;
   hash_fns_ = new hash_t[num_hash_];
   // Allocate memory
   arr_ = new uint8_t[nbytes_]();
 }
 
-template <typename hash_t> CountingBloomFilter<hash_t>::~CountingBloomFilter() {
+template <typename hash_t, int32_t BITS>
+CountingBloomFilter<hash_t, BITS>::~CountingBloomFilter() {
   delete[] hash_fns_;
   delete[] arr_;
 }
 
-template <typename hash_t>
+template <typename hash_t, int32_t BITS>
 template <int32_t key_len>
-void CountingBloomFilter<hash_t>::insert(const FlowKey<key_len> &flowkey) {
+void CountingBloomFilter<hash_t, BITS>::insert(
+    const FlowKey<key_len> &flowkey) {
   for (int32_t i = 0; i < num_hash_; ++i) {
-    int32_t idx = hash_fns_[i](flowkey) % nbuckets_;
-    uint8_t val = getVal(idx);
-    if (val < 0xF) { //如果没满，就加1
-      ++val;
-    }
-    setVal(idx, val);
+    increment(hash_fns_[i](flowkey) % nbuckets_);
   }
 }
 
-template <typename hash_t>
+template <typename hash_t, int32_t BITS>
 template <int32_t key_len>
-void CountingBloomFilter<hash_t>::remove(const FlowKey<key_len> &flowkey) {
+void CountingBloomFilter<hash_t, BITS>::remove(
+    const FlowKey<key_len> &flowkey) {
   for (int32_t i = 0; i < num_hash_; ++i) {
     int32_t idx = hash_fns_[i](flowkey) % nbuckets_;
-    uint8_t val = getVal(idx);
-    if (val > 0) {
-      --val;
+    uint32_t val = getVal(idx);
+    // a saturated counter no longer knows its count, so it stays put
+    if (val > 0 && val < MAX_VAL) {
+      setVal(idx, val - 1);
     }
-    setVal(idx, val);
   }
 }
 
-template <typename hash_t>
+template <typename hash_t, int32_t BITS>
 template <int32_t key_len>
-bool CountingBloomFilter<hash_t>::query(const FlowKey<key_len> &flowkey) const {
+bool CountingBloomFilter<hash_t, BITS>::query(
+    const FlowKey<key_len> &flowkey) const {
   for (int32_t i = 0; i < num_hash_; ++i) {
     int32_t idx = hash_fns_[i](flowkey) % nbuckets_;
-    uint8_t val = getVal(idx);
-    if (!val) {
+    if (!getVal(idx)) {
       return false;
     }
   }
   return true;
 }
 
-template <typename hash_t>
-std::size_t CountingBloomFilter<hash_t>::size() const {
-  return sizeof(CountingBloomFilter<hash_t>) // Instance
-         + nbytes_ * sizeof(uint8_t)         // arr_
-         + num_hash_ * sizeof(hash_t);       // hash_fns
+template <typename hash_t, int32_t BITS>
+template <int32_t key_len>
+void CountingBloomFilter<hash_t, BITS>::insertBatch(
+    const FlowKey<key_len> *flowkeys, size_t n) {
+  if (num_hash_ > Util::BATCH_INDEX_LIMIT) {
+    // one key's positions would not fit the chunk buffer
+    for (size_t k = 0; k < n; ++k) {
+      insert(flowkeys[k]);
+    }
+    return;
+  }
+  int32_t idx[Util::BATCH_INDEX_LIMIT];
+  const size_t chunk = Util::BATCH_INDEX_LIMIT / num_hash_;
+  for (size_t base = 0; base < n; base += chunk) {
+    size_t m = std::min(chunk, n - base);
+    int32_t *p = idx;
+    for (size_t k = 0; k < m; ++k) {
+      for (int32_t i = 0; i < num_hash_; ++i, ++p) {
+        *p = hash_fns_[i](flowkeys[base + k]) % nbuckets_;
+        Util::Prefetch(addrOf(*p));
+      }
+    }
+    // saturating increments commute, so the order within a chunk is free
+    for (int32_t *q = idx; q != p; ++q) {
+      increment(*q);
+    }
+  }
+}
+
+template <typename hash_t, int32_t BITS>
+template <int32_t key_len>
+void CountingBloomFilter<hash_t, BITS>::queryBatch(
+    const FlowKey<key_len> *flowkeys, uint64_t *found, size_t n) const {
+  std::fill(found, found + (n + 63) / 64, 0);
+  if (num_hash_ > Util::BATCH_INDEX_LIMIT) {
+    for (size_t k = 0; k < n; ++k) {
+      found[k >> 6] |= static_cast<uint64_t>(query(flowkeys[k])) << (k & 63);
+    }
+    return;
+  }
+  int32_t idx[Util::BATCH_INDEX_LIMIT];
+  const size_t chunk = Util::BATCH_INDEX_LIMIT / num_hash_;
+  for (size_t base = 0; base < n; base += chunk) {
+    size_t m = std::min(chunk, n - base);
+    int32_t *p = idx;
+    for (size_t k = 0; k < m; ++k) {
+      for (int32_t i = 0; i < num_hash_; ++i, ++p) {
+        *p = hash_fns_[i](flowkeys[base + k]) % nbuckets_;
+        Util::Prefetch(addrOf(*p));
+      }
+    }
+    p = idx;
+    for (size_t k = base; k < base + m; ++k, p += num_hash_) {
+      bool all = true;
+      for (int32_t i = 0; i < num_hash_; ++i) {
+        all &= getVal(p[i]) != 0;
+      }
+      found[k >> 6] |= static_cast<uint64_t>(all) << (k & 63);
+    }
+  }
+}
+
+template <typename hash_t, int32_t BITS>
+std::size_t CountingBloomFilter<hash_t, BITS>::size() const {
+  return sizeof(CountingBloomFilter<hash_t, BITS>) // Instance
+         + nbytes_ * sizeof(uint8_t)               // arr_
+         + num_hash_ * sizeof(hash_t);             // hash_fns
 }
 
-template <typename hash_t> void CountingBloomFilter<hash_t>::clear() {
+template <typename hash_t, int32_t BITS>
+void CountingBloomFilter<hash_t, BITS>::clear() {
   std::fill(arr_, arr_ + nbytes_, 0);
+  overflows_ = 0;
 }
 } // namespace SketchLab
-#endif
\ No newline at end of file
+#endif
@@ -1,9 +1,10 @@
 #ifndef SKETCHLAB_CPP_DELTOID_H
 #define SKETCHLAB_CPP_DELTOID_H
 
+#include "FlatHashMap.h"
 #include "hash.h"
 #include "util.h"
-#include <map>
+#include <limits>
 namespace SketchLab {
 template <typename T, typename hash_t, int32_t key_len> class Deltoid {
 
@@ -16,9 +17,9 @@ public:
   ~Deltoid();
 
   void update(const FlowKey<key_len> &flowkey, T val);
-  std::map<FlowKey<key_len>, T> heavyChangers(T threshold,
+  FlatHashMap<key_len, T> heavyChangers(T threshold,
                                               const Deltoid &other) const;
-  std::map<FlowKey<key_len>, T> heavyHitters(T threshold) const;
+  FlatHashMap<key_len, T> heavyHitters(T threshold) const;
 
   T query(const FlowKey<key_len> &flowkey) const;
   size_t size() const;
@@ -204,11 +205,11 @@ T Deltoid<T, hash_t, key_len>::query(const FlowKey<key_len> &flowkey) const {
 }
 
 template <typename T, typename hash_t, int32_t key_len>
-std::map<FlowKey<key_len>, T>
+FlatHashMap<key_len, T>
 Deltoid<T, hash_t, key_len>::heavyHitters(T threshold) const {
   double val1 = 0;
   double val0 = 0;
-  std::map<FlowKey<key_len>, T> heavy_hitters;
+  FlatHashMap<key_len, T> heavy_hitters;
   for (int32_t i = 0; i < num_hash_; i++) {
     for (int32_t j = 0; j < num_group_; j++) {
       // val1 = static_cast<double>(
@@ -242,12 +243,12 @@ Deltoid<T, hash_t, key_len>::heavyHitters(T threshold) const {
 }
 
 template <typename T, typename hash_t, int32_t key_len>
-std::map<FlowKey<key_len>, T>
+FlatHashMap<key_len, T>
 Deltoid<T, hash_t, key_len>::heavyChangers(T threshold,
                                            const Deltoid &other) const {
   double val1 = 0;
   double val0 = 0;
-  std::map<FlowKey<key_len>, T> heavy_changers;
+  FlatHashMap<key_len, T> heavy_changers;
   for (int32_t i = 0; i < num_hash_; i++) {
     for (int32_t j = 0; j < num_group_; j++) {
       val1 = static_cast<double>(
@@ -5,39 +5,89 @@
 #include "hash.h"
 #include "util.h"
 #include <algorithm>
+#include <cstring>
 #include <memory>
+#include <new>
+#include <stdexcept>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define JUDGE_IF_SWAP(min_val, guard_val)                                      \
   ((guard_val) > ((min_val) << 3)) // delta = 8
 
 namespace SketchLab {
 
+/*
+ * Elastic sketch (Yang et al., "Elastic sketch: adaptive and fast
+ * network-wide measurements", 2018).
+ *
+ * Each heavy bucket starts with a block holding a 16-bit fingerprint per
+ * entry (0 for empty), the counters, the vote counter and the flags; the
+ * full keys follow it and are compared only for an entry whose fingerprint
+ * matches. With 32-bit counters and up to 7 entries per bucket
+ * (num_per_bucket <= 8) the block is one cache line, so a packet that misses
+ * the heavy part reads a single line, and a hit reads the adjacent key line,
+ * prefetched as soon as the bucket is known. With SSE2 all fingerprints of a
+ * bucket are compared at once, 8 per instruction.
+ *
+ * Entries fill in order and are only ever replaced, so the first empty entry
+ * follows every stored key, and the vote/swap rule (JUDGE_IF_SWAP against the
+ * first smallest counter) is unchanged.
+ */
 template <typename T, typename U, typename hash_t, int32_t key_len>
 class ElasticSketch {
 private:
-  struct Entry {
-    FlowKey<key_len> flowkey_;
-    T val_;
-    bool flag_;
-    Entry() : flowkey_(), val_(0), flag_(false) {}
-    bool isEmpty() {
-      FlowKey<key_len> emptyKey{};
-      return flowkey_ == emptyKey;
-    }
-  };
+  static const int32_t LINE_BYTES = 64;
+  static const int32_t MAX_ENTRIES = 64; // per bucket, excluding the vote
+
   // heavy part
-  Entry **buckets_;
   int32_t num_buckets_;
   int32_t num_per_bucket_; // each bucket has num_per_bucket_ entries
+  int32_t num_entries_;    // num_per_bucket_ - 1, the last being the vote
+  int32_t fp_lanes_;       // num_entries_ rounded up to 8
+  int32_t block_bytes_;    // fingerprints, counters, vote and flags
+  int32_t bucket_bytes_;   // the block, then the keys
+
+  uint8_t *raw_;
+  uint8_t *buckets_; // num_buckets_ * bucket_bytes_, 64-byte aligned
 
   hash_t hash_h_;
   // light part
   CMSketch<U, hash_t> cm_;
 
+  // bucket layout: fingerprints, counters, vote, flags, keys
+  uint16_t *fps(int32_t index) const {
+    return reinterpret_cast<uint16_t *>(buckets_ +
+                                        static_cast<int64_t>(index) *
+                                            bucket_bytes_);
+  }
+  T *vals(int32_t index) const {
+    return reinterpret_cast<T *>(fps(index) + fp_lanes_);
+  }
+  T &vote(int32_t index) const { return vals(index)[num_entries_]; }
+  uint8_t *flags(int32_t index) const {
+    return reinterpret_cast<uint8_t *>(vals(index) + num_entries_ + 1);
+  }
+  FlowKey<key_len> *keys(int32_t index) const {
+    return reinterpret_cast<FlowKey<key_len> *>(
+        reinterpret_cast<uint8_t *>(fps(index)) + block_bytes_);
+  }
+  static uint16_t fingerprint(uint64_t hash) {
+    uint16_t fp = static_cast<uint16_t>(Util::Mix64(hash) >> 48);
+    return fp ? fp : 1;
+  }
+  // bit i set iff entry i of the bucket has fingerprint fp
+  uint64_t matchFingerprint(const uint16_t *fps, uint16_t fp) const;
+  int32_t find(int32_t index, uint16_t fp,
+               const FlowKey<key_len> &flowkey) const;
+
 public:
   ElasticSketch(int32_t num_buckets, int32_t num_per_bucket, int32_t l_depth,
                 int32_t l_width);
   ~ElasticSketch();
+  ElasticSketch(const ElasticSketch &) = delete;
+  ElasticSketch &operator=(const ElasticSketch &) = delete;
 
   int heavypartInsert(const FlowKey<key_len> &flowkey, T val,
                       FlowKey<key_len> &swap_key, T &swap_val);
@@ -56,17 +106,74 @@ ElasticSketch<T, U, hash_t, key_len>::ElasticSketch(int32_t num_buckets,
                                                     int32_t l_width)
     : num_buckets_(Util::NextPrime(num_buckets)),
       num_per_bucket_(num_per_bucket), cm_(l_depth, l_width) {
-  buckets_ = new Entry *[num_buckets_];
-  buckets_[0] = new Entry[num_buckets_ * num_per_bucket_]();
-  for (int i = 1; i < num_buckets_; ++i) {
-    buckets_[i] = buckets_[i - 1] + num_per_bucket_;
+  if (num_per_bucket_ < 2 || num_per_bucket_ > MAX_ENTRIES + 1) {
+    throw std::invalid_argument(
+        "ElasticSketch: num_per_bucket must be in [2, " +
+        std::to_string(MAX_ENTRIES + 1) + "]");
+  }
+  num_entries_ = num_per_bucket_ - 1;
+  fp_lanes_ = (num_entries_ + 7) / 8 * 8;
+  block_bytes_ = fp_lanes_ * sizeof(uint16_t) +
+                 (num_entries_ + 1) * sizeof(T) + num_entries_;
+  // keys start on a line of their own unless the whole bucket fits one
+  const int32_t key_align = alignof(FlowKey<key_len>);
+  block_bytes_ = (block_bytes_ + key_align - 1) / key_align * key_align;
+  int32_t keys_bytes = num_entries_ * sizeof(FlowKey<key_len>);
+  if (block_bytes_ + keys_bytes > LINE_BYTES) {
+    block_bytes_ = (block_bytes_ + LINE_BYTES - 1) / LINE_BYTES * LINE_BYTES;
+  }
+  bucket_bytes_ = (block_bytes_ + keys_bytes + LINE_BYTES - 1) / LINE_BYTES *
+                  LINE_BYTES;
+  raw_ = new uint8_t[static_cast<int64_t>(num_buckets_) * bucket_bytes_ +
+                     LINE_BYTES]();
+  buckets_ = reinterpret_cast<uint8_t *>(
+      (reinterpret_cast<uintptr_t>(raw_) + LINE_BYTES - 1) &
+      ~static_cast<uintptr_t>(LINE_BYTES - 1));
+  for (int32_t i = 0; i < num_buckets_; ++i) {
+    for (int32_t j = 0; j < num_entries_; ++j) {
+      new (keys(i) + j) FlowKey<key_len>();
+    }
   }
 }
 
 template <typename T, typename U, typename hash_t, int32_t key_len>
 ElasticSketch<T, U, hash_t, key_len>::~ElasticSketch() {
-  delete[] buckets_[0];
-  delete[] buckets_;
+  delete[] raw_;
+}
+
+template <typename T, typename U, typename hash_t, int32_t key_len>
+uint64_t ElasticSketch<T, U, hash_t, key_len>::matchFingerprint(
+    const uint16_t *fps, uint16_t fp) const {
+  uint64_t mask = 0;
+#ifdef __SSE2__
+  const __m128i needle = _mm_set1_epi16(static_cast<int16_t>(fp));
+  for (int32_t i = 0; i < fp_lanes_; i += 8) {
+    __m128i eq = _mm_cmpeq_epi16(
+        _mm_load_si128(reinterpret_cast<const __m128i *>(fps + i)), needle);
+    // one bit per 16-bit lane
+    uint64_t bits = _mm_movemask_epi8(_mm_packs_epi16(eq, eq)) & 0xff;
+    mask |= bits << i;
+  }
+#else
+  for (int32_t i = 0; i < num_entries_; ++i) {
+    mask |= static_cast<uint64_t>(fps[i] == fp) << i;
+  }
+#endif
+  return num_entries_ < 64 ? mask & ((1ULL << num_entries_) - 1) : mask;
+}
+
+// entry holding flowkey, -1 if none
+template <typename T, typename U, typename hash_t, int32_t key_len>
+int32_t ElasticSketch<T, U, hash_t, key_len>::find(
+    int32_t index, uint16_t fp, const FlowKey<key_len> &flowkey) const {
+  const FlowKey<key_len> *bucket_keys = keys(index);
+  for (uint64_t m = matchFingerprint(fps(index), fp); m; m &= m - 1) {
+    int32_t i = Util::CountTrailingZeros(m);
+    if (bucket_keys[i] == flowkey) {
+      return i;
+    }
+  }
+  return -1;
 }
 
 template <typename T, typename U, typename hash_t, int32_t key_len>
@@ -74,41 +181,51 @@ int ElasticSketch<T, U, hash_t, key_len>::heavypartInsert(
     const FlowKey<key_len> &flowkey, T val, FlowKey<key_len> &swap_key,
     T &swap_val) {
 
-  int32_t index = hash_h_(flowkey) % num_buckets_;
-  int32_t matched = -1;
-  int32_t empty = -1;
+  uint64_t hash = hash_h_(flowkey);
+  int32_t index = hash % num_buckets_;
+  // the keys are needed on a hit; fetch them alongside the block
+  Util::Prefetch(keys(index));
+  uint16_t fp = fingerprint(hash);
+  uint16_t *bucket_fps = fps(index);
+  T *bucket_vals = vals(index);
+  FlowKey<key_len> *bucket_keys = keys(index);
+
+  int32_t matched = find(index, fp, flowkey);
+  if (matched >= 0) { // flowkey is in the bucket
+    bucket_vals[matched] += val;
+    return 0;
+  }
+  uint64_t empty = matchFingerprint(bucket_fps, 0);
+  if (empty) {
+    int32_t i = Util::CountTrailingZeros(empty);
+    bucket_fps[i] = fp;
+    bucket_keys[i] = flowkey;
+    bucket_vals[i] = val;
+    return 0;
+  }
   int32_t min_counter = 0;
-  T min_counter_val = buckets_[index][0].val_;
-  for (int32_t i = 0; i < num_per_bucket_ - 1; ++i) {
-    if (buckets_[index][i].flowkey_ == flowkey) { // flowkey is in the bucket
-      matched = i;
-      buckets_[index][i].val_ += val;
-      return 0;
-    }
-    if (buckets_[index][i].isEmpty()) {
-      buckets_[index][i].flowkey_ = flowkey;
-      buckets_[index][i].val_ = val;
-      return 0;
-    }
-    if (min_counter_val > buckets_[index][i].val_) {
+  T min_counter_val = bucket_vals[0];
+  for (int32_t i = 1; i < num_entries_; ++i) {
+    if (min_counter_val > bucket_vals[i]) {
       min_counter = i;
-      min_counter_val = buckets_[index][i].val_;
+      min_counter_val = bucket_vals[i];
     }
   }
   /* update guard val and comparison */
-  T guard_val = buckets_[index][num_per_bucket_ - 1].val_;
+  T guard_val = vote(index);
   guard_val += 1;
 
   if (!JUDGE_IF_SWAP(min_counter_val, guard_val)) {
-    buckets_[index][num_per_bucket_ - 1].val_ = guard_val;
+    vote(index) = guard_val;
     return 2;
   } else {
-    swap_key = buckets_[index][min_counter].flowkey_;
-    swap_val = buckets_[index][min_counter].val_;
-    buckets_[index][num_per_bucket_ - 1].val_ = 0;
-    buckets_[index][min_counter].flowkey_ = flowkey;
-    buckets_[index][min_counter].val_ = val;
-    buckets_[index][min_counter].flag_ = true;
+    swap_key = bucket_keys[min_counter];
+    swap_val = bucket_vals[min_counter];
+    vote(index) = 0;
+    bucket_fps[min_counter] = fp;
+    bucket_keys[min_counter] = flowkey;
+    bucket_vals[min_counter] = val;
+    flags(index)[min_counter] = true;
     return 1;
   }
 }
@@ -150,12 +267,13 @@ void ElasticSketch<T, U, hash_t, key_len>::update(
 template <typename T, typename U, typename hash_t, int32_t key_len>
 T ElasticSketch<T, U, hash_t, key_len>::heavypartQuery(
     const FlowKey<key_len> &flowkey, bool &flag) const {
-  int index = hash_h_(flowkey) % num_buckets_;
-  for (int i = 0; i < num_per_bucket_ - 1; ++i) {
-    if (buckets_[index][i].flowkey_ == flowkey) {
-      flag = buckets_[index][i].flag_;
-      return buckets_[index][i].val_;
-    }
+  uint64_t hash = hash_h_(flowkey);
+  int32_t index = hash % num_buckets_;
+  Util::Prefetch(keys(index));
+  int32_t i = find(index, fingerprint(hash), flowkey);
+  if (i >= 0) {
+    flag = flags(index)[i];
+    return vals(index)[i];
   }
   return 0;
 }
@@ -181,8 +299,7 @@ T ElasticSketch<T, U, hash_t, key_len>::query(
 template <typename T, typename U, typename hash_t, int32_t key_len>
 size_t ElasticSketch<T, U, hash_t, key_len>::size() const {
   size_t es = sizeof(ElasticSketch<T, U, hash_t, key_len>) + sizeof(hash_h_);
-  size_t bucket_size = key_len + 1 + sizeof(U);
-  size_t vk = bucket_size * num_buckets_ * num_per_bucket_;
+  size_t vk = static_cast<size_t>(num_buckets_) * bucket_bytes_;
   size_t ct = cm_.size();
   return es + vk + ct;
 }
@@ -2,18 +2,34 @@
 #define SKETCHLAB_CPP_FMSKETCH_H
 #include "hash.h"
 #include "util.h"
+#include <algorithm>
 #include <cmath>
 namespace SketchLab {
+/*
+ * Flajolet-Martin sketch with depth_ bitmaps.
+ *
+ * By default every bitmap has its own hash function and the estimate comes
+ * from the median bitmap. With pcsa set the sketch does Probabilistic
+ * Counting with Stochastic Averaging instead: one hash per key, whose high
+ * bits pick the bitmap and whose low bits give the rank, and the estimate
+ * averages over all bitmaps (with the small range correction of Scheuermann
+ * and Mauve, "Near-optimal compression of probabilistic counting sketches
+ * for networking applications", 2007).
+ */
 template <typename hash_t> class FMSketch {
 private:
+  static constexpr double PHI = 0.77351;
+  static constexpr double KAPPA = 1.75;
+
   uint64_t *arr_;
   int32_t depth_;
+  bool pcsa_;
   hash_t *hash_fns_;
   int32_t zeroes(uint64_t num) const;
   int32_t ones(uint64_t num) const;
 
 public:
-  FMSketch(int32_t depth);
+  FMSketch(int32_t depth, bool pcsa = false);
   ~FMSketch();
   template <int32_t key_len> void update(const FlowKey<key_len> &flowkey);
   int64_t query() const;
@@ -21,9 +37,10 @@ public:
   void clear();
 };
 template <typename hash_t>
-FMSketch<hash_t>::FMSketch(int32_t depth) : depth_(depth) {
+FMSketch<hash_t>::FMSketch(int32_t depth, bool pcsa)
+    : depth_(depth), pcsa_(pcsa) {
   arr_ = new uint64_t[depth_]();
-  hash_fns_ = new hash_t[depth_];
+  hash_fns_ = new hash_t[pcsa_ ? 1 : depth_];
 }
 
 template <typename hash_t> FMSketch<hash_t>::~FMSketch() {
@@ -31,36 +48,27 @@ template <typename hash_t> FMSketch<hash_t>::~FMSketch() {
   delete[] hash_fns_;
 }
 
+// trailing zeroes, 0 for 0
 template <typename hash_t>
 int32_t FMSketch<hash_t>::zeroes(uint64_t num) const {
-  int32_t ret = 0;
-  while (num) {
-    if (!(num & 1)) {
-      ++ret;
-      num >>= 1;
-    } else {
-      return ret;
-    }
-  }
-  return ret;
+  return num ? Util::CountTrailingZeros(num) : 0;
 }
 
+// trailing ones: num & ~(num + 1) keeps exactly them
 template <typename hash_t> int32_t FMSketch<hash_t>::ones(uint64_t num) const {
-  int32_t ret = 0;
-  while (num) {
-    if (num & 1) {
-      ++ret;
-      num >>= 1;
-    } else {
-      return ret;
-    }
-  }
-  return ret;
+  return Util::PopCount(num & ~(num + 1));
 }
 
 template <typename hash_t>
 template <int32_t key_len>
 void FMSketch<hash_t>::update(const FlowKey<key_len> &flowkey) {
+  if (pcsa_) {
+    uint64_t hash = Util::Mix64(hash_fns_[0](flowkey));
+    int32_t i = static_cast<int32_t>(((hash >> 32) * depth_) >> 32);
+    // a guard bit caps the rank at 32, room for 2^32 keys per bitmap
+    arr_[i] |= 1ULL << zeroes(hash | (1ULL << 32));
+    return;
+  }
   for (int32_t i = 0; i < depth_; ++i) {
     int32_t idx = zeroes(hash_fns_[i](flowkey));
     // int32_t idx = ones(hash_fns_[i](flowkey));
@@ -71,37 +79,43 @@ void FMSketch<hash_t>::update(const FlowKey<key_len> &flowkey) {
 }
 
 template <typename hash_t> int64_t FMSketch<hash_t>::query() const {
-  // int32_t L = 0;
-  // for (int32_t i = 0; i < depth_; ++i) {
-  //   L += ones(arr_[i]);
-  //   std::cout << ones(arr_[i]) << " ";
-  // }
-  // 选中位数
-  int32_t *values = new int32_t[depth_];
+  if (pcsa_) {
+    int32_t sum = 0;
+    for (int32_t i = 0; i < depth_; ++i) {
+      sum += ones(arr_[i]);
+    }
+    double mean = static_cast<double>(sum) / depth_;
+    return static_cast<int64_t>(
+        depth_ / PHI * (std::pow(2.0, mean) - std::pow(2.0, -KAPPA * mean)));
+  }
+  // 选中位数, from a histogram of the values (0 .. 64)
+  int32_t count[65] = {};
   for (int32_t i = 0; i < depth_; ++i) {
-    values[i] = ones(arr_[i]);
-    std::cout << ones(arr_[i]) << " ";
+    ++count[ones(arr_[i])];
   }
-  std::cout << std::endl;
-  std::sort(values, values + depth_);
+  // values[k] in sorted order, without sorting
+  auto nth = [&count](int32_t k) {
+    int32_t v = 0;
+    for (int32_t seen = count[0]; seen <= k; seen += count[++v]) {
+    }
+    return v;
+  };
   double p;
   if (!(depth_ & 1)) { //偶数
-    p = std::abs((values[depth_ / 2 - 1] + values[depth_ / 2]) / 2);
+    p = (nth(depth_ / 2 - 1) + nth(depth_ / 2)) / 2;
   } else { //奇数
-    p = std::abs(values[depth_ / 2]);
+    p = nth(depth_ / 2);
   }
-  delete[] values;
-  // double p = static_cast<double>(L) / depth_;
   int64_t cardinality = static_cast<int64_t>(1.2928 * pow(2.0, p));
   return cardinality;
 }
 template <typename hash_t> std::size_t FMSketch<hash_t>::size() const {
-  return sizeof(FMSketch<hash_t>) +
-         depth_ * (sizeof(uint64_t) + sizeof(hash_t));
+  return sizeof(FMSketch<hash_t>) + depth_ * sizeof(uint64_t) +
+         (pcsa_ ? 1 : depth_) * sizeof(hash_t);
 }
 template <typename hash_t> void FMSketch<hash_t>::clear() {
   std::fill(arr_, arr_ + depth_, 0);
 }
 } // namespace SketchLab
 
-#endif
\ No newline at end of file
+#endif
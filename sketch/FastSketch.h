@@ -1,10 +1,12 @@
 #ifndef SKETCHLAB_CPP_FASTSKETCH_H
 #define SKETCHLAB_CPP_FASTSKETCH_H
 
+#include "FlatHashMap.h"
 #include "hash.h"
 #include "util.h"
 
-#include <map>
+#include <cstring>
+#include <stdexcept>
 #include <vector>
 
 namespace SketchLab {
@@ -18,9 +20,13 @@ private:
   T **counter_;      // Counter table
   hash_t *hash_fns_;
 
-  bool guessOne(int32_t i, T thresh, uint8_t *guess);
-  void recover(uint8_t *q, int32_t i, int32_t j, uint8_t *guess);
-  std::map<FlowKey<key_len>, T> detectAnomaly(T threshold);
+  // count(i, j) yields the counter the detection runs on, so heavy changers
+  // can read |this - other| on the fly instead of materialising it
+  template <typename Count>
+  bool guessOne(int32_t i, T thresh, uint8_t *guess, const Count &count) const;
+  void recover(uint8_t *q, int32_t i, int32_t j, uint8_t *guess) const;
+  template <typename Count>
+  FlatHashMap<key_len, T> detectAnomaly(T threshold, const Count &count) const;
 
 public:
   FastSketch(int32_t depth, int32_t num_hash);
@@ -32,9 +38,10 @@ public:
 
   void update(const FlowKey<key_len> &flowkey, T val);
   T query(const FlowKey<key_len> &flowkey) const;
-  std::map<FlowKey<key_len>, T> heavyChangers(T threshold, const FastSketch &other) ;
-  std::map<FlowKey<key_len>, T> heavyHitters(T threshold);
-  
+  FlatHashMap<key_len, T> heavyChangers(T threshold,
+                                        const FastSketch &other) const;
+  FlatHashMap<key_len, T> heavyHitters(T threshold) const;
+
   size_t size() const;
   void clear();
   void merge(const FastSketch<T, hash_t, key_len> **fast_arr,
@@ -171,15 +178,17 @@ T FastSketch<T, hash_t, key_len>::query(
 }
 
 template <typename T, typename hash_t, int32_t key_len>
+template <typename Count>
 bool FastSketch<T, hash_t, key_len>::guessOne(int32_t i, T thresh,
-                                              uint8_t *guess) {
-  T count0 = counter_[i][0];
+                                              uint8_t *guess,
+                                              const Count &count) const {
+  T count0 = count(i, 0);
   if (count0 < thresh) {
     return false;
   }
   for (int32_t k = 1; k < width_; ++k) {
     // Maintest: if one side is above threshold, the other side is not
-    T countk = counter_[i][k];
+    T countk = count(i, k);
     if (((count0 - countk < thresh) && (countk < thresh)) ||
         ((count0 - countk > thresh) && (countk > thresh))) {
       return false;
@@ -196,7 +205,7 @@ bool FastSketch<T, hash_t, key_len>::guessOne(int32_t i, T thresh,
 // 假设一个flowkey被用第j个哈希函数映射到了第i行。现在要恢复这个flowkey
 template <typename T, typename hash_t, int32_t key_len>
 void FastSketch<T, hash_t, key_len>::recover(uint8_t *q, int32_t i, int32_t j,
-                                             uint8_t *guess) {
+                                             uint8_t *guess) const {
   uint64_t bucket = hash_fns_[j](q, key_len) % depth_;
   uint64_t qint = 0;
   memcpy(&qint, q, key_len);
@@ -205,17 +214,19 @@ void FastSketch<T, hash_t, key_len>::recover(uint8_t *q, int32_t i, int32_t j,
 }
 
 template <typename T, typename hash_t, int32_t key_len>
-
-std::map<FlowKey<key_len>, T> FastSketch<T, hash_t, key_len>::detectAnomaly(T thresh) {
+template <typename Count>
+FlatHashMap<key_len, T>
+FastSketch<T, hash_t, key_len>::detectAnomaly(T thresh,
+                                              const Count &count) const {
   uint8_t guess[key_len];
   uint8_t q[key_len];
   T degree = 0;
-  std::map<FlowKey<key_len>, T> cand_list;
+  FlatHashMap<key_len, T> cand_list;
   for (int32_t i = 0; i < depth_; ++i) {
     // Find one candidate
     memset(guess, 0, key_len);
     memset(q, 0, key_len);
-    if (guessOne(i, thresh, q) == false) {
+    if (guessOne(i, thresh, q, count) == false) {
       continue;
     }
 
@@ -236,7 +247,7 @@ std::map<FlowKey<key_len>, T> FastSketch<T, hash_t, key_len>::detectAnomaly(T th
         for (int32_t k = 0; k < num_hash_; ++k) { // 计算flowkey对应的估计值
           uint32_t bucket = hash_fns_[k]((uint8_t *)&guess_q, key_len) % depth_;
           bucket = guess_mod ^ bucket;
-          T deg = counter_[bucket][0];
+          T deg = count(bucket, 0);
           if (deg > thresh) {
             pass++;
             if (k == 0)
@@ -245,7 +256,7 @@ std::map<FlowKey<key_len>, T> FastSketch<T, hash_t, key_len>::detectAnomaly(T th
               degree = std::min(degree, deg);
             for (int32_t t = 1; t < width_; ++t) {
               if (guess_q & (1ULL << (t - 1))) {
-                degree = std::min(degree, counter_[bucket][t]);
+                degree = std::min(degree, count(bucket, t));
               }
             }
           }
@@ -266,26 +277,28 @@ std::map<FlowKey<key_len>, T> FastSketch<T, hash_t, key_len>::detectAnomaly(T th
   return cand_list;
 }
 
-template<typename T, typename hash_t, int32_t key_len>
-std::map<FlowKey<key_len>, T> FastSketch<T, hash_t, key_len>::heavyHitters(T threshold){
-  return detectAnomaly(threshold);
+template <typename T, typename hash_t, int32_t key_len>
+FlatHashMap<key_len, T>
+FastSketch<T, hash_t, key_len>::heavyHitters(T threshold) const {
+  return detectAnomaly(threshold, [this](int32_t i, int32_t j) {
+    return counter_[i][j];
+  });
 }
 
-template<typename T, typename hash_t, int32_t key_len>
-std::map<FlowKey<key_len>, T> FastSketch<T, hash_t, key_len>::heavyChangers(T threshold, const FastSketch &other){
-  int32_t n = depth_ * width_;
-  T *temp = new T[n];
-  std::copy(counter_[0], counter_[0] + n, temp);
-  for(int32_t i = 0; i < n; ++i){
-    *(counter_[0] + i) = std::abs(*(counter_[0] + i) - *(other.counter_[0] + i));
+template <typename T, typename hash_t, int32_t key_len>
+FlatHashMap<key_len, T>
+FastSketch<T, hash_t, key_len>::heavyChangers(T threshold,
+                                              const FastSketch &other) const {
+  if (depth_ != other.depth_ || width_ != other.width_ ||
+      num_hash_ != other.num_hash_ ||
+      !Util::SameHashes(hash_fns_, other.hash_fns_, num_hash_)) {
+    throw std::invalid_argument(
+        "FastSketch: operands differ in dimensions or hash functions");
   }
-  T temp_sum = sum_;
-  sum_ = std::abs(sum_ - other.sum_);
-  auto heavy_changers = detectAnomaly(threshold);
-  std::copy(temp, temp + n, counter_[0]);
-  sum_ = temp_sum;
-  delete []temp;
-  return heavy_changers;
+  // detect on |this - other|, computed per counter as it is read
+  return detectAnomaly(threshold, [this, &other](int32_t i, int32_t j) {
+    return static_cast<T>(std::abs(counter_[i][j] - other.counter_[i][j]));
+  });
 }
 
 
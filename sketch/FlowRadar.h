@@ -1,6 +1,7 @@
 #ifndef SKETCHLAB_CPP_FLOWRADAR_H
 #define SKETCHLAB_CPP_FLOWRADAR_H
 
+#include "BlockedBloomFilter.h"
 #include "BloomFilter.h"
 #include "FlowKey.h"
 #include "hash.h"
@@ -9,7 +10,10 @@
 #include <map>
 #include <memory>
 namespace SketchLab {
-template <typename T, typename hash_t, int32_t key_len> class FlowRadar {
+// filter_t is BloomFilter<hash_t> or BlockedBloomFilter<hash_t>
+template <typename T, typename hash_t, int32_t key_len,
+          typename filter_t = BloomFilter<hash_t>>
+class FlowRadar {
   int32_t n_arr_;
   int32_t nhash_arr_;
   hash_t *hash_fns_;
@@ -18,7 +22,7 @@ template <typename T, typename hash_t, int32_t key_len> class FlowRadar {
   T *flow_arr_;
   T *size_arr_;
   FlowKey<key_len> *keys_;
-  BloomFilter<hash_t> bf_;
+  filter_t bf_;
 
 public:
   FlowRadar(int32_t bf_nbits, int32_t bf_nhash, int32_t n_arr,
@@ -31,9 +35,11 @@ public:
   size_t size() const;
 };
 
-template <typename T, typename hash_t, int32_t key_len>
-FlowRadar<T, hash_t, key_len>::FlowRadar(int32_t bf_nbits, int32_t bf_nhash,
-                                         int32_t n_arr, int32_t nhash_arr)
+template <typename T, typename hash_t, int32_t key_len, typename filter_t>
+FlowRadar<T, hash_t, key_len, filter_t>::FlowRadar(int32_t bf_nbits,
+                                                   int32_t bf_nhash,
+                                                   int32_t n_arr,
+                                                   int32_t nhash_arr)
     : bf_(bf_nbits, bf_nhash), n_arr_(Util::NextPrime(n_arr)),
       nhash_arr_(nhash_arr) {
   n_flows_ = 0;
@@ -45,17 +51,17 @@ FlowRadar<T, hash_t, key_len>::FlowRadar(int32_t bf_nbits, int32_t bf_nhash,
   keys_ = new FlowKey<key_len>[n_arr_]();
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-FlowRadar<T, hash_t, key_len>::~FlowRadar() {
+template <typename T, typename hash_t, int32_t key_len, typename filter_t>
+FlowRadar<T, hash_t, key_len, filter_t>::~FlowRadar() {
   delete[] hash_fns_;
   delete[] flow_arr_;
   delete[] size_arr_;
   delete[] keys_;
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-void FlowRadar<T, hash_t, key_len>::update(const FlowKey<key_len> &flowkey,
-                                           T size) {
+template <typename T, typename hash_t, int32_t key_len, typename filter_t>
+void FlowRadar<T, hash_t, key_len, filter_t>::update(
+    const FlowKey<key_len> &flowkey, T size) {
   bool exist = bf_.query(flowkey);
   if (!exist) {
     bf_.insert(flowkey);
@@ -72,8 +78,9 @@ void FlowRadar<T, hash_t, key_len>::update(const FlowKey<key_len> &flowkey,
   }
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-std::map<FlowKey<key_len>, T> FlowRadar<T, hash_t, key_len>::decode() {
+template <typename T, typename hash_t, int32_t key_len, typename filter_t>
+std::map<FlowKey<key_len>, T>
+FlowRadar<T, hash_t, key_len, filter_t>::decode() {
   // int stop = 0;
   bool stop = false;
   int ret = 0;
@@ -109,8 +116,8 @@ std::map<FlowKey<key_len>, T> FlowRadar<T, hash_t, key_len>::decode() {
   return ans;
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-void FlowRadar<T, hash_t, key_len>::clear() {
+template <typename T, typename hash_t, int32_t key_len, typename filter_t>
+void FlowRadar<T, hash_t, key_len, filter_t>::clear() {
   n_flows_ = 0;
   bf_.clear();
   std::fill_n(flow_arr_, n_arr_, 0);
@@ -121,9 +128,9 @@ void FlowRadar<T, hash_t, key_len>::clear() {
   }
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-size_t FlowRadar<T, hash_t, key_len>::size() const {
-  size_t admin = sizeof(FlowRadar<T, hash_t, key_len>);
+template <typename T, typename hash_t, int32_t key_len, typename filter_t>
+size_t FlowRadar<T, hash_t, key_len, filter_t>::size() const {
+  size_t admin = sizeof(FlowRadar<T, hash_t, key_len, filter_t>);
   size_t hash = nhash_arr_ * sizeof(hash_t);
   size_t cnt = 2 * sizeof(T) * n_arr_;
   size_t encode = key_len * n_arr_;
@@ -1,12 +1,22 @@
 #ifndef SKETCHLAB_CPP_HASHPIPE_H
 #define SKETCHLAB_CPP_HASHPIPE_H
 
+#include "FlatHashMap.h"
 #include "hash.h"
 #include "util.h"
 #include <cstdint>
-#include <map>
-#include <set>
+#include <utility>
+#include <vector>
 namespace SketchLab {
+/*
+ * HashPipe (Sivaraman et al., "Heavy-hitter detection entirely in the data
+ * plane", 2017).
+ *
+ * A key sits in at most one slot per stage, the one its stage hash picks, so
+ * query() and the heavy hitters agree: both sum the key's slots. Heavy hitter
+ * extraction walks the stage arrays once and sums duplicates in a flat
+ * scratch table instead of re-hashing every key through all stages.
+ */
 template <typename T, typename hash_t, int32_t key_len> class HashPipe {
 private:
   class Entry {
@@ -20,12 +30,18 @@ private:
   hash_t *hash_fns_;
   Entry **arr_;
 
+  template <typename Emit> void aggregate(Emit emit) const;
+
 public:
   HashPipe(int depth, int width);
   ~HashPipe();
   void update(const FlowKey<key_len> &flowkey, T val);
   T query(const FlowKey<key_len> &flowkey) const;
-  std::map<FlowKey<key_len>, T> getHeavyHitters(const T val_threshold) const;
+  FlatHashMap<key_len, T> getHeavyHitters(const T val_threshold) const;
+  // Same keys and values, written to out (cleared first) in no particular
+  // order
+  void getHeavyHitters(const T val_threshold,
+                       std::vector<std::pair<FlowKey<key_len>, T>> &out) const;
   std::size_t size() const;
   void clear();
 };
@@ -94,7 +110,7 @@ void HashPipe<T, hash_t, key_len>::update(const FlowKey<key_len> &flowkey,
 }
 template <typename T, typename hash_t, int32_t key_len>
 T HashPipe<T, hash_t, key_len>::query(const FlowKey<key_len> &flowkey) const {
-  int ret = 0;
+  T ret = 0;
   for (int i = 0; i < depth_; ++i) {
     int idx = hash_fns_[i](flowkey) % width_;
     if (arr_[i][idx].flowkey_ == flowkey) {
@@ -104,27 +120,63 @@ T HashPipe<T, hash_t, key_len>::query(const FlowKey<key_len> &flowkey) const {
   return ret;
 }
 
+// Calls emit(flowkey, sum) once for every stored key, with sum the total of
+// its slots, i.e. its query() value. Duplicates are found through a SlotIndex
+// over the slot numbers, which is far smaller than a map of keys.
 template <typename T, typename hash_t, int32_t key_len>
-std::map<FlowKey<key_len>, T>
-HashPipe<T, hash_t, key_len>::getHeavyHitters(const T val_threshold) const {
-  std::map<FlowKey<key_len>, T> heavy_hitters;
-  std::set<FlowKey<key_len>> checked;
-  for (int i = 0; i < depth_; ++i) {
-    for (int j = 0; j < width_; ++j) {
-      const auto &flowkey = arr_[i][j].flowkey_;
-      if (checked.find(flowkey) != checked.end()) {
-        continue;
-      }
-      checked.insert(flowkey);
-      auto estimate_val = query(flowkey);
-      if (estimate_val >= val_threshold) {
-        heavy_hitters.emplace(flowkey, estimate_val);
-      }
+template <typename Emit>
+void HashPipe<T, hash_t, key_len>::aggregate(Emit emit) const {
+  const int32_t n = depth_ * width_;
+  const Entry *slots = arr_[0];
+  const FlowKey<key_len> empty_key;
+  SlotIndex index(n);
+  std::vector<T> sums(n);
+  std::vector<int32_t> firsts;
+  for (int32_t i = 0; i < n; ++i) {
+    if (slots[i].flowkey_ == empty_key) {
+      continue;
     }
+    uint32_t hash = static_cast<uint32_t>(FlatHash::HashKey(slots[i].flowkey_));
+    int32_t first = index.find(hash, [&](int32_t j) {
+      return slots[j].flowkey_ == slots[i].flowkey_;
+    });
+    if (first < 0) {
+      index.insert(hash, i);
+      sums[i] = slots[i].val_;
+      firsts.push_back(i);
+    } else {
+      sums[first] += slots[i].val_;
+    }
+  }
+  for (int32_t i : firsts) {
+    emit(slots[i].flowkey_, sums[i]);
   }
+}
+
+template <typename T, typename hash_t, int32_t key_len>
+FlatHashMap<key_len, T>
+HashPipe<T, hash_t, key_len>::getHeavyHitters(const T val_threshold) const {
+  FlatHashMap<key_len, T> heavy_hitters;
+  aggregate([&](const FlowKey<key_len> &flowkey, T sum) {
+    if (sum >= val_threshold) {
+      heavy_hitters.emplace(flowkey, sum);
+    }
+  });
   return heavy_hitters;
 }
 
+template <typename T, typename hash_t, int32_t key_len>
+void HashPipe<T, hash_t, key_len>::getHeavyHitters(
+    const T val_threshold,
+    std::vector<std::pair<FlowKey<key_len>, T>> &out) const {
+  out.clear();
+  aggregate([&](const FlowKey<key_len> &flowkey, T sum) {
+    if (sum >= val_threshold) {
+      out.emplace_back(flowkey, sum);
+    }
+  });
+}
+
 template <typename T, typename hash_t, int32_t key_len>
 std::size_t HashPipe<T, hash_t, key_len>::size() const {
   return sizeof(HashPipe<T, hash_t, key_len>) + depth_ * sizeof(hash_t) +
@@ -141,4 +193,4 @@ void HashPipe<T, hash_t, key_len>::clear() {
   }
 }
 } // namespace SketchLab
-#endif
\ No newline at end of file
+#endif
@@ -7,59 +7,118 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <memory>
+#include <stdexcept>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "hash.h"
 #include "util.h"
 
 namespace SketchLab {
 
-// Which type for float?
-
+/*
+ * HyperLogLog with a sparse mode (HLL++) and 6-bit dense registers.
+ *
+ * The 64-bit hash goes through Util::Mix64; its top log2_depth_ bits then
+ * pick the register and the rank is one plus the leading zeros of the rest
+ * (at most 65 - log2_depth_, which fits 6 bits). With 64-bit hashes
+ * collisions stay negligible far beyond 2^32 distinct keys, so there is no
+ * large range correction.
+ *
+ * A new instance is sparse: it keeps a sorted list of (index, rank) entries
+ * at the finer precision SPARSE_PRECISION, 4 bytes per distinct entry, and
+ * estimates by linear counting over 2^SPARSE_PRECISION buckets. Updates are
+ * buffered unsorted and merged in batches. Once the list holds more than
+ * sparse_limit_ entries it is converted to dense registers, packed four to
+ * three bytes; the default limit switches when the list would outgrow them.
+ *
+ * The dense estimate is Ertl's improved estimator ("New cardinality
+ * estimation algorithms for HyperLogLog sketches", 2017). It corrects the
+ * small range bias of the raw estimate without the empirical bias tables of
+ * HLL++, and works on a histogram of register values, so it does no
+ * per-register floating point work.
+ *
+ * Copies of one instance share its hash function and can be merged, e.g. the
+ * per-core shards of one counter. Entries and registers at a finer precision
+ * carry enough bits to be folded into a coarser one, so instances of
+ * different depths merge at the smaller of the two.
+ */
 template <typename T, typename hash_t> class HyperLogLog {
+  static const int32_t REG_BITS = 6;
+  static const uint32_t REG_MASK = (1U << REG_BITS) - 1;
+  static const int32_t SPARSE_PRECISION = 25;
 
   int32_t depth_;
 
   int32_t log2_depth_;
 
-  double alpha_;
-
   hash_t *hash_fns_;
 
-  int32_t *max_pos_;
+  int32_t nbytes_;
+
+  uint8_t *regs_; // dense registers, little-endian packed; null when sparse
+
+  int32_t sparse_limit_;
+
+  // entry = index at SPARSE_PRECISION << REG_BITS | rank; sorted, one entry
+  // per index (the largest rank)
+  std::vector<uint32_t> sparse_;
+
+  std::vector<uint32_t> pending_; // unsorted updates not merged yet
+
+  static uint32_t getReg(const uint8_t *regs, int32_t index);
+  uint32_t getReg(int32_t index) const { return getReg(regs_, index); }
+  void setReg(int32_t index, uint32_t val);
+  static uint64_t maxRegs(uint64_t a, uint64_t b);
+#ifdef __AVX2__
+  static __m256i maxRegs(__m256i a, __m256i b);
+#endif
+  void foldReg(uint32_t fine, uint32_t rank, int32_t shift);
+  void mergePending();
+  void toDense();
+  void reduce(int32_t log2_depth);
+  double denseEstimate() const;
+  double sparseEstimate() const;
 
 public:
-  HyperLogLog(int depth);
+  // sparse_limit: sparse entries kept before switching to dense registers;
+  // negative picks the point where the list and its buffer would outgrow the
+  // dense registers, 0 starts dense
+  HyperLogLog(int depth, int32_t sparse_limit = -1);
+  HyperLogLog(const HyperLogLog &other);
+  // an empty instance with other's hash function at another depth, e.g. a
+  // coarser aggregate of shards, see merge()
+  HyperLogLog(const HyperLogLog &other, int depth, int32_t sparse_limit = -1);
   ~HyperLogLog();
+  HyperLogLog &operator=(const HyperLogLog &) = delete;
 
   template <int32_t key_len> void update(const FlowKey<key_len> &flowkey);
   T query() const;
+  // Set operations on instances with the same hash function, i.e. copies of
+  // one HyperLogLog (copy it, then clear() it for each shard). Operands with
+  // different hash functions throw std::invalid_argument.
+  bool compatible(const HyperLogLog &other) const;
+  // *this becomes the union; if other has fewer registers, *this drops to
+  // its precision first
+  void merge(const HyperLogLog &other);
+  T queryUnion(const HyperLogLog &other) const;
+  // |A| + |B| - |A u B|, clamped at 0; the error is that of the union, so
+  // small intersections of large sets are not resolved
+  T queryIntersection(const HyperLogLog &other) const;
+  bool isSparse() const { return regs_ == nullptr; }
   size_t size() const;
   void clear();
 };
 
-double alpha_HyperLogLog(int32_t m) {
-  if (m == 16) {
-    return 0.673;
-  }
-
-  if (m == 32) {
-    return 0.697;
-  }
-
-  if (m == 64) {
-    return 0.709;
-  }
-
-  if (m >= 128) {
-    return 0.7213 / (1. + 1.079 / m);
-  }
-
-  return 0.;
-}
-
 template <typename T, typename hash_t>
-HyperLogLog<T, hash_t>::HyperLogLog(int depth) : depth_(depth) {
+HyperLogLog<T, hash_t>::HyperLogLog(int depth, int32_t sparse_limit)
+    : depth_(depth), regs_(nullptr) {
 
   log2_depth_ = 4;
 
@@ -73,32 +132,122 @@ HyperLogLog<T, hash_t>::HyperLogLog(int depth) : depth_(depth) {
 
   // set depth_ to 16, 32, 64, ..., 65536
 
-  alpha_ = alpha_HyperLogLog(depth_);
-
   hash_fns_ = new hash_t[1];
 
-  max_pos_ = new int32_t[depth_]();
+  // one spare byte, so every register can be read as two bytes
+  nbytes_ = depth_ * REG_BITS / 8 + 1;
+
+  // the buffer holds up to a quarter of the list, plus vector slack
+  sparse_limit_ =
+      sparse_limit < 0 ? nbytes_ / (6 * sizeof(uint32_t)) * 4 : sparse_limit;
+
+  if (sparse_limit_ == 0) {
+    regs_ = new uint8_t[nbytes_]();
+  }
+}
+
+template <typename T, typename hash_t>
+HyperLogLog<T, hash_t>::HyperLogLog(const HyperLogLog &other)
+    : depth_(other.depth_), log2_depth_(other.log2_depth_),
+      nbytes_(other.nbytes_), regs_(nullptr),
+      sparse_limit_(other.sparse_limit_), sparse_(other.sparse_),
+      pending_(other.pending_) {
+  // copy-construct, MurmurHash is not assignable
+  hash_fns_ = new hash_t[1]{other.hash_fns_[0]};
+
+  if (other.regs_) {
+    regs_ = new uint8_t[nbytes_];
+    std::copy(other.regs_, other.regs_ + nbytes_, regs_);
+  }
+}
+
+template <typename T, typename hash_t>
+HyperLogLog<T, hash_t>::HyperLogLog(const HyperLogLog &other, int depth,
+                                    int32_t sparse_limit)
+    : HyperLogLog(depth, sparse_limit) {
+  delete[] hash_fns_;
+  hash_fns_ = new hash_t[1]{other.hash_fns_[0]};
 }
 
 template <typename T, typename hash_t> HyperLogLog<T, hash_t>::~HyperLogLog() {
   delete[] hash_fns_;
 
-  delete[] max_pos_;
+  delete[] regs_;
 }
 
-int32_t pos_HyperLogLog(uint32_t s, int32_t K) {
-  if (!s) {
-    return K + 1;
-  }
+template <typename T, typename hash_t>
+uint32_t HyperLogLog<T, hash_t>::getReg(const uint8_t *regs, int32_t index) {
+  int32_t bit = index * REG_BITS;
+  const uint8_t *p = regs + (bit >> 3);
+  return ((p[0] | (p[1] << 8)) >> (bit & 7)) & REG_MASK;
+}
 
-  int32_t pos = 1;
+template <typename T, typename hash_t>
+void HyperLogLog<T, hash_t>::setReg(int32_t index, uint32_t val) {
+  int32_t bit = index * REG_BITS;
+  uint8_t *p = regs_ + (bit >> 3);
+  uint32_t word = p[0] | (p[1] << 8);
+  word &= ~(REG_MASK << (bit & 7));
+  word |= val << (bit & 7);
+  p[0] = static_cast<uint8_t>(word);
+  p[1] = static_cast<uint8_t>(word >> 8);
+}
+
+// Eight 6-bit registers in the low 48 bits of each 64-bit word (the rest is
+// ignored and cleared). Every other register is handled at once: with a guard
+// bit set above each field of a, the guard survives a - b exactly when a >= b,
+// and spreads into a select mask.
+template <typename T, typename hash_t>
+inline uint64_t HyperLogLog<T, hash_t>::maxRegs(uint64_t a, uint64_t b) {
+  const uint64_t FIELDS = 0x3f03f03f03fULL;
+  const uint64_t GUARDS = 0x40040040040ULL;
+  uint64_t res = 0;
+  for (int32_t half = 0; half < 2; ++half) {
+    uint64_t x = (a >> (half * REG_BITS)) & FIELDS;
+    uint64_t y = (b >> (half * REG_BITS)) & FIELDS;
+    uint64_t ge = (((x | GUARDS) - y) & GUARDS) >> REG_BITS;
+    uint64_t sel = (ge << REG_BITS) - ge;
+    res |= ((x & sel) | (y & ~sel)) << (half * REG_BITS);
+  }
+  return res;
+}
 
-  while ((s & 1) == 0) {
-    pos++;
-    s >>= 1;
+#ifdef __AVX2__
+template <typename T, typename hash_t>
+__m256i HyperLogLog<T, hash_t>::maxRegs(__m256i a, __m256i b) {
+  const __m256i fields = _mm256_set1_epi64x(0x3f03f03f03fLL);
+  const __m256i guards = _mm256_set1_epi64x(0x40040040040LL);
+  __m256i res = _mm256_setzero_si256();
+  for (int32_t half = 0; half < 2; ++half) {
+    __m256i x = _mm256_and_si256(
+        _mm256_srli_epi64(a, half * REG_BITS), fields);
+    __m256i y = _mm256_and_si256(
+        _mm256_srli_epi64(b, half * REG_BITS), fields);
+    __m256i ge = _mm256_srli_epi64(
+        _mm256_and_si256(
+            _mm256_sub_epi64(_mm256_or_si256(x, guards), y), guards),
+        REG_BITS);
+    __m256i sel = _mm256_sub_epi64(_mm256_slli_epi64(ge, REG_BITS), ge);
+    __m256i max = _mm256_or_si256(_mm256_and_si256(sel, x),
+                                  _mm256_andnot_si256(sel, y));
+    res = _mm256_or_si256(res, _mm256_slli_epi64(max, half * REG_BITS));
   }
+  return res;
+}
+#endif
 
-  return pos;
+template <typename T, typename hash_t>
+void HyperLogLog<T, hash_t>::foldReg(uint32_t fine, uint32_t rank,
+                                     int32_t shift) {
+  // a register at a precision shift bits finer; the bits between the two
+  // precisions lead the coarse rank's bit string
+  int32_t index = fine >> shift;
+  uint32_t middle = fine & ((1U << shift) - 1);
+  uint32_t coarse = middle ? Util::CountLeadingZeros(middle) - (64 - shift) + 1
+                           : shift + rank;
+  if (coarse > getReg(index)) {
+    setReg(index, coarse);
+  }
 }
 
 template <typename T, typename hash_t>
@@ -107,96 +256,334 @@ void HyperLogLog<T, hash_t>::update(const FlowKey<key_len> &flowkey) {
 
   // ignore potential pkt_size because HyperLogLog focus on cardinality
 
-  uint32_t hash_res_ = static_cast<uint32_t>(hash_fns_[0](flowkey));
+  uint64_t hash = Util::Mix64(hash_fns_[0](flowkey));
 
-  // set hash result to uint32_t
+  if (regs_) {
+    int32_t index = static_cast<int32_t>(hash >> (64 - log2_depth_));
 
-  int32_t index_ = hash_res_ & ((1 << log2_depth_) - 1);
+    // a guard bit below the remaining bits caps the rank at 65 - log2_depth_
 
-  uint32_t string_ = hash_res_ >> log2_depth_;
+    uint64_t rest = (hash << log2_depth_) | (1ULL << (log2_depth_ - 1));
+
+    uint32_t rank = Util::CountLeadingZeros(rest) + 1;
+
+    if (rank > getReg(index)) {
+      setReg(index, rank);
+    }
+    return;
+  }
+
+  uint32_t index = static_cast<uint32_t>(hash >> (64 - SPARSE_PRECISION));
+
+  uint64_t rest = (hash << SPARSE_PRECISION) | (1ULL << (SPARSE_PRECISION - 1));
+
+  pending_.push_back((index << REG_BITS) | (Util::CountLeadingZeros(rest) + 1));
+
+  // merge in batches of a quarter of the list, so merging stays amortised
+  // O(log n) per update and the buffer small next to the list
+  if (pending_.size() >= std::max<size_t>(8, sparse_.size() / 4)) {
+    mergePending();
+    if (sparse_.size() > static_cast<size_t>(sparse_limit_)) {
+      toDense();
+    }
+  }
+}
 
-  int32_t cur_pos_ = pos_HyperLogLog(string_, 32 - log2_depth_);
+template <typename T, typename hash_t>
+void HyperLogLog<T, hash_t>::mergePending() {
+  if (pending_.empty()) {
+    return;
+  }
+  std::sort(pending_.begin(), pending_.end());
+  size_t old_size = sparse_.size();
+  // grow exactly, so the list never holds more than it needs
+  sparse_.reserve(old_size + pending_.size());
+  sparse_.insert(sparse_.end(), pending_.begin(), pending_.end());
+  std::inplace_merge(sparse_.begin(), sparse_.begin() + old_size,
+                     sparse_.end());
+  pending_.clear();
+  // equal indices are adjacent with ascending rank; keep the last one
+  size_t out = 0;
+  for (size_t i = 0; i < sparse_.size(); ++i) {
+    if (i + 1 < sparse_.size() &&
+        (sparse_[i] >> REG_BITS) == (sparse_[i + 1] >> REG_BITS)) {
+      continue;
+    }
+    sparse_[out++] = sparse_[i];
+  }
+  sparse_.resize(out);
+}
 
-  max_pos_[index_] = std::max(max_pos_[index_], cur_pos_);
+template <typename T, typename hash_t> void HyperLogLog<T, hash_t>::toDense() {
+  mergePending();
+  regs_ = new uint8_t[nbytes_]();
+  for (uint32_t entry : sparse_) {
+    foldReg(entry >> REG_BITS, entry & REG_MASK,
+            SPARSE_PRECISION - log2_depth_);
+  }
+  std::vector<uint32_t>().swap(sparse_);
+  std::vector<uint32_t>().swap(pending_);
 }
 
-double negpwr2_HyperLogLog(int32_t e) {
-  double negpwr2_ = 1.;
-  while (e > 0) {
-    negpwr2_ /= 2.;
-    e--;
+template <typename T, typename hash_t>
+void HyperLogLog<T, hash_t>::reduce(int32_t log2_depth) {
+  const int32_t shift = log2_depth_ - log2_depth;
+  log2_depth_ = log2_depth;
+  depth_ = 1 << log2_depth_;
+  nbytes_ = depth_ * REG_BITS / 8 + 1;
+  // sparse entries do not depend on the dense precision
+  if (!regs_) {
+    return;
+  }
+  uint8_t *old = regs_;
+  regs_ = new uint8_t[nbytes_]();
+  for (int32_t j = 0; j < (depth_ << shift); ++j) {
+    uint32_t rank = getReg(old, j);
+    if (rank) {
+      foldReg(j, rank, shift);
+    }
   }
-  return negpwr2_;
+  delete[] old;
 }
 
-template <typename T, typename hash_t> T HyperLogLog<T, hash_t>::query() const {
-  double E_ = 0;
+template <typename T, typename hash_t>
+bool HyperLogLog<T, hash_t>::compatible(const HyperLogLog &other) const {
+  return Util::SameHashes(hash_fns_, other.hash_fns_, 1);
+}
+
+template <typename T, typename hash_t>
+void HyperLogLog<T, hash_t>::merge(const HyperLogLog &other) {
+  if (!compatible(other)) {
+    throw std::invalid_argument(
+        "HyperLogLog: operands use different hash functions");
+  }
+  if (&other == this) {
+    return;
+  }
+  if (other.log2_depth_ < log2_depth_) {
+    reduce(other.log2_depth_);
+  }
+
+  if (!other.regs_) {
+    if (!regs_) {
+      pending_.insert(pending_.end(), other.sparse_.begin(),
+                      other.sparse_.end());
+      pending_.insert(pending_.end(), other.pending_.begin(),
+                      other.pending_.end());
+      mergePending();
+      if (sparse_.size() > static_cast<size_t>(sparse_limit_)) {
+        toDense();
+      }
+      return;
+    }
+    const int32_t shift = SPARSE_PRECISION - log2_depth_;
+    for (uint32_t entry : other.sparse_) {
+      foldReg(entry >> REG_BITS, entry & REG_MASK, shift);
+    }
+    for (uint32_t entry : other.pending_) {
+      foldReg(entry >> REG_BITS, entry & REG_MASK, shift);
+    }
+    return;
+  }
+
+  if (!regs_) {
+    toDense();
+  }
 
-  for (int32_t index_ = 0; index_ < depth_; index_++) {
-    E_ += negpwr2_HyperLogLog(max_pos_[index_]);
+  if (other.log2_depth_ > log2_depth_) {
+    const int32_t shift = other.log2_depth_ - log2_depth_;
+    for (int32_t j = 0; j < other.depth_; ++j) {
+      uint32_t rank = other.getReg(j);
+      if (rank) {
+        foldReg(j, rank, shift);
+      }
+    }
+    return;
   }
 
-  double depth_float_ = static_cast<double>(depth_);
+  // same precision, in groups of 16 registers (12 bytes) split into two
+  // 48-bit words; the byte order of the packing is that of a little-endian
+  // load, as MurmurHash also assumes
+  const int32_t n = depth_ * REG_BITS / 8;
+  int32_t i = 0;
+#ifdef __AVX2__
+  // two groups per step, one per 128-bit lane, spread to four 64-bit words;
+  // each lane is stored back as 8 + 4 bytes, so the next step's loads never
+  // overlap a pending store
+  const __m256i spread = _mm256_setr_epi8(
+      0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1, //
+      0, 1, 2, 3, 4, 5, -1, -1, 6, 7, 8, 9, 10, 11, -1, -1);
+  const __m256i gather = _mm256_setr_epi8(
+      0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1, //
+      0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1);
+  for (; i + 28 <= n; i += 24) {
+    __m256i a = _mm256_loadu2_m128i(
+        reinterpret_cast<const __m128i *>(regs_ + i + 12),
+        reinterpret_cast<const __m128i *>(regs_ + i));
+    __m256i b = _mm256_loadu2_m128i(
+        reinterpret_cast<const __m128i *>(other.regs_ + i + 12),
+        reinterpret_cast<const __m128i *>(other.regs_ + i));
+    __m256i res = _mm256_shuffle_epi8(
+        maxRegs(_mm256_shuffle_epi8(a, spread), _mm256_shuffle_epi8(b, spread)),
+        gather);
+    for (int32_t lane = 0; lane < 2; ++lane) {
+      __m128i half = lane ? _mm256_extracti128_si256(res, 1)
+                          : _mm256_castsi256_si128(res);
+      uint32_t rest = static_cast<uint32_t>(_mm_extract_epi32(half, 2));
+      _mm_storel_epi64(reinterpret_cast<__m128i *>(regs_ + i + 12 * lane),
+                       half);
+      std::memcpy(regs_ + i + 12 * lane + 8, &rest, 4);
+    }
+  }
+#endif
+  for (; i < n; i += 12) {
+    // 8-byte loads at i and i + 4; the second holds registers 8..15 above
+    // its low 16 bits. Nothing is reloaded after a store, so the narrower
+    // stores do not stall the next loads.
+    uint64_t a[2], b[2];
+    std::memcpy(&a[0], regs_ + i, 8);
+    std::memcpy(&a[1], regs_ + i + 4, 8);
+    std::memcpy(&b[0], other.regs_ + i, 8);
+    std::memcpy(&b[1], other.regs_ + i + 4, 8);
+    uint64_t lo = maxRegs(a[0], b[0]);
+    uint64_t hi = maxRegs(a[1] >> 16, b[1] >> 16);
+    uint64_t word = lo | (hi << 48);
+    uint32_t rest = static_cast<uint32_t>(hi >> 16);
+    std::memcpy(regs_ + i, &word, 8);
+    std::memcpy(regs_ + i + 8, &rest, 4);
+  }
+}
 
-  E_ = 1. / E_;
+template <typename T, typename hash_t>
+T HyperLogLog<T, hash_t>::queryUnion(const HyperLogLog &other) const {
+  HyperLogLog<T, hash_t> u(*this);
+  u.merge(other);
+  return u.query();
+}
 
-  E_ *= alpha_ * depth_float_ * depth_float_;
+template <typename T, typename hash_t>
+T HyperLogLog<T, hash_t>::queryIntersection(const HyperLogLog &other) const {
+  double inter = static_cast<double>(query()) +
+                 static_cast<double>(other.query()) -
+                 static_cast<double>(queryUnion(other));
+  return static_cast<T>(std::max(0., inter));
+}
 
-  double Boundary1_ = depth_float_ * 2.5;
+template <typename T, typename hash_t>
+double HyperLogLog<T, hash_t>::sparseEstimate() const {
+  // distinct indices of sparse_ and pending_ together
+  std::vector<uint32_t> fresh(pending_);
+  for (uint32_t &entry : fresh) {
+    entry >>= REG_BITS;
+  }
+  std::sort(fresh.begin(), fresh.end());
+  fresh.erase(std::unique(fresh.begin(), fresh.end()), fresh.end());
+  size_t distinct = sparse_.size();
+  for (uint32_t index : fresh) {
+    auto it =
+        std::lower_bound(sparse_.begin(), sparse_.end(), index << REG_BITS);
+    distinct += (it == sparse_.end() || (*it >> REG_BITS) != index);
+  }
+  // linear counting over 2^SPARSE_PRECISION buckets
+  double m = static_cast<double>(1 << SPARSE_PRECISION);
+  return m * std::log(m / (m - distinct));
+}
 
-  double Boundary2_ = 65536. * 65536. / 30.;
+template <typename T, typename hash_t>
+double HyperLogLog<T, hash_t>::denseEstimate() const {
+  // histogram of register values; depth_ is a multiple of 4, and four
+  // registers are exactly three bytes. One histogram per slot of the word,
+  // so runs of equal registers do not serialise on one counter.
+
+  int32_t count[4][REG_MASK + 1] = {};
+
+  for (const uint8_t *p = regs_; p < regs_ + depth_ * REG_BITS / 8; p += 3) {
+    uint32_t word = p[0] | (p[1] << 8) | (p[2] << 16);
+    ++count[0][word & REG_MASK];
+    ++count[1][(word >> REG_BITS) & REG_MASK];
+    ++count[2][(word >> (2 * REG_BITS)) & REG_MASK];
+    ++count[3][word >> (3 * REG_BITS)];
+  }
 
-  double Estar_ = E_;
+  int32_t hist[REG_MASK + 1];
 
-  if (E_ <= Boundary1_) {
-    int32_t V_ = 0;
+  for (int32_t k = 0; k <= static_cast<int32_t>(REG_MASK); ++k) {
+    hist[k] = count[0][k] + count[1][k] + count[2][k] + count[3][k];
+  }
 
-    for (int32_t index_ = 0; index_ < depth_; index_++) {
-      if (max_pos_[index_] == 0)
-        V_++;
+  const int32_t q = 64 - log2_depth_; // ranks are 0 .. q + 1
 
-      // count empty registers
-    }
+  const double m = depth_;
 
-    if (V_ > 0) {
-      Estar_ = log(depth_float_ / static_cast<double>(V_)) * depth_float_;
-    }
+  // m * tau(1 - hist[q + 1] / m), for registers at the largest rank
 
-    else {
-      Estar_ = E_;
-    }
+  double x = 1. - hist[q + 1] / m, z = 0;
 
-    // small range correction
+  if (x > 0 && x < 1) {
+    double y = 1, prev;
+    z = 1 - x;
+    do {
+      x = std::sqrt(x);
+      prev = z;
+      y *= 0.5;
+      z -= (1 - x) * (1 - x) * y;
+    } while (z != prev);
+    z /= 3;
   }
 
-  else if (E_ <= Boundary2_) {
-    Estar_ = E_;
+  z *= m;
 
-    // intermediate range - no correction
+  for (int32_t k = q; k >= 1; --k) {
+    z = 0.5 * (z + hist[k]);
   }
 
-  else {
-    Estar_ = 0. - 65536. * 65536. * log(1. - E_ / 65536. / 65536.);
+  // m * sigma(hist[0] / m), for empty registers
+
+  x = hist[0] / m;
 
-    // large range correction
+  if (x == 1) {
+    return 0;
   }
 
-  return static_cast<T>(Estar_);
+  double y = 1, sigma = x, prev;
+
+  do {
+    x *= x;
+    prev = sigma;
+    sigma += x * y;
+    y += y;
+  } while (sigma != prev);
+
+  z += m * sigma;
+
+  return 0.5 / std::log(2.) * m * m / z;
+}
+
+template <typename T, typename hash_t> T HyperLogLog<T, hash_t>::query() const {
+  return static_cast<T>(regs_ ? denseEstimate() : sparseEstimate());
 }
 
 template <typename T, typename hash_t>
 size_t HyperLogLog<T, hash_t>::size() const {
   return sizeof(HyperLogLog<T, hash_t>) // Instance
          + 1 * sizeof(hash_t)           // hash_fns
-         + depth_ * sizeof(uint32_t);   // maximizer
+         + (regs_ ? nbytes_ : 0)        // registers
+         + (sparse_.capacity() + pending_.capacity()) *
+               sizeof(uint32_t); // sparse list
 }
 
 template <typename T, typename hash_t> void HyperLogLog<T, hash_t>::clear() {
-  for (int32_t index_ = 0; index_ < depth_; index_++) {
-    max_pos_[index_] = 0;
+  std::vector<uint32_t>().swap(sparse_);
+  std::vector<uint32_t>().swap(pending_);
+  if (sparse_limit_ > 0) {
+    // back to sparse mode
+    delete[] regs_;
+    regs_ = nullptr;
+  } else {
+    std::fill(regs_, regs_ + nbytes_, 0);
   }
 }
 
 } // namespace SketchLab
 
-#endif // SKETCHLAB_CPP_HyperLogLog_H
\ No newline at end of file
+#endif // SKETCHLAB_CPP_HyperLogLog_H
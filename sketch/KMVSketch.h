@@ -0,0 +1,247 @@
+#ifndef SKETCHLAB_CPP_KMVSKETCH_H
+#define SKETCHLAB_CPP_KMVSKETCH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "hash.h"
+#include "util.h"
+
+namespace SketchLab {
+
+/*
+ * K-Minimum-Values sketch (Bar-Yossef et al. 2002; set operations from
+ * Beyer et al., "On synopses for distinct-value estimation under multiset
+ * operations", 2007).
+ *
+ * Keeps the k_ smallest distinct 64-bit key hashes; with U the k-th smallest
+ * as a fraction of 2^64 the estimate is (k_ - 1) / U, exact below k_ keys.
+ *
+ * Once k_ hashes are known every key at or above the current k-th minimum
+ * (threshold_) is dropped after a single compare, which is nearly every key
+ * of a long stream. Smaller hashes, duplicates included, are appended to a
+ * buffer behind the sorted minima; a full buffer is sorted and merged in,
+ * which costs amortised O(log k_) per buffered key.
+ *
+ * Instances with the same hash function (copies of one KMVSketch, possibly
+ * with a different k) support union, intersection and Jaccard estimates,
+ * taken over the min(k) smallest hashes of the union.
+ */
+template <typename T, typename hash_t> class KMVSketch {
+  int32_t k_;
+
+  hash_t *hash_fns_;
+
+  // vals_[0, count_) sorted distinct minima, vals_[count_, count_ + nbuf_)
+  // unsorted buffer; 2 * k_ entries
+  uint64_t *vals_;
+
+  int32_t count_;
+
+  int32_t nbuf_;
+
+  uint64_t threshold_;
+
+  void insert(uint64_t hash);
+  void compact();
+  std::vector<uint64_t> values() const;
+  static double estimate(const uint64_t *vals, size_t n, int32_t k);
+  void checkCompatible(const KMVSketch &other) const;
+  // the min(k) smallest hashes of the union; counts those in both in common
+  std::vector<uint64_t> unionValues(const KMVSketch &other,
+                                    int32_t &common) const;
+
+public:
+  KMVSketch(int32_t k);
+  KMVSketch(const KMVSketch &other);
+  ~KMVSketch();
+  KMVSketch &operator=(const KMVSketch &) = delete;
+
+  template <int32_t key_len> void update(const FlowKey<key_len> &flowkey);
+  T query() const;
+  // Set operations on instances with the same hash function; others throw
+  // std::invalid_argument. merge keeps this sketch's k.
+  bool compatible(const KMVSketch &other) const;
+  void merge(const KMVSketch &other);
+  T queryUnion(const KMVSketch &other) const;
+  T queryIntersection(const KMVSketch &other) const;
+  double jaccard(const KMVSketch &other) const;
+  size_t size() const;
+  void clear();
+};
+
+template <typename T, typename hash_t>
+KMVSketch<T, hash_t>::KMVSketch(int32_t k)
+    : k_(std::max<int32_t>(k, 2)), count_(0), nbuf_(0),
+      threshold_(std::numeric_limits<uint64_t>::max()) {
+  hash_fns_ = new hash_t[1];
+  vals_ = new uint64_t[2 * k_];
+}
+
+template <typename T, typename hash_t>
+KMVSketch<T, hash_t>::KMVSketch(const KMVSketch &other)
+    : k_(other.k_), count_(other.count_), nbuf_(other.nbuf_),
+      threshold_(other.threshold_) {
+  hash_fns_ = new hash_t[1]{other.hash_fns_[0]};
+  vals_ = new uint64_t[2 * k_];
+  std::copy(other.vals_, other.vals_ + count_ + nbuf_, vals_);
+}
+
+template <typename T, typename hash_t> KMVSketch<T, hash_t>::~KMVSketch() {
+  delete[] hash_fns_;
+  delete[] vals_;
+}
+
+template <typename T, typename hash_t>
+void KMVSketch<T, hash_t>::insert(uint64_t hash) {
+  if (hash >= threshold_) {
+    return;
+  }
+  vals_[count_ + nbuf_++] = hash;
+  if (count_ + nbuf_ == 2 * k_) {
+    compact();
+  }
+}
+
+template <typename T, typename hash_t> void KMVSketch<T, hash_t>::compact() {
+  uint64_t *end = vals_ + count_ + nbuf_;
+  std::sort(vals_ + count_, end);
+  std::inplace_merge(vals_, vals_ + count_, end);
+  end = std::unique(vals_, end);
+  count_ = std::min<int32_t>(k_, end - vals_);
+  nbuf_ = 0;
+  if (count_ == k_) {
+    threshold_ = vals_[k_ - 1];
+  }
+}
+
+template <typename T, typename hash_t>
+std::vector<uint64_t> KMVSketch<T, hash_t>::values() const {
+  std::vector<uint64_t> vals(vals_, vals_ + count_ + nbuf_);
+  std::sort(vals.begin() + count_, vals.end());
+  std::inplace_merge(vals.begin(), vals.begin() + count_, vals.end());
+  vals.erase(std::unique(vals.begin(), vals.end()), vals.end());
+  vals.resize(std::min<size_t>(k_, vals.size()));
+  return vals;
+}
+
+template <typename T, typename hash_t>
+double KMVSketch<T, hash_t>::estimate(const uint64_t *vals, size_t n,
+                                      int32_t k) {
+  if (n < static_cast<size_t>(k)) {
+    return static_cast<double>(n);
+  }
+  // (k - 1) / U with U = (vals[k - 1] + 1) / 2^64
+  return std::ldexp(k - 1., 64) / (static_cast<double>(vals[k - 1]) + 1);
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+void KMVSketch<T, hash_t>::update(const FlowKey<key_len> &flowkey) {
+  insert(Util::Mix64(hash_fns_[0](flowkey)));
+}
+
+template <typename T, typename hash_t> T KMVSketch<T, hash_t>::query() const {
+  if (!nbuf_) {
+    return static_cast<T>(estimate(vals_, count_, k_));
+  }
+  std::vector<uint64_t> vals = values();
+  return static_cast<T>(estimate(vals.data(), vals.size(), k_));
+}
+
+template <typename T, typename hash_t>
+bool KMVSketch<T, hash_t>::compatible(const KMVSketch &other) const {
+  return Util::SameHashes(hash_fns_, other.hash_fns_, 1);
+}
+
+template <typename T, typename hash_t>
+void KMVSketch<T, hash_t>::checkCompatible(const KMVSketch &other) const {
+  if (!compatible(other)) {
+    throw std::invalid_argument(
+        "KMVSketch: operands use different hash functions");
+  }
+}
+
+template <typename T, typename hash_t>
+void KMVSketch<T, hash_t>::merge(const KMVSketch &other) {
+  checkCompatible(other);
+  if (&other == this) {
+    return;
+  }
+  for (uint64_t hash : other.values()) {
+    insert(hash);
+  }
+}
+
+template <typename T, typename hash_t>
+std::vector<uint64_t> KMVSketch<T, hash_t>::unionValues(const KMVSketch &other,
+                                                        int32_t &common) const {
+  checkCompatible(other);
+  std::vector<uint64_t> a = values(), b = other.values();
+  const size_t k = std::min(k_, other.k_);
+  std::vector<uint64_t> vals;
+  vals.reserve(k);
+  common = 0;
+  auto i = a.begin(), j = b.begin();
+  while (vals.size() < k && (i != a.end() || j != b.end())) {
+    if (j == b.end() || (i != a.end() && *i < *j)) {
+      vals.push_back(*i++);
+    } else if (i == a.end() || *j < *i) {
+      vals.push_back(*j++);
+    } else {
+      vals.push_back(*i++);
+      ++j;
+      ++common;
+    }
+  }
+  return vals;
+}
+
+template <typename T, typename hash_t>
+T KMVSketch<T, hash_t>::queryUnion(const KMVSketch &other) const {
+  int32_t common;
+  std::vector<uint64_t> vals = unionValues(other, common);
+  return static_cast<T>(
+      estimate(vals.data(), vals.size(), std::min(k_, other.k_)));
+}
+
+template <typename T, typename hash_t>
+T KMVSketch<T, hash_t>::queryIntersection(const KMVSketch &other) const {
+  int32_t common;
+  std::vector<uint64_t> vals = unionValues(other, common);
+  if (vals.empty()) {
+    return 0;
+  }
+  // below k the union, and so the intersection, is exact
+  return static_cast<T>(
+      estimate(vals.data(), vals.size(), std::min(k_, other.k_)) * common /
+      vals.size());
+}
+
+template <typename T, typename hash_t>
+double KMVSketch<T, hash_t>::jaccard(const KMVSketch &other) const {
+  int32_t common;
+  std::vector<uint64_t> vals = unionValues(other, common);
+  return vals.empty() ? 0 : static_cast<double>(common) / vals.size();
+}
+
+template <typename T, typename hash_t>
+size_t KMVSketch<T, hash_t>::size() const {
+  return sizeof(KMVSketch<T, hash_t>) // Instance
+         + sizeof(hash_t)             // hash_fns
+         + 2 * k_ * sizeof(uint64_t); // minima and buffer
+}
+
+template <typename T, typename hash_t> void KMVSketch<T, hash_t>::clear() {
+  count_ = 0;
+  nbuf_ = 0;
+  threshold_ = std::numeric_limits<uint64_t>::max();
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_KMVSKETCH_H
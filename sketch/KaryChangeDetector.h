@@ -0,0 +1,388 @@
+#ifndef SKETCHLAB_CPP_KARYCHANGEDETECTOR_H
+#define SKETCHLAB_CPP_KARYCHANGEDETECTOR_H
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "FlatHashMap.h"
+#include "KarySketch.h"
+#include "hash.h"
+#include "util.h"
+
+namespace SketchLab {
+
+/*
+ * Sketch-based change detection (Krishnamurthy et al., IMC'03).
+ *
+ * Traffic of the running epoch goes into an observed K-ary sketch S(t). When
+ * the epoch is closed, the forecast sketch Sf(t) is subtracted to give the
+ * error sketch Se(t) = S(t) - Sf(t), and the model produces Sf(t + 1) from
+ * past observed / error sketches. All sketches are copies of one sketch, so
+ * every step is in-place sketch arithmetic and costs O(depth * width) no
+ * matter how many flows the epoch carried.
+ *
+ * Models:
+ *   MA(W)            Sf(t) = (S(t-1) + ... + S(t-W)) / W
+ *   EWMA(a)          Sf(t) = a S(t-1) + (1 - a) Sf(t-1), Sf(2) = S(1)
+ *   NSHW(a, b)       non-seasonal Holt-Winters with smoothing a, trend b
+ *   ARIMA(p, d, q)   d in {0, 1, 2}, AR coefficients p, MA coefficients q
+ *
+ * Keys are reported from a caller-supplied candidate set (e.g. the keys of
+ * the epoch), comparing their estimated error against a threshold; the usual
+ * threshold is a fraction of sqrt(F2) of the error sketch (alarmThreshold).
+ */
+template <typename T, typename hash_t, int32_t DEPTH = 0>
+class KaryChangeDetector {
+  static_assert(std::is_floating_point<T>::value,
+                "forecast sketches need a floating point counter type");
+
+public:
+  typedef KarySketch<T, hash_t, DEPTH> Sketch;
+
+  struct Model {
+    enum Kind { MA, EWMA, NSHW, ARIMA };
+    Kind kind;
+    int32_t window;         // MA
+    double alpha;           // EWMA, NSHW
+    double beta;            // NSHW
+    int32_t d;              // ARIMA
+    std::vector<double> ar; // ARIMA, at most 2
+    std::vector<double> ma; // ARIMA, at most 2
+
+    static Model MovingAverage(int32_t window) {
+      return {MA, window, 0, 0, 0, {}, {}};
+    }
+    static Model Ewma(double alpha) { return {EWMA, 0, alpha, 0, 0, {}, {}}; }
+    static Model HoltWinters(double alpha, double beta) {
+      return {NSHW, 0, alpha, beta, 0, {}, {}};
+    }
+    static Model Arima(int32_t d, std::vector<double> ar,
+                       std::vector<double> ma) {
+      return {ARIMA, 0, 0, 0, d, ar, ma};
+    }
+  };
+
+  KaryChangeDetector(const Model &model, int32_t depth, int32_t width);
+
+  // Add traffic to the running epoch
+  template <int32_t key_len>
+  void update(const FlowKey<key_len> &flowkey, T val);
+  // Close the running epoch. Returns true if it had a forecast, i.e. error()
+  // now describes this epoch; the first epochs only warm the model up.
+  bool endEpoch();
+
+  bool hasError() const { return has_error_; }
+  const Sketch &error() const { return *error_; }
+  // Estimated magnitude of the change of a key in the last closed epoch
+  template <int32_t key_len> T change(const FlowKey<key_len> &flowkey) const;
+  // fraction * sqrt(F2 of the error sketch)
+  double alarmThreshold(double fraction) const;
+  // Candidates whose estimated change is at least threshold
+  template <int32_t key_len>
+  FlatHashMap<key_len, T> changes(const FlowKey<key_len> *candidates, size_t n,
+                                  T threshold) const;
+
+  size_t size() const;
+  void clear();
+
+private:
+  typedef std::unique_ptr<Sketch> SketchPtr;
+
+  Model model_;
+  int32_t epoch_; // closed epochs
+
+  SketchPtr observed_; // S(t), running epoch
+  SketchPtr forecast_; // Sf(t), valid if has_forecast_
+  SketchPtr error_;    // Se of the last closed epoch, valid if has_error_
+  bool has_forecast_;
+  bool has_error_;
+
+  std::deque<SketchPtr> history_; // S(t-1), S(t-2), ... newest first
+  std::deque<SketchPtr> errors_;  // Se(t-1), Se(t-2), ... newest first
+  SketchPtr smooth_;              // NSHW smoothing
+  SketchPtr trend_;               // NSHW trend
+  SketchPtr scratch_;
+
+  // ARIMA forecast as a linear function of history_ and errors_
+  std::vector<double> hist_coeffs_;
+  std::vector<double> err_coeffs_;
+
+  SketchPtr blank() const;
+  // Take the sketch of a closed epoch; recycles the oldest one when full
+  void pushHistory(size_t limit);
+  void forecastNext();
+};
+
+template <typename T, typename hash_t, int32_t DEPTH>
+KaryChangeDetector<T, hash_t, DEPTH>::KaryChangeDetector(const Model &model,
+                                                         int32_t depth,
+                                                         int32_t width)
+    : model_(model), epoch_(0), observed_(new Sketch(depth, width)),
+      has_forecast_(false), has_error_(false) {
+  switch (model_.kind) {
+  case Model::MA:
+    if (model_.window <= 0) {
+      throw std::invalid_argument("KaryChangeDetector: MA window must be > 0");
+    }
+    break;
+  case Model::EWMA:
+  case Model::NSHW:
+    if (model_.alpha < 0 || model_.alpha > 1 || model_.beta < 0 ||
+        model_.beta > 1) {
+      throw std::invalid_argument(
+          "KaryChangeDetector: smoothing parameters must be in [0, 1]");
+    }
+    break;
+  case Model::ARIMA: {
+    if (model_.d < 0 || model_.d > 2 || model_.ar.size() > 2 ||
+        model_.ma.size() > 2) {
+      throw std::invalid_argument(
+          "KaryChangeDetector: ARIMA needs d <= 2, p <= 2, q <= 2");
+    }
+    // Z(t) = sum_k (-1)^k C(d, k) S(t - k) is the differenced series and
+    // Zf(t) = sum_i ar[i] Z(t - i) - sum_j ma[j] Se(t - j); Sf(t) is Zf(t)
+    // plus the part of Z(t) that does not involve S(t).
+    static const int32_t binom[3][3] = {{1, 0, 0}, {1, 1, 0}, {1, 2, 1}};
+    int32_t p = model_.ar.size(), d = model_.d;
+    hist_coeffs_.assign(p + d, 0);
+    for (int32_t k = 1; k <= d; ++k) {
+      hist_coeffs_[k - 1] -= (k & 1 ? -1 : 1) * binom[d][k];
+    }
+    for (int32_t i = 1; i <= p; ++i) {
+      for (int32_t k = 0; k <= d; ++k) {
+        hist_coeffs_[i + k - 1] +=
+            model_.ar[i - 1] * (k & 1 ? -1 : 1) * binom[d][k];
+      }
+    }
+    for (double theta : model_.ma) {
+      err_coeffs_.push_back(-theta);
+    }
+    break;
+  }
+  }
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+typename KaryChangeDetector<T, hash_t, DEPTH>::SketchPtr
+KaryChangeDetector<T, hash_t, DEPTH>::blank() const {
+  // copies share the hash functions, which the arithmetic requires
+  SketchPtr sketch(new Sketch(*observed_));
+  sketch->clear();
+  return sketch;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+template <int32_t key_len>
+void KaryChangeDetector<T, hash_t, DEPTH>::update(
+    const FlowKey<key_len> &flowkey, T val) {
+  observed_->update(flowkey, val);
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+bool KaryChangeDetector<T, hash_t, DEPTH>::endEpoch() {
+  ++epoch_;
+  has_error_ = has_forecast_;
+  if (has_error_) {
+    if (!error_) {
+      error_ = blank();
+    }
+    const Sketch *ops[2] = {observed_.get(), forecast_.get()};
+    const double coeffs[2] = {1, -1};
+    error_->combine(coeffs, ops, 2);
+  }
+  forecastNext();
+  return has_error_;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void KaryChangeDetector<T, hash_t, DEPTH>::pushHistory(size_t limit) {
+  if (limit == 0) {
+    observed_->clear();
+    return;
+  }
+  SketchPtr next;
+  if (history_.size() >= limit) {
+    next = std::move(history_.back());
+    history_.pop_back();
+    next->clear();
+  } else {
+    next = blank();
+  }
+  history_.push_front(std::move(observed_));
+  observed_ = std::move(next);
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void KaryChangeDetector<T, hash_t, DEPTH>::forecastNext() {
+  if (!forecast_) {
+    forecast_ = blank();
+  }
+  switch (model_.kind) {
+  case Model::MA: {
+    pushHistory(model_.window);
+    has_forecast_ = history_.size() == static_cast<size_t>(model_.window);
+    if (has_forecast_) {
+      std::vector<const Sketch *> ops;
+      for (const SketchPtr &s : history_) {
+        ops.push_back(s.get());
+      }
+      std::vector<double> coeffs(ops.size(), 1. / model_.window);
+      forecast_->combine(coeffs.data(), ops.data(), ops.size());
+    }
+    break;
+  }
+  case Model::EWMA: {
+    const Sketch *ops[2] = {observed_.get(), forecast_.get()};
+    const double coeffs[2] = {model_.alpha, 1 - model_.alpha};
+    if (!has_forecast_) {
+      *forecast_ += *observed_; // Sf(2) = S(1)
+    } else {
+      forecast_->combine(coeffs, ops, 2);
+    }
+    has_forecast_ = true;
+    observed_->clear();
+    break;
+  }
+  case Model::NSHW: {
+    if (epoch_ == 1) {
+      smooth_ = blank();
+      *smooth_ += *observed_; // Ss(2) = S(1)
+      observed_->clear();
+      break;
+    }
+    if (epoch_ == 2) {
+      trend_ = blank(); // T(2) = S(2) - S(1), so Sf(2) = S(2)
+      scratch_ = blank();
+      *trend_ += *observed_;
+      *trend_ -= *smooth_;
+      *forecast_ += *observed_;
+    }
+    // Ss(t+1) = a S(t) + (1 - a) Sf(t)
+    const Sketch *ops[3] = {observed_.get(), forecast_.get(), nullptr};
+    double coeffs[3] = {model_.alpha, 1 - model_.alpha, 0};
+    scratch_->combine(coeffs, ops, 2);
+    // T(t+1) = b (Ss(t+1) - Ss(t)) + (1 - b) T(t)
+    ops[0] = scratch_.get();
+    ops[1] = smooth_.get();
+    ops[2] = trend_.get();
+    coeffs[0] = model_.beta;
+    coeffs[1] = -model_.beta;
+    coeffs[2] = 1 - model_.beta;
+    trend_->combine(coeffs, ops, 3);
+    smooth_.swap(scratch_);
+    // Sf(t+1) = Ss(t+1) + T(t+1)
+    ops[0] = smooth_.get();
+    ops[1] = trend_.get();
+    coeffs[0] = coeffs[1] = 1;
+    forecast_->combine(coeffs, ops, 2);
+    has_forecast_ = true;
+    observed_->clear();
+    break;
+  }
+  case Model::ARIMA: {
+    if (has_error_ && !err_coeffs_.empty()) {
+      SketchPtr next;
+      if (errors_.size() >= err_coeffs_.size()) {
+        next = std::move(errors_.back());
+        errors_.pop_back();
+      } else {
+        next = blank();
+      }
+      next->clear();
+      *next += *error_;
+      errors_.push_front(std::move(next));
+    }
+    pushHistory(hist_coeffs_.size());
+    has_forecast_ = history_.size() >= hist_coeffs_.size();
+    if (has_forecast_) {
+      std::vector<const Sketch *> ops;
+      std::vector<double> coeffs;
+      for (size_t i = 0; i < hist_coeffs_.size(); ++i) {
+        ops.push_back(history_[i].get());
+        coeffs.push_back(hist_coeffs_[i]);
+      }
+      // errors before the first forecast are taken as zero
+      for (size_t j = 0; j < errors_.size(); ++j) {
+        ops.push_back(errors_[j].get());
+        coeffs.push_back(err_coeffs_[j]);
+      }
+      forecast_->combine(coeffs.data(), ops.data(), ops.size());
+    }
+    break;
+  }
+  }
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+template <int32_t key_len>
+T KaryChangeDetector<T, hash_t, DEPTH>::change(
+    const FlowKey<key_len> &flowkey) const {
+  return has_error_ ? error_->query(flowkey) : 0;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+double KaryChangeDetector<T, hash_t, DEPTH>::alarmThreshold(
+    double fraction) const {
+  if (!has_error_) {
+    return 0;
+  }
+  return fraction * std::sqrt(std::max(0., error_->estimateF2()));
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+template <int32_t key_len>
+FlatHashMap<key_len, T> KaryChangeDetector<T, hash_t, DEPTH>::changes(
+    const FlowKey<key_len> *candidates, size_t n, T threshold) const {
+  FlatHashMap<key_len, T> changers;
+  if (!has_error_) {
+    return changers;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    T delta = error_->query(candidates[i]);
+    if (delta >= threshold) {
+      changers.emplace(candidates[i], delta);
+    }
+  }
+  return changers;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+size_t KaryChangeDetector<T, hash_t, DEPTH>::size() const {
+  size_t total = sizeof(KaryChangeDetector<T, hash_t, DEPTH>);
+  const SketchPtr *singles[] = {&observed_, &forecast_, &error_,
+                                &smooth_,   &trend_,    &scratch_};
+  for (const SketchPtr *s : singles) {
+    total += *s ? (*s)->size() : 0;
+  }
+  for (const SketchPtr &s : history_) {
+    total += s->size();
+  }
+  for (const SketchPtr &s : errors_) {
+    total += s->size();
+  }
+  return total;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void KaryChangeDetector<T, hash_t, DEPTH>::clear() {
+  observed_->clear();
+  // the warm-up epochs add onto forecast_, so it must start out blank
+  forecast_.reset();
+  error_.reset();
+  history_.clear();
+  errors_.clear();
+  smooth_.reset();
+  trend_.reset();
+  scratch_.reset();
+  epoch_ = 0;
+  has_forecast_ = has_error_ = false;
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_KARYCHANGEDETECTOR_H
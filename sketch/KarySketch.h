@@ -2,91 +2,220 @@
 #define SKETCHLAB_CPP_KARYSKETCH_H
 
 #include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
 
 #include "hash.h"
 #include "util.h"
 namespace SketchLab {
-template <typename T, typename hash_t> class KarySketch {
+template <typename T, typename hash_t, int32_t DEPTH = 0> class KarySketch {
 private:
   int32_t depth_;
   int32_t width_;
-  hash_t *hash_fns_;
+
+  // Row count; a compile-time constant when DEPTH > 0, so the per-row
+  // loops unroll and their indices stay in registers
+  int32_t depth() const { return DEPTH > 0 ? DEPTH : depth_; }
+  std::vector<hash_t> hash_fns_;
   T **arr_;
-  int32_t sum_;
-  T *values_;
+  T sum_;
+
+  void checkCompatible(const KarySketch &other) const;
 
 public:
   KarySketch(int32_t depth, int32_t width);
   ~KarySketch();
-  KarySketch(const KarySketch &) = delete;
+  KarySketch(const KarySketch &other);
   KarySketch(KarySketch &&) = delete;
   KarySketch &operator=(KarySketch) = delete;
 
   template <int32_t key_len>
   void update(const FlowKey<key_len> &flowkey, T val);
   template <int32_t key_len> T query(const FlowKey<key_len> &flowkey) const;
+  // Unbiased estimate of the second moment (sum of squared values)
+  double estimateF2() const;
+  // Linear arithmetic on sketches with the same depth, width and hash
+  // functions, i.e. copies of one sketch (copy it, then clear() it to start
+  // a new epoch). Operands that differ throw std::invalid_argument.
+  bool compatible(const KarySketch &other) const;
+  KarySketch &operator+=(const KarySketch &other);
+  KarySketch &operator-=(const KarySketch &other);
+  KarySketch &operator*=(double scale);
+  // *this = coeffs[0] * sketches[0] + ... + coeffs[n - 1] * sketches[n - 1]
+  void combine(const double *coeffs, const KarySketch *const *sketches,
+               int32_t n);
+
   size_t size() const;
   void clear();
 };
 
-template <typename T, typename hash_t>
-KarySketch<T, hash_t>::KarySketch(int32_t depth, int32_t width)
+// Depth fixed at compile time, e.g. KarySketchN<T, hash_t, 4>
+template <typename T, typename hash_t, int32_t depth>
+using KarySketchN = KarySketch<T, hash_t, depth>;
+
+template <typename T, typename hash_t, int32_t DEPTH>
+KarySketch<T, hash_t, DEPTH>::KarySketch(int32_t depth, int32_t width)
     : depth_(depth), width_(Util::NextPrime(width)), sum_(0) {
+  if (DEPTH > 0 && depth != DEPTH) {
+    throw std::invalid_argument("KarySketch: depth does not match DEPTH");
+  }
+  if (depth_ <= 0 || depth_ > Util::MAX_DEPTH) {
+    throw std::invalid_argument("KarySketch: depth must be in [1, " +
+                                std::to_string(Util::MAX_DEPTH) + "]");
+  }
 
-  hash_fns_ = new hash_t[depth_];
+  hash_fns_.resize(depth_);
   // Allocate continuous memory
   arr_ = new T *[depth_];
   arr_[0] = new T[depth_ * width_](); // Init with zero
   for (int32_t i = 1; i < depth_; ++i) {
     arr_[i] = arr_[i - 1] + width_;
   }
-  values_ = new T[depth_];
 }
 
-template <typename T, typename hash_t> KarySketch<T, hash_t>::~KarySketch() {
-  delete[] hash_fns_;
+template <typename T, typename hash_t, int32_t DEPTH>
+KarySketch<T, hash_t, DEPTH>::KarySketch(const KarySketch &other)
+    : depth_(other.depth_), width_(other.width_),
+      hash_fns_(other.hash_fns_), sum_(other.sum_) {
+  arr_ = new T *[depth_];
+  arr_[0] = new T[depth_ * width_];
+  for (int32_t i = 1; i < depth_; ++i) {
+    arr_[i] = arr_[i - 1] + width_;
+  }
+  std::copy(other.arr_[0], other.arr_[0] + depth_ * width_, arr_[0]);
+}
 
+template <typename T, typename hash_t, int32_t DEPTH>
+KarySketch<T, hash_t, DEPTH>::~KarySketch() {
   delete[] arr_[0];
   delete[] arr_;
-  delete[] values_;
 }
 
-template <typename T, typename hash_t>
+template <typename T, typename hash_t, int32_t DEPTH>
 template <int32_t key_len>
-void KarySketch<T, hash_t>::update(const FlowKey<key_len> &flowkey, T val) {
+void KarySketch<T, hash_t, DEPTH>::update(const FlowKey<key_len> &flowkey,
+                                          T val) {
   sum_ += val;
-  for (int32_t i = 0; i < depth_; ++i) {
+  for (int32_t i = 0; i < depth(); ++i) {
     int32_t index = hash_fns_[i](flowkey) % width_;
     arr_[i][index] += val;
   }
 }
 
-template <typename T, typename hash_t>
+template <typename T, typename hash_t, int32_t DEPTH>
 template <int32_t key_len>
-T KarySketch<T, hash_t>::query(const FlowKey<key_len> &flowkey) const {
-  for (int32_t i = 0; i < depth_; ++i) {
+T KarySketch<T, hash_t, DEPTH>::query(const FlowKey<key_len> &flowkey) const {
+  T values[Util::MAX_DEPTH];
+  for (int32_t i = 0; i < depth(); ++i) {
     int32_t idx = hash_fns_[i](flowkey) % width_;
-    values_[i] = (arr_[i][idx] - 1. * sum_ / width_) / (1. - 1. / width_);
+    values[i] = (arr_[i][idx] - 1. * sum_ / width_) / (1. - 1. / width_);
   }
-  std::sort(values_, values_ + depth_);
-  if (depth_ & 1) {
-    return std::abs(values_[depth_ / 2]);
-  } else {
-    return std::abs(values_[depth_ / 2 - 1] + values_[depth_ / 2]) / 2;
+  return std::abs(Util::Median(values, depth()));
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+double KarySketch<T, hash_t, DEPTH>::estimateF2() const {
+  double values[Util::MAX_DEPTH];
+  for (int32_t i = 0; i < depth(); ++i) {
+    double sq = 0;
+    for (int32_t j = 0; j < width_; ++j) {
+      sq += 1. * arr_[i][j] * arr_[i][j];
+    }
+    values[i] = (sq * width_ - 1. * sum_ * sum_) / (width_ - 1.);
   }
+  return Util::Median(values, depth());
 }
 
-template <typename T, typename hash_t>
-size_t KarySketch<T, hash_t>::size() const {
-  return sizeof(KarySketch<T, hash_t>)  // Instance
-         + depth_ * sizeof(hash_t)      // hash_fns
-         + depth_ * width_ * sizeof(T); // counter
+template <typename T, typename hash_t, int32_t DEPTH>
+size_t KarySketch<T, hash_t, DEPTH>::size() const {
+  return sizeof(KarySketch<T, hash_t, DEPTH>) // Instance
+         + depth() * sizeof(hash_t)           // hash_fns
+         + depth() * width_ * sizeof(T);      // counter
 }
 
-template <typename T, typename hash_t> void KarySketch<T, hash_t>::clear() {
-  std::fill(arr_[0], arr_[0] + depth_ * width_, 0);
+template <typename T, typename hash_t, int32_t DEPTH>
+void KarySketch<T, hash_t, DEPTH>::clear() {
+  std::fill(arr_[0], arr_[0] + depth() * width_, 0);
   sum_ = 0;
 }
+
+template <typename T, typename hash_t, int32_t DEPTH>
+bool KarySketch<T, hash_t, DEPTH>::compatible(const KarySketch &other) const {
+  return depth() == other.depth() && width_ == other.width_ &&
+         Util::SameHashes(hash_fns_.data(), other.hash_fns_.data(), depth());
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void KarySketch<T, hash_t, DEPTH>::checkCompatible(
+    const KarySketch &other) const {
+  if (!compatible(other)) {
+    throw std::invalid_argument(
+        "KarySketch: operands differ in dimensions or hash functions");
+  }
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+KarySketch<T, hash_t, DEPTH> &
+KarySketch<T, hash_t, DEPTH>::operator+=(const KarySketch &other) {
+  checkCompatible(other);
+  T *dst = arr_[0];
+  const T *src = other.arr_[0];
+  // plain contiguous loop, left to the auto-vectorizer
+  for (int64_t i = 0, n = int64_t(depth()) * width_; i < n; ++i) {
+    dst[i] += src[i];
+  }
+  sum_ += other.sum_;
+  return *this;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+KarySketch<T, hash_t, DEPTH> &
+KarySketch<T, hash_t, DEPTH>::operator-=(const KarySketch &other) {
+  checkCompatible(other);
+  T *dst = arr_[0];
+  const T *src = other.arr_[0];
+  for (int64_t i = 0, n = int64_t(depth()) * width_; i < n; ++i) {
+    dst[i] -= src[i];
+  }
+  sum_ -= other.sum_;
+  return *this;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+KarySketch<T, hash_t, DEPTH> &
+KarySketch<T, hash_t, DEPTH>::operator*=(double scale) {
+  T *dst = arr_[0];
+  for (int64_t i = 0, n = int64_t(depth()) * width_; i < n; ++i) {
+    dst[i] = static_cast<T>(dst[i] * scale);
+  }
+  sum_ = static_cast<T>(sum_ * scale);
+  return *this;
+}
+
+template <typename T, typename hash_t, int32_t DEPTH>
+void KarySketch<T, hash_t, DEPTH>::combine(const double *coeffs,
+                                           const KarySketch *const *sketches,
+                                           int32_t n) {
+  for (int32_t k = 0; k < n; ++k) {
+    checkCompatible(*sketches[k]);
+  }
+  // counter by counter, so *this may also appear among the operands
+  T *dst = arr_[0];
+  for (int64_t i = 0, m = int64_t(depth()) * width_; i < m; ++i) {
+    double acc = 0;
+    for (int32_t k = 0; k < n; ++k) {
+      acc += coeffs[k] * sketches[k]->arr_[0][i];
+    }
+    dst[i] = static_cast<T>(acc);
+  }
+  double sum = 0;
+  for (int32_t k = 0; k < n; ++k) {
+    sum += coeffs[k] * sketches[k]->sum_;
+  }
+  sum_ = static_cast<T>(sum);
+}
+
 } // namespace SketchLab
 
 #endif
\ No newline at end of file
@@ -6,9 +6,12 @@
 #define SKETCHLAB_CPP_LDSKETCH_H
 
 #include <algorithm>
-#include <map>
 #include <vector>
 
+#include "FlatHashMap.h"
+#include "hash.h"
+#include "util.h"
+
 namespace SketchLab {
 
 template <typename T, typename hash_t, int32_t key_len> class LDSketch {
@@ -24,7 +27,7 @@ template <typename T, typename hash_t, int32_t key_len> class LDSketch {
   struct Bucket {
     T V, e;
     int32_t l;
-    std::map<FlowKey<key_len>, T> A;
+    FlatHashMap<key_len, T> A;
 
     Bucket();
     void update(const FlowKey<key_len> &flow_key, T val, double expansion);
@@ -47,8 +50,8 @@ public:
   std::size_t size() const;
   void clear();
 
-  std::map<FlowKey<key_len>, T> heavyHitters() const;
-  std::map<FlowKey<key_len>, T> heavyChangers(const LDSketch &other) const;
+  FlatHashMap<key_len, T> heavyHitters() const;
+  FlatHashMap<key_len, T> heavyChangers(const LDSketch &other) const;
 };
 
 template <typename T, typename hash_t, int32_t key_len>
@@ -108,8 +111,7 @@ void LDSketch<T, hash_t, key_len>::Bucket::clear() {
 template <typename T, typename hash_t, int32_t key_len>
 std::size_t LDSketch<T, hash_t, key_len>::Bucket::size() {
   // Not accurate
-  return sizeof(LDSketch<T, hash_t, key_len>::Bucket) +
-         A.size() * (sizeof(FlowKey<key_len>) + sizeof(T));
+  return sizeof(LDSketch<T, hash_t, key_len>::Bucket) + A.bytes();
 }
 
 template <typename T, typename hash_t, int32_t key_len>
@@ -177,9 +179,9 @@ std::size_t LDSketch<T, hash_t, key_len>::size() const {
 }
 
 template <typename T, typename hash_t, int32_t key_len>
-std::map<FlowKey<key_len>, T>
+FlatHashMap<key_len, T>
 LDSketch<T, hash_t, key_len>::heavyHitters() const {
-  std::map<FlowKey<key_len>, T> heavy_hitters;
+  FlatHashMap<key_len, T> heavy_hitters;
 
   for (int i = 0; i < depth_; ++i)
     for (int j = 0; j < width_; ++j) {
@@ -207,7 +209,7 @@ LDSketch<T, hash_t, key_len>::heavyHitters() const {
 }
 
 template <typename T, typename hash_t, int32_t key_len>
-std::map<FlowKey<key_len>, T>
+FlatHashMap<key_len, T>
 LDSketch<T, hash_t, key_len>::heavyChangers(const LDSketch &other) const {
   auto d = [this, &other](FlowKey<key_len> flow_key) {
     std::vector<T> Ds(depth_);
@@ -221,7 +223,7 @@ LDSketch<T, hash_t, key_len>::heavyChangers(const LDSketch &other) const {
     return *std::min_element(Ds.begin(), Ds.end());
   };
 
-  std::map<FlowKey<key_len>, T> heavy_changers;
+  FlatHashMap<key_len, T> heavy_changers;
 
   for (int i = 0; i < depth_; ++i)
     for (int j = 0; j < width_; ++j) {
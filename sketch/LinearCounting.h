@@ -0,0 +1,121 @@
+#ifndef SKETCHLAB_CPP_LINEARCOUNTING_H
+#define SKETCHLAB_CPP_LINEARCOUNTING_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+#include "hash.h"
+#include "util.h"
+
+namespace SketchLab {
+
+/*
+ * Linear Counting (Whang, Vander-Zanden and Taylor, "A linear-time
+ * probabilistic counting algorithm for database applications", 1990).
+ *
+ * Every key sets one bit of an nbits_ bitmap; with z bits still clear the
+ * estimate is nbits_ * ln(nbits_ / z). It is accurate while the load
+ * (keys / nbits_) stays below a few, and cheaper per key than HyperLogLog:
+ * one hash and one bit set. Once every bit is set the estimate saturates at
+ * nbits_ * ln(nbits_).
+ *
+ * Copies of one instance share its hash function; their union is the bitwise
+ * OR of the bitmaps.
+ */
+template <typename T, typename hash_t> class LinearCounting {
+  int32_t nbits_;
+
+  int32_t nwords_;
+
+  hash_t *hash_fns_;
+
+  uint64_t *arr_;
+
+public:
+  // nbits is rounded up to a multiple of 64
+  LinearCounting(int32_t nbits);
+  LinearCounting(const LinearCounting &other);
+  ~LinearCounting();
+  LinearCounting &operator=(const LinearCounting &) = delete;
+
+  template <int32_t key_len> void update(const FlowKey<key_len> &flowkey);
+  T query() const;
+  // Union of instances with the same size and hash function, i.e. copies of
+  // one LinearCounting; others throw std::invalid_argument
+  bool compatible(const LinearCounting &other) const;
+  void merge(const LinearCounting &other);
+  size_t size() const;
+  void clear();
+};
+
+template <typename T, typename hash_t>
+LinearCounting<T, hash_t>::LinearCounting(int32_t nbits) {
+  nwords_ = std::max<int32_t>(1, (nbits + 63) / 64);
+  nbits_ = nwords_ * 64;
+  hash_fns_ = new hash_t[1];
+  arr_ = new uint64_t[nwords_]();
+}
+
+template <typename T, typename hash_t>
+LinearCounting<T, hash_t>::LinearCounting(const LinearCounting &other)
+    : nbits_(other.nbits_), nwords_(other.nwords_) {
+  hash_fns_ = new hash_t[1]{other.hash_fns_[0]};
+  arr_ = new uint64_t[nwords_];
+  std::copy(other.arr_, other.arr_ + nwords_, arr_);
+}
+
+template <typename T, typename hash_t>
+LinearCounting<T, hash_t>::~LinearCounting() {
+  delete[] hash_fns_;
+  delete[] arr_;
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+void LinearCounting<T, hash_t>::update(const FlowKey<key_len> &flowkey) {
+  uint64_t hash = Util::Mix64(hash_fns_[0](flowkey));
+  // multiply-shift maps the high half onto [0, nbits_) without a division
+  uint64_t idx = ((hash >> 32) * static_cast<uint64_t>(nbits_)) >> 32;
+  arr_[idx >> 6] |= 1ULL << (idx & 63);
+}
+
+template <typename T, typename hash_t>
+T LinearCounting<T, hash_t>::query() const {
+  const double m = nbits_;
+  int64_t zeroes = nbits_ - Util::PopCountArray(arr_, nwords_);
+  return static_cast<T>(m * std::log(m / std::max<int64_t>(zeroes, 1)));
+}
+
+template <typename T, typename hash_t>
+bool LinearCounting<T, hash_t>::compatible(const LinearCounting &other) const {
+  return nbits_ == other.nbits_ &&
+         Util::SameHashes(hash_fns_, other.hash_fns_, 1);
+}
+
+template <typename T, typename hash_t>
+void LinearCounting<T, hash_t>::merge(const LinearCounting &other) {
+  if (!compatible(other)) {
+    throw std::invalid_argument(
+        "LinearCounting: operands differ in size or hash functions");
+  }
+  for (int32_t i = 0; i < nwords_; ++i) {
+    arr_[i] |= other.arr_[i];
+  }
+}
+
+template <typename T, typename hash_t>
+size_t LinearCounting<T, hash_t>::size() const {
+  return sizeof(LinearCounting<T, hash_t>) // Instance
+         + sizeof(hash_t)                  // hash_fns
+         + nwords_ * sizeof(uint64_t);     // bitmap
+}
+
+template <typename T, typename hash_t> void LinearCounting<T, hash_t>::clear() {
+  std::fill(arr_, arr_ + nwords_, 0);
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_LINEARCOUNTING_H
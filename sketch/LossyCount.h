@@ -2,19 +2,37 @@
 #define SKETCHLAB_CPP_LOSSYCOUNT_H
 
 #include <cmath>
-#include <list>
 
+#include "FlatHashMap.h"
 #include "hash.h"
 #include "util.h"
 
 namespace SketchLab {
 
+/*
+ * Lossy Counting (Manku and Motwani, "Approximate frequency counts over data
+ * streams", 2002).
+ *
+ * Entries live inline in one linear-probing table. Pruning is lazy: at a
+ * bucket boundary only pruned_ moves, and an entry with freq_ + error_ <=
+ * pruned_ counts as deleted from then on, exactly as if it had been removed.
+ * Updates and queries treat such an entry as absent, an update reusing its
+ * slot, and every update reclaims up to SWEEP_STEP slots behind a cursor that
+ * cycles through the table. Nothing stops the world at a boundary.
+ *
+ * size is the initial capacity in entries. The sweep keeps at most half the
+ * table for entries that are dead but not yet reclaimed; should the live
+ * entries alone need more than a quarter of it, the table doubles, which is
+ * the only allocation after construction.
+ */
 template <typename T, typename hash_t, int32_t key_len> class LossyCount {
 
 private:
+  static const int32_t SWEEP_STEP = 4;
+
   int32_t width_;
-  int32_t size_;
   int32_t bucket_current_;
+  int32_t pruned_; // bucket at the last boundary
   int32_t count_;
 
   hash_t hash_fn_;
@@ -23,12 +41,20 @@ private:
     FlowKey<key_len> flowkey_;
     T freq_;
     T error_;
-    entry() {}
-    entry(const FlowKey<key_len> &flowkey, T freq, T error)
-        : flowkey_(flowkey), freq_(freq), error_(error) {}
+    uint32_t hash_;
+    bool used_;
   };
 
-  std::list<entry> *arr_;
+  uint32_t mask_;
+  int32_t num_; // used slots, dead entries included
+  uint32_t cursor_;
+  entry *arr_;
+
+  bool dead(const entry &e) const { return e.freq_ + e.error_ <= pruned_; }
+  uint32_t find(const FlowKey<key_len> &flowkey, uint32_t hash) const;
+  void erase(uint32_t i);
+  void sweep();
+  void grow();
 
 public:
   LossyCount(double eps, int size);
@@ -45,8 +71,10 @@ public:
 
 template <typename T, typename hash_t, int32_t key_len>
 LossyCount<T, hash_t, key_len>::LossyCount(double eps, int size)
-    : width_(ceil(1 / eps)), size_(Util::NextPrime(size)), bucket_current_(1), count_(0) {
-  arr_ = new std::list<entry>[size_];
+    : width_(ceil(1 / eps)), bucket_current_(1), pruned_(0), count_(0),
+      num_(0), cursor_(0) {
+  mask_ = FlatHash::RoundUpPow2(2 * static_cast<std::size_t>(size)) - 1;
+  arr_ = new entry[mask_ + 1]();
 }
 
 template <typename T, typename hash_t, int32_t key_len>
@@ -54,62 +82,121 @@ LossyCount<T, hash_t, key_len>::~LossyCount() {
   delete[] arr_;
 }
 
+// slot holding flowkey, or the empty slot ending its probe sequence
 template <typename T, typename hash_t, int32_t key_len>
-void LossyCount<T, hash_t, key_len>::update(const FlowKey<key_len> &flowkey,
-                                            T val) {
-  int idx = hash_fn_(flowkey) % size_;
-  bool lookup = 0; //表中是否能找到flowkey
-  for (entry &e : arr_[idx]) {
-    if (e.flowkey_ == flowkey) {
-      e.freq_ += val;
-      lookup = 1;
-      break;
+uint32_t LossyCount<T, hash_t, key_len>::find(const FlowKey<key_len> &flowkey,
+                                              uint32_t hash) const {
+  uint32_t i = hash & mask_;
+  while (arr_[i].used_ &&
+         !(arr_[i].hash_ == hash && arr_[i].flowkey_ == flowkey)) {
+    i = (i + 1) & mask_;
+  }
+  return i;
+}
+
+// backward shift deletion: no tombstones, probe sequences stay intact
+template <typename T, typename hash_t, int32_t key_len>
+void LossyCount<T, hash_t, key_len>::erase(uint32_t i) {
+  for (uint32_t j = (i + 1) & mask_; arr_[j].used_; j = (j + 1) & mask_) {
+    // move back an entry whose home is not in (i, j]
+    if (((j - arr_[j].hash_) & mask_) >= ((j - i) & mask_)) {
+      arr_[i] = arr_[j];
+      i = j;
+    }
+  }
+  arr_[i].used_ = false;
+  --num_;
+}
+
+template <typename T, typename hash_t, int32_t key_len>
+void LossyCount<T, hash_t, key_len>::sweep() {
+  for (int32_t s = 0; s < SWEEP_STEP; ++s) {
+    if (arr_[cursor_].used_ && dead(arr_[cursor_])) {
+      // a later entry may have shifted into the cursor slot, look again
+      erase(cursor_);
+    } else {
+      cursor_ = (cursor_ + 1) & mask_;
+    }
+  }
+}
+
+template <typename T, typename hash_t, int32_t key_len>
+void LossyCount<T, hash_t, key_len>::grow() {
+  entry *old = arr_;
+  uint32_t old_slots = mask_ + 1;
+  mask_ = 2 * old_slots - 1;
+  arr_ = new entry[mask_ + 1]();
+  num_ = 0;
+  cursor_ = 0;
+  for (uint32_t i = 0; i < old_slots; ++i) {
+    if (old[i].used_ && !dead(old[i])) {
+      arr_[find(old[i].flowkey_, old[i].hash_)] = old[i];
+      ++num_;
     }
   }
-  if (!lookup) {
-    arr_[idx].push_back(entry{flowkey, val, bucket_current_ - 1});
+  delete[] old;
+}
+
+template <typename T, typename hash_t, int32_t key_len>
+void LossyCount<T, hash_t, key_len>::update(const FlowKey<key_len> &flowkey,
+                                            T val) {
+  uint32_t hash = static_cast<uint32_t>(Util::Mix64(hash_fn_(flowkey)));
+  entry &e = arr_[find(flowkey, hash)];
+  if (!e.used_) {
+    e.flowkey_ = flowkey;
+    e.freq_ = val;
+    e.error_ = bucket_current_ - 1;
+    e.hash_ = hash;
+    e.used_ = true;
+    ++num_;
+  } else if (dead(e)) {
+    // pruned at an earlier boundary: a new entry in the same slot
+    e.freq_ = val;
+    e.error_ = bucket_current_ - 1;
+  } else {
+    e.freq_ += val;
   }
   count_ += val;
   if (count_ >= width_) {
-    for (int i = 0; i < size_; ++i) {
-      arr_[i].remove_if(
-          [&](entry &e) { return e.freq_ + e.error_ <= bucket_current_; });
-    }
+    pruned_ = bucket_current_;
     bucket_current_ += count_ / width_;
     count_ %= width_;
   }
+  sweep();
+  if (num_ > static_cast<int32_t>((mask_ + 1) / 4 * 3)) {
+    grow();
+  }
 }
 
 template <typename T, typename hash_t, int32_t key_len>
 T LossyCount<T, hash_t, key_len>::query(const FlowKey<key_len> &flowkey) const {
-  int idx = hash_fn_(flowkey) % size_;
-  for (entry e : arr_[idx]) {
-    if (e.flowkey_ == flowkey) {
-      return e.freq_;
-    }
+  uint32_t hash = static_cast<uint32_t>(Util::Mix64(hash_fn_(flowkey)));
+  const entry &e = arr_[find(flowkey, hash)];
+  if (e.used_ && !dead(e)) {
+    return e.freq_;
   }
   return 0;
 }
 
 template <typename T, typename hash_t, int32_t key_len>
 std::size_t LossyCount<T, hash_t, key_len>::size() const {
-  int entry_num = 0;
-  for (int i = 1; i < size_; i++) {
-    entry_num += arr_[i].size();
-  }
   return sizeof(LossyCount<T, hash_t, key_len>) // Instance
          + sizeof(hash_t)                       // hash_fn
-         + entry_num * sizeof(entry);           // counter
+         + (mask_ + 1) * sizeof(entry);         // counter
 }
 
 template <typename T, typename hash_t, int32_t key_len>
 void LossyCount<T, hash_t, key_len>::clear() {
-  for (int i = 0; i < size_; ++i)
-    arr_[i].clear();
+  for (uint32_t i = 0; i <= mask_; ++i) {
+    arr_[i].used_ = false;
+  }
   bucket_current_ = 1;
+  pruned_ = 0;
   count_ = 0;
+  num_ = 0;
+  cursor_ = 0;
 }
 
 } // namespace SketchLab
 
-#endif
\ No newline at end of file
+#endif
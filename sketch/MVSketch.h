@@ -6,17 +6,24 @@
 #define SKETCHLAB_CPP_MVSKETCH_H
 
 #include <algorithm>
-#include <map>
+#include <limits>
+#include <stdexcept>
 #include <vector>
 
+#include "FlatHashMap.h"
 #include "hash.h"
 #include "util.h"
 
 namespace SketchLab {
-template <typename T, typename hash_t, int32_t key_len> class MVSketch {
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH = 0>
+class MVSketch {
   int32_t depth_;
   int32_t width_;
 
+  // Row count; a compile-time constant when DEPTH > 0, so the per-row
+  // loops unroll and their indices stay in registers
+  int32_t depth() const { return DEPTH > 0 ? DEPTH : depth_; }
+
   hash_t *hash_fns_;
 
   struct Bounds {
@@ -34,7 +41,7 @@ template <typename T, typename hash_t, int32_t key_len> class MVSketch {
 
 public:
   MVSketch(int depth, int width);
-  MVSketch(const MVSketch<T, hash_t, key_len> &);
+  MVSketch(const MVSketch<T, hash_t, key_len, DEPTH> &);
   MVSketch(MVSketch &&) = delete;
   ~MVSketch();
   MVSketch &operator=(const MVSketch &) = delete;
@@ -47,14 +54,21 @@ public:
   std::size_t size() const;
 
   Bounds queryBounds(const FlowKey<key_len> &flow_key) const;
-  std::map<FlowKey<key_len>, T> heavyHitters(T threshold) const;
-  std::map<FlowKey<key_len>, T> heavyChangers(T threshold,
+  FlatHashMap<key_len, T> heavyHitters(T threshold) const;
+  FlatHashMap<key_len, T> heavyChangers(T threshold,
                                               const MVSketch &other) const;
 };
 
-template <typename T, typename hash_t, int32_t key_len>
-MVSketch<T, hash_t, key_len>::MVSketch(int depth, int width)
+// Depth fixed at compile time, e.g. MVSketchN<T, hash_t, key_len, 4>
+template <typename T, typename hash_t, int32_t key_len, int32_t depth>
+using MVSketchN = MVSketch<T, hash_t, key_len, depth>;
+
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH>
+MVSketch<T, hash_t, key_len, DEPTH>::MVSketch(int depth, int width)
     : depth_(depth), width_(Util::NextPrime(width)) {
+  if (DEPTH > 0 && depth != DEPTH) {
+    throw std::invalid_argument("MVSketch: depth does not match DEPTH");
+  }
   hash_fns_ = new hash_t[depth_];
 
   // Allocate continuous memory
@@ -64,33 +78,33 @@ MVSketch<T, hash_t, key_len>::MVSketch(int depth, int width)
     counter_[i] = counter_[i - 1] + width_;
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-MVSketch<T, hash_t, key_len>::MVSketch(
-    const MVSketch<T, hash_t, key_len> &other)
-    : depth_(other.depth_), width_(other.width_) {
-  hash_fns_ = new hash_t[depth_];
-  std::copy(other.hash_fns_, other.hash_fns_ + depth_, hash_fns_);
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH>
+MVSketch<T, hash_t, key_len, DEPTH>::MVSketch(
+    const MVSketch<T, hash_t, key_len, DEPTH> &other)
+    : depth_(other.depth()), width_(other.width_) {
+  hash_fns_ = new hash_t[depth()];
+  std::copy(other.hash_fns_, other.hash_fns_ + depth(), hash_fns_);
 
-  counter_ = new Bucket *[depth_];
-  counter_[0] = new Bucket[depth_ * width_];
-  for (int i = 1; i < depth_; ++i)
+  counter_ = new Bucket *[depth()];
+  counter_[0] = new Bucket[depth() * width_];
+  for (int i = 1; i < depth(); ++i)
     counter_[i] = counter_[i - 1] + width_;
-  std::copy(other.counter_[0], other.counter_[0] + depth_ * width_,
+  std::copy(other.counter_[0], other.counter_[0] + depth() * width_,
             counter_[0]);
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-MVSketch<T, hash_t, key_len>::~MVSketch() {
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH>
+MVSketch<T, hash_t, key_len, DEPTH>::~MVSketch() {
   delete[] hash_fns_;
 
   delete[] counter_[0];
   delete[] counter_;
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-void MVSketch<T, hash_t, key_len>::update(const FlowKey<key_len> &flow_key,
-                                          T val) {
-  for (int i = 0; i < depth_; ++i) {
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH>
+void MVSketch<T, hash_t, key_len, DEPTH>::update(
+    const FlowKey<key_len> &flow_key, T val) {
+  for (int i = 0; i < depth(); ++i) {
     int index = hash_fns_[i](flow_key) % width_;
     counter_[i][index].V += val;
     if (counter_[i][index].K == flow_key)
@@ -105,54 +119,58 @@ void MVSketch<T, hash_t, key_len>::update(const FlowKey<key_len> &flow_key,
   }
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-T MVSketch<T, hash_t, key_len>::query(const FlowKey<key_len> &flow_key) const {
-  std::vector<T> S_cap(depth_);
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH>
+T MVSketch<T, hash_t, key_len, DEPTH>::query(
+    const FlowKey<key_len> &flow_key) const {
+  T S_cap = std::numeric_limits<T>::max();
 
-  for (int i = 0; i < depth_; ++i) {
+  for (int i = 0; i < depth(); ++i) {
     int index = hash_fns_[i](flow_key) % width_;
     if (counter_[i][index].K == flow_key)
-      S_cap[i] = (counter_[i][index].V + counter_[i][index].C) / 2;
+      S_cap = std::min<T>(S_cap,
+                          (counter_[i][index].V + counter_[i][index].C) / 2);
     else
-      S_cap[i] = (counter_[i][index].V - counter_[i][index].C) / 2;
+      S_cap = std::min<T>(S_cap,
+                          (counter_[i][index].V - counter_[i][index].C) / 2);
   }
 
-  return *min_element(S_cap.begin(), S_cap.end());
+  return S_cap;
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-void MVSketch<T, hash_t, key_len>::clear() {
-  std::fill(counter_[0], counter_[0] + depth_ * width_, {0, 0, 0});
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH>
+void MVSketch<T, hash_t, key_len, DEPTH>::clear() {
+  std::fill(counter_[0], counter_[0] + depth() * width_, {0, 0, 0});
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-std::size_t MVSketch<T, hash_t, key_len>::size() const {
-  return sizeof(MVSketch<T, hash_t, key_len>) + // Instance
-         depth_ * sizeof(hash_t) +              // hash_fns
-         sizeof(Bucket *) * depth_ +            // counter
-         sizeof(Bucket) * depth_ * width_;
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH>
+std::size_t MVSketch<T, hash_t, key_len, DEPTH>::size() const {
+  return sizeof(MVSketch<T, hash_t, key_len, DEPTH>) + // Instance
+         depth() * sizeof(hash_t) +                    // hash_fns
+         sizeof(Bucket *) * depth() +                  // counter
+         sizeof(Bucket) * depth() * width_;
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-typename MVSketch<T, hash_t, key_len>::Bounds
-MVSketch<T, hash_t, key_len>::queryBounds(
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH>
+typename MVSketch<T, hash_t, key_len, DEPTH>::Bounds
+MVSketch<T, hash_t, key_len, DEPTH>::queryBounds(
     const FlowKey<key_len> &flow_key) const {
-  std::vector<T> L(depth_);
+  T L = 0;
 
-  for (int i = 0; i < depth_; ++i) {
+  for (int i = 0; i < depth(); ++i) {
     int index = hash_fns_[i](flow_key) % width_;
-    L[i] = counter_[i][index].K == flow_key ? counter_[i][index].C : 0;
+    if (counter_[i][index].K == flow_key)
+      L = std::max(L, counter_[i][index].C);
   }
 
-  return {*max_element(L.begin(), L.end()), query(flow_key)};
+  return {L, query(flow_key)};
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-std::map<FlowKey<key_len>, T>
-MVSketch<T, hash_t, key_len>::heavyHitters(T threshold) const {
-  std::map<FlowKey<key_len>, T> heavy_hitters;
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH>
+FlatHashMap<key_len, T>
+MVSketch<T, hash_t, key_len, DEPTH>::heavyHitters(T threshold) const {
+  FlatHashMap<key_len, T> heavy_hitters;
 
-  for (int i = 0; i < depth_; ++i)
+  for (int i = 0; i < depth(); ++i)
     for (int j = 0; j < width_; ++j) {
       if (counter_[i][j].V < threshold)
         continue;
@@ -169,10 +187,10 @@ MVSketch<T, hash_t, key_len>::heavyHitters(T threshold) const {
   return heavy_hitters;
 }
 
-template <typename T, typename hash_t, int32_t key_len>
-std::map<FlowKey<key_len>, T>
-MVSketch<T, hash_t, key_len>::heavyChangers(T threshold,
-                                            const MVSketch &other) const {
+template <typename T, typename hash_t, int32_t key_len, int32_t DEPTH>
+FlatHashMap<key_len, T>
+MVSketch<T, hash_t, key_len, DEPTH>::heavyChangers(
+    T threshold, const MVSketch &other) const {
   auto d_cap = [this, &other](const FlowKey<key_len> &flow_key) {
     auto bounds = queryBounds(flow_key);
     auto other_bounds = other.queryBounds(flow_key);
@@ -180,9 +198,9 @@ MVSketch<T, hash_t, key_len>::heavyChangers(T threshold,
                     std::abs(bounds.lower - other_bounds.upper));
   };
 
-  std::map<FlowKey<key_len>, T> heavy_changers;
+  FlatHashMap<key_len, T> heavy_changers;
 
-  for (int i = 0; i < depth_; ++i)
+  for (int i = 0; i < depth(); ++i)
     for (int j = 0; j < width_; ++j) {
       if (counter_[i][j].V < threshold)
         continue;
@@ -196,7 +214,7 @@ MVSketch<T, hash_t, key_len>::heavyChangers(T threshold,
         heavy_changers.emplace(flow_key, D_cap);
     }
 
-  for (int i = 0; i < depth_; ++i)
+  for (int i = 0; i < depth(); ++i)
     for (int j = 0; j < width_; ++j) {
       if (other.counter_[i][j].V < threshold)
         continue;
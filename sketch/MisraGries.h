@@ -1,133 +1,167 @@
 #ifndef SKETCHLAB_CPP_MISRAGRIES_H
 #define SKETCHLAB_CPP_MISRAGRIES_H
 
+#include "CounterHeap.h"
+#include "FlatHashMap.h"
 #include "hash.h"
 #include "util.h"
 
 #include <algorithm>
 #include <cstdint>
-#include <map>
+#include <vector>
 namespace SketchLab {
+/*
+ * Misra-Gries (Misra and Gries, "Finding repeated elements", 1982).
+ *
+ * Decrementing every counter is a single add to offset_: counters are stored
+ * biased by it, and those it has caught up with are popped off a CounterHeap
+ * and freed. Each counter is freed at most once per insertion, so a
+ * decrement-all costs O(1) amortised plus O(log k) per counter it frees.
+ * Entries stay in fixed slots found through a SlotIndex; nothing is
+ * allocated after construction.
+ *
+ * Counts and totals are kept in total_t, at least 64 bits wide, so a stream
+ * weighted by bytes does not overflow them.
+ */
 template <typename T, int32_t key_len> class MisraGries {
 private:
-  std::map<FlowKey<key_len>, T> counter_;
+  typedef decltype(T() + int64_t()) total_t;
+
+  struct Entry {
+    FlowKey<key_len> flowkey_;
+    uint32_t hash_;
+  };
+
   int num_threshold_;
-  int total_val_;
+  std::vector<Entry> entries_;
+  CounterHeap<total_t> heap_; // counts plus offset_, by slot
+  std::vector<int32_t> free_; // num_threshold_ - heap_.size() unused slots
+  SlotIndex index_;
+
+  total_t offset_; // sum of all decrements
+  total_t total_val_;
+
+  int32_t find(const FlowKey<key_len> &flowkey, uint32_t hash) const {
+    return index_.find(hash, [&](int32_t slot) {
+      return entries_[slot].flowkey_ == flowkey;
+    });
+  }
+  void insert(const FlowKey<key_len> &flowkey, uint32_t hash, total_t count);
+  void popMin();
 
 public:
-  MisraGries(int num_threshold)
-      : num_threshold_(num_threshold), total_val_(0) {}
-  ~MisraGries() {}
+  MisraGries(int num_threshold);
   void update(const FlowKey<key_len> &flowkey);
   void update(const FlowKey<key_len> &flowkey, T val);
   T query(const FlowKey<key_len> &flowkey) const;
-  std::map<FlowKey<key_len>, T>
+  FlatHashMap<key_len, T>
   getHeavyHittersWithLowerBound(const T val_threshold) const;
-  std::map<FlowKey<key_len>, T>
+  FlatHashMap<key_len, T>
   getHeavyHittersWithUpperBound(const T val_threshold) const;
   std::size_t size() const; // only estimated size
 };
 
+template <typename T, int32_t key_len>
+MisraGries<T, key_len>::MisraGries(int num_threshold)
+    : num_threshold_(num_threshold), entries_(num_threshold),
+      heap_(num_threshold), free_(num_threshold), index_(num_threshold),
+      offset_(0), total_val_(0) {
+  for (int32_t i = 0; i < num_threshold_; ++i) {
+    free_[i] = num_threshold_ - 1 - i;
+  }
+}
+
+template <typename T, int32_t key_len>
+void MisraGries<T, key_len>::insert(const FlowKey<key_len> &flowkey,
+                                    uint32_t hash, total_t count) {
+  int32_t slot = free_[num_threshold_ - heap_.size() - 1];
+  entries_[slot].flowkey_ = flowkey;
+  entries_[slot].hash_ = hash;
+  index_.insert(hash, slot);
+  heap_.push(slot, count + offset_);
+}
+
+template <typename T, int32_t key_len> void MisraGries<T, key_len>::popMin() {
+  int32_t slot = heap_.pop();
+  index_.erase(entries_[slot].hash_, slot);
+  free_[num_threshold_ - heap_.size() - 1] = slot;
+}
+
 // 默认val是1
 template <typename T, int32_t key_len>
 void MisraGries<T, key_len>::update(const FlowKey<key_len> &flowkey) {
-  total_val_ += 1;
-  auto iter = counter_.find(flowkey);
-  if (iter != counter_.end()) {
-    iter->second += 1;
-  } else if (counter_.size() < num_threshold_) {
-    counter_.emplace(flowkey, 1);
-  } else {
-    for (auto it = counter_.begin(); it != counter_.end();) {
-      it->second -= 1;
-      if (it->second == 0) {
-        it = counter_.erase(it);
-      } else {
-        ++it;
-      }
-    }
-  }
+  update(flowkey, 1);
 }
 
 template <typename T, int32_t key_len>
 void MisraGries<T, key_len>::update(const FlowKey<key_len> &flowkey, T val) {
   total_val_ += val;
-  auto iter = counter_.find(flowkey);
-  if (iter != counter_.end()) {
-    iter->second += val;
-  } else if (counter_.size() < num_threshold_) {
-    counter_.emplace(flowkey, val);
-  } else {
-    auto min_val =
-        std::min_element(counter_.begin(), counter_.end(),
-                         [](const std::pair<FlowKey<key_len>, T> &left,
-                            const std::pair<FlowKey<key_len>, T> &right) {
-                           return left.second < right.second;
-                         })
-            ->second;
-    if (val < min_val) {
-      for (auto &kv : counter_) {
-        kv.second -= val;
-      }
-    } else {
-      for (auto it = counter_.begin(); it != counter_.end();) {
-        if (it->second <= min_val) {
-          it = counter_.erase(it);
-        } else {
-          it->second -= min_val;
-          ++it;
-        }
-      }
-      val -= min_val;
-      if (val > 0) {
-        counter_.emplace(flowkey, val);
-      }
+  uint32_t hash = static_cast<uint32_t>(FlatHash::HashKey(flowkey));
+  int32_t slot = find(flowkey, hash);
+  if (slot >= 0) {
+    heap_.add(slot, val);
+  } else if (heap_.size() < num_threshold_) {
+    insert(flowkey, hash, val);
+  } else if (num_threshold_ > 0) {
+    // decrement all by min(val, smallest count), then insert what is left
+    total_t dec = std::min<total_t>(val, heap_.top().count_ - offset_);
+    offset_ += dec;
+    while (heap_.size() > 0 && heap_.top().count_ <= offset_) {
+      popMin();
+    }
+    if (val > dec) {
+      insert(flowkey, hash, val - dec);
     }
   }
 }
 
 template <typename T, int32_t key_len>
 T MisraGries<T, key_len>::query(const FlowKey<key_len> &flowkey) const {
-  auto iter = counter_.find(flowkey);
-  if (iter != counter_.end()) {
-    return iter->second;
+  int32_t slot =
+      find(flowkey, static_cast<uint32_t>(FlatHash::HashKey(flowkey)));
+  if (slot >= 0) {
+    return static_cast<T>(heap_.count(slot) - offset_);
   } else {
     return 0;
   }
 }
 
 template <typename T, int32_t key_len>
-std::map<FlowKey<key_len>, T>
+FlatHashMap<key_len, T>
 MisraGries<T, key_len>::getHeavyHittersWithLowerBound(
     const T val_threshold) const {
-  std::map<FlowKey<key_len>, T> heavy_hitters;
-  for (auto &kv : counter_) {
-    if (kv.second >= val_threshold) {
-      heavy_hitters.emplace(kv.first, kv.second);
+  FlatHashMap<key_len, T> heavy_hitters;
+  for (int32_t i = 0; i < heap_.size(); ++i) {
+    total_t count = heap_[i].count_ - offset_;
+    if (count >= val_threshold) {
+      heavy_hitters.emplace(entries_[heap_[i].slot_].flowkey_,
+                            static_cast<T>(count));
     }
   }
   return heavy_hitters;
 }
 
 template <typename T, int32_t key_len>
-std::map<FlowKey<key_len>, T>
+FlatHashMap<key_len, T>
 MisraGries<T, key_len>::getHeavyHittersWithUpperBound(
     const T val_threshold) const {
-  std::map<FlowKey<key_len>, T> heavy_hitters;
-  int delta = total_val_ / (num_threshold_ + 1);
-  for (auto &kv : counter_) {
-    if (kv.second + delta >= val_threshold) {
-      heavy_hitters.emplace(kv.first, kv.second);
+  FlatHashMap<key_len, T> heavy_hitters;
+  total_t delta = total_val_ / (num_threshold_ + 1);
+  for (int32_t i = 0; i < heap_.size(); ++i) {
+    total_t count = heap_[i].count_ - offset_;
+    if (count + delta >= val_threshold) {
+      heavy_hitters.emplace(entries_[heap_[i].slot_].flowkey_,
+                            static_cast<T>(count));
     }
   }
   return heavy_hitters;
 }
-// only estimated size
-// 没有考虑map的每个节点的指针的大小
 template <typename T, int32_t key_len>
 std::size_t MisraGries<T, key_len>::size() const {
-  return (sizeof(FlowKey<key_len>) + sizeof(T)) * num_threshold_ +
-         sizeof(MisraGries<T, key_len>);
+  return sizeof(MisraGries<T, key_len>) // Instance
+         + num_threshold_ * (sizeof(Entry) + sizeof(int32_t)) // slots
+         + heap_.bytes()                                      // heap_
+         + index_.bytes();                                    // index_
 }
 } // namespace SketchLab
-#endif
\ No newline at end of file
+#endif
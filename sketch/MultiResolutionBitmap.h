@@ -0,0 +1,167 @@
+#ifndef SKETCHLAB_CPP_MULTIRESOLUTIONBITMAP_H
+#define SKETCHLAB_CPP_MULTIRESOLUTIONBITMAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#include "hash.h"
+#include "util.h"
+
+namespace SketchLab {
+
+/*
+ * Multi-resolution bitmap (Estan, Varghese and Fisk, "Bitmap algorithms for
+ * counting active flows on high-speed links", 2006).
+ *
+ * A stack of components_ Linear Counting bitmaps of bits_ bits each. A key
+ * goes to component i with probability 2^-(i + 1), the last one taking the
+ * remaining 2^-(components_ - 1), so every component sees a geometrically
+ * smaller share of the keys and one of them is always at a load Linear
+ * Counting handles well. The estimate takes the first component that is not
+ * too full (base) and scales the Linear Counting estimates of it and all
+ * later components, which together see a 2^-base share of the keys, by
+ * 2^base. The range grows by a factor of two per component at a constant
+ * relative error.
+ *
+ * Copies of one instance share its hash function; their union is the bitwise
+ * OR of the bitmaps.
+ */
+template <typename T, typename hash_t> class MultiResolutionBitmap {
+  static const int32_t MAX_COMPONENTS = 32;
+
+  int32_t bits_;
+
+  int32_t words_; // per component
+
+  int32_t components_;
+
+  hash_t *hash_fns_;
+
+  uint64_t *arr_; // components_ * words_, component 0 first
+
+public:
+  // bits per component, rounded up to a multiple of 64; components in
+  // [1, 32]
+  MultiResolutionBitmap(int32_t bits, int32_t components);
+  MultiResolutionBitmap(const MultiResolutionBitmap &other);
+  ~MultiResolutionBitmap();
+  MultiResolutionBitmap &operator=(const MultiResolutionBitmap &) = delete;
+
+  template <int32_t key_len> void update(const FlowKey<key_len> &flowkey);
+  T query() const;
+  // Union of instances with the same dimensions and hash function, i.e.
+  // copies of one MultiResolutionBitmap; others throw std::invalid_argument
+  bool compatible(const MultiResolutionBitmap &other) const;
+  void merge(const MultiResolutionBitmap &other);
+  size_t size() const;
+  void clear();
+};
+
+template <typename T, typename hash_t>
+MultiResolutionBitmap<T, hash_t>::MultiResolutionBitmap(int32_t bits,
+                                                        int32_t components)
+    : components_(components) {
+  if (components_ < 1 || components_ > MAX_COMPONENTS) {
+    throw std::invalid_argument(
+        "MultiResolutionBitmap: components must be in [1, " +
+        std::to_string(MAX_COMPONENTS) + "]");
+  }
+  words_ = std::max<int32_t>(1, (bits + 63) / 64);
+  bits_ = words_ * 64;
+  hash_fns_ = new hash_t[1];
+  arr_ = new uint64_t[components_ * words_]();
+}
+
+template <typename T, typename hash_t>
+MultiResolutionBitmap<T, hash_t>::MultiResolutionBitmap(
+    const MultiResolutionBitmap &other)
+    : bits_(other.bits_), words_(other.words_),
+      components_(other.components_) {
+  hash_fns_ = new hash_t[1]{other.hash_fns_[0]};
+  arr_ = new uint64_t[components_ * words_];
+  std::copy(other.arr_, other.arr_ + components_ * words_, arr_);
+}
+
+template <typename T, typename hash_t>
+MultiResolutionBitmap<T, hash_t>::~MultiResolutionBitmap() {
+  delete[] hash_fns_;
+  delete[] arr_;
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+void MultiResolutionBitmap<T, hash_t>::update(
+    const FlowKey<key_len> &flowkey) {
+  uint64_t hash = Util::Mix64(hash_fns_[0](flowkey));
+  // trailing zeroes of the low half pick the component, capped by a guard
+  // bit; the high half picks the bit
+  int32_t component =
+      Util::CountTrailingZeros(hash | (1ULL << (components_ - 1)));
+  uint64_t idx = ((hash >> 32) * static_cast<uint64_t>(bits_)) >> 32;
+  arr_[component * words_ + (idx >> 6)] |= 1ULL << (idx & 63);
+}
+
+template <typename T, typename hash_t>
+T MultiResolutionBitmap<T, hash_t>::query() const {
+  const double b = bits_;
+  // a component past a load of 2 keys per bit (86% of bits set) is too full
+  // for an accurate Linear Counting estimate
+  const int64_t set_max = static_cast<int64_t>(b * (1 - std::exp(-2.)));
+
+  int64_t set[MAX_COMPONENTS];
+  int32_t base = components_ - 1;
+  for (int32_t i = 0; i < components_; ++i) {
+    set[i] = Util::PopCountArray(arr_ + i * words_, words_);
+  }
+  for (int32_t i = 0; i < components_ - 1; ++i) {
+    if (set[i] <= set_max) {
+      base = i;
+      break;
+    }
+  }
+
+  double sum = 0;
+  for (int32_t i = base; i < components_; ++i) {
+    sum += b * std::log(b / std::max<int64_t>(bits_ - set[i], 1));
+  }
+  return static_cast<T>(std::ldexp(sum, base));
+}
+
+template <typename T, typename hash_t>
+bool MultiResolutionBitmap<T, hash_t>::compatible(
+    const MultiResolutionBitmap &other) const {
+  return bits_ == other.bits_ && components_ == other.components_ &&
+         Util::SameHashes(hash_fns_, other.hash_fns_, 1);
+}
+
+template <typename T, typename hash_t>
+void MultiResolutionBitmap<T, hash_t>::merge(
+    const MultiResolutionBitmap &other) {
+  if (!compatible(other)) {
+    throw std::invalid_argument(
+        "MultiResolutionBitmap: operands differ in dimensions or hash "
+        "functions");
+  }
+  for (int32_t i = 0; i < components_ * words_; ++i) {
+    arr_[i] |= other.arr_[i];
+  }
+}
+
+template <typename T, typename hash_t>
+size_t MultiResolutionBitmap<T, hash_t>::size() const {
+  return sizeof(MultiResolutionBitmap<T, hash_t>)  // Instance
+         + sizeof(hash_t)                           // hash_fns
+         + components_ * words_ * sizeof(uint64_t); // bitmaps
+}
+
+template <typename T, typename hash_t>
+void MultiResolutionBitmap<T, hash_t>::clear() {
+  std::fill(arr_, arr_ + components_ * words_, 0);
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_MULTIRESOLUTIONBITMAP_H
@@ -6,6 +6,7 @@
 #include <iostream>
 #include <memory>
 #include <random>
+#include <stdexcept>
 
 #include "FlowKey.h"
 #include "hash.h"
@@ -13,7 +14,7 @@
 
 namespace SketchLab {
 
-template <typename T, typename hash_t> class NitroSketch {
+template <typename T, typename hash_t, int32_t DEPTH = 0> class NitroSketch {
 public:
   NitroSketch(int depth, int width);
   ~NitroSketch();
@@ -27,7 +28,7 @@ public:
   template <int32_t key_len>
   void alwaysCorrectUpdate(const FlowKey<key_len> &flowkey, T value);
 
-  template <int32_t key_len> T query(const FlowKey<key_len> &flowkey);
+  template <int32_t key_len> T query(const FlowKey<key_len> &flowkey) const;
 
   void adjustUpdateProb(double traffic_rate);
 
@@ -38,6 +39,10 @@ private:
   int depth_;
   int width_;
 
+  // Row count; a compile-time constant when DEPTH > 0, so the per-row
+  // loops unroll and their indices stay in registers
+  int32_t depth() const { return DEPTH > 0 ? DEPTH : depth_; }
+
   T **array_;
   hash_t *hash_fns_;
   double *square_sum_; // maintain the square sum of each hash table
@@ -61,15 +66,26 @@ private:
   void __do_update(const FlowKey<key_len> &flowkey, T value, double prob);
 };
 
-#define SKETCH_TYPE template <typename T, typename hash_t>
+// Depth fixed at compile time, e.g. NitroSketchN<T, hash_t, 4>
+template <typename T, typename hash_t, int32_t depth>
+using NitroSketchN = NitroSketch<T, hash_t, depth>;
+
+#define SKETCH_TYPE template <typename T, typename hash_t, int32_t DEPTH>
 
 SKETCH_TYPE
-double NitroSketch<T, hash_t>::update_probs[8] = {
+double NitroSketch<T, hash_t, DEPTH>::update_probs[8] = {
     1.0, 1.0 / 2, 1.0 / 4, 1.0 / 8, 1.0 / 16, 1.0 / 32, 1.0 / 64, 1.0 / 128};
 
 SKETCH_TYPE
-NitroSketch<T, hash_t>::NitroSketch(int depth, int width)
+NitroSketch<T, hash_t, DEPTH>::NitroSketch(int depth, int width)
     : depth_(depth), width_(Util::NextPrime(width)) {
+  if (DEPTH > 0 && depth != DEPTH) {
+    throw std::invalid_argument("NitroSketch: depth does not match DEPTH");
+  }
+  if (depth_ <= 0 || depth_ > Util::MAX_DEPTH) {
+    throw std::invalid_argument("NitroSketch: depth must be in [1, " +
+                                std::to_string(Util::MAX_DEPTH) + "]");
+  }
 
   switch_thresh_ = (1.0 + std::sqrt(11.0 / width_)) * width_ * width_;
 
@@ -90,7 +106,7 @@ NitroSketch<T, hash_t>::NitroSketch(int depth, int width)
 }
 
 SKETCH_TYPE
-NitroSketch<T, hash_t>::~NitroSketch() {
+NitroSketch<T, hash_t, DEPTH>::~NitroSketch() {
   delete[] hash_fns_;
   delete[] array_[0];
   delete[] array_;
@@ -98,14 +114,14 @@ NitroSketch<T, hash_t>::~NitroSketch() {
 
 SKETCH_TYPE
 template <int32_t key_len>
-void NitroSketch<T, hash_t>::alwaysLineRateUpdate(
+void NitroSketch<T, hash_t, DEPTH>::alwaysLineRateUpdate(
     const FlowKey<key_len> &flowkey, T value) {
   __do_update(flowkey, value, update_prob_);
 }
 
 SKETCH_TYPE
 template <int32_t key_len>
-void NitroSketch<T, hash_t>::alwaysCorrectUpdate(
+void NitroSketch<T, hash_t, DEPTH>::alwaysCorrectUpdate(
     const FlowKey<key_len> &flowkey, T value) {
   if (isLineRateUpdate()) {
     __do_update(flowkey, value, update_prob_);
@@ -116,38 +132,31 @@ void NitroSketch<T, hash_t>::alwaysCorrectUpdate(
 
 SKETCH_TYPE
 template <int32_t key_len>
-T NitroSketch<T, hash_t>::query(const FlowKey<key_len> &flowkey) {
-  T median;
-  T values[depth_];
-  for (int i = 0; i < depth_; i++) {
+T NitroSketch<T, hash_t, DEPTH>::query(const FlowKey<key_len> &flowkey) const {
+  T values[Util::MAX_DEPTH];
+  for (int i = 0; i < depth(); i++) {
     int index = hash_fns_[i](flowkey) % width_;
     values[i] = array_[i][index] *
-                (2 * static_cast<int>(hash_fns_[depth_ + i](flowkey) & 1) - 1);
+                (2 * static_cast<int>(hash_fns_[depth() + i](flowkey) & 1) - 1);
   }
-  std::sort(values, values + depth_);
-  if (depth_ & 1) {
-    median = std::abs(values[depth_ / 2]);
-  } else {
-    median = std::abs((values[depth_ / 2 - 1] + values[depth_ / 2]) / 2);
-  }
-  return median;
+  return std::abs(Util::Median(values, depth()));
 }
 
 SKETCH_TYPE
-std::size_t NitroSketch<T, hash_t>::size() {
-  return sizeof(NitroSketch<T, hash_t>) + depth_ * 2 * sizeof(hash_t) +
-         depth_ * sizeof(T *) + depth_ * width_ * sizeof(T);
+std::size_t NitroSketch<T, hash_t, DEPTH>::size() {
+  return sizeof(NitroSketch<T, hash_t, DEPTH>) + depth() * 2 * sizeof(hash_t) +
+         depth() * sizeof(T *) + depth() * width_ * sizeof(T);
 }
 
 SKETCH_TYPE
-void NitroSketch<T, hash_t>::clear() {
-  std::fill(array_[0], array_[0] + depth_ * width_);
+void NitroSketch<T, hash_t, DEPTH>::clear() {
+  std::fill(array_[0], array_[0] + depth() * width_, 0);
 }
 
 SKETCH_TYPE
 template <int32_t key_len>
-void NitroSketch<T, hash_t>::__do_update(const FlowKey<key_len> &flowkey,
-                                         T value, double prob) {
+void NitroSketch<T, hash_t, DEPTH>::__do_update(const FlowKey<key_len> &flowkey,
+                                                T value, double prob) {
   next_packet_--; // skip packets
   if (next_packet_ == 0) {
     int i;
@@ -157,7 +166,7 @@ void NitroSketch<T, hash_t>::__do_update(const FlowKey<key_len> &flowkey,
 
       double delta =
           1.0 * value / prob *
-          (2 * static_cast<int>(hash_fns_[depth_ + i](flowkey) & 1) - 1);
+          (2 * static_cast<int>(hash_fns_[depth() + i](flowkey) & 1) - 1);
 
       square_sum_[i] += (2.0 * array_[i][index] + delta) * delta;
       array_[i][index] += static_cast<T>(delta);
@@ -171,33 +180,25 @@ void NitroSketch<T, hash_t>::__do_update(const FlowKey<key_len> &flowkey,
 }
 
 SKETCH_TYPE
-void NitroSketch<T, hash_t>::getNextUpdate(double prob) {
+void NitroSketch<T, hash_t, DEPTH>::getNextUpdate(double prob) {
   int sample = 1;
   if (prob < 1.0) {
     std::geometric_distribution<int> dist(prob);
     sample = 1 + dist(generator);
   }
   next_bucket_ = next_bucket_ + sample;
-  next_packet_ = next_bucket_ / depth_;
-  next_bucket_ %= depth_;
+  next_packet_ = next_bucket_ / depth();
+  next_bucket_ %= depth();
 }
 
 SKETCH_TYPE
-bool NitroSketch<T, hash_t>::isLineRateUpdate() {
+bool NitroSketch<T, hash_t, DEPTH>::isLineRateUpdate() {
   if (line_rate_enable_) {
     return true;
   } else {
-    double median;
-    double values[depth_];
-    for (int i = 0; i < depth_; i++) {
-      values[i] = square_sum_[i];
-    }
-    std::sort(values, values + depth_);
-    if (depth_ & 1) {
-      median = values[depth_ / 2];
-    } else {
-      median = (values[depth_ / 2 - 1] + values[depth_ / 2]) / 2;
-    }
+    double values[Util::MAX_DEPTH];
+    std::copy(square_sum_, square_sum_ + depth(), values);
+    double median = Util::Median(values, depth());
     if (median >= switch_thresh_) {
       std::cout << "line rate update enable\n";
       line_rate_enable_ = true;
@@ -207,7 +208,7 @@ bool NitroSketch<T, hash_t>::isLineRateUpdate() {
 }
 
 SKETCH_TYPE
-void NitroSketch<T, hash_t>::adjustUpdateProb(double traffic_rate) {
+void NitroSketch<T, hash_t, DEPTH>::adjustUpdateProb(double traffic_rate) {
   int log_rate = static_cast<int>(std::log2(traffic_rate));
   int update_index = std::max(0, std::min(log_rate, 7));
   update_prob_ = update_probs[update_index];
@@ -0,0 +1,89 @@
+#ifndef SKETCHLAB_CPP_SALSACMSKETCH_H
+#define SKETCHLAB_CPP_SALSACMSKETCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+
+#include "SalsaCounter.h"
+#include "hash.h"
+#include "util.h"
+
+namespace SketchLab {
+
+/*
+ * Count-Min on SALSA counters: every counter starts at 8 bits and is merged
+ * with its neighbours into 16/32 bits only when it overflows, so the same
+ * memory holds about 4x the counters of a 32-bit CMSketch. `width` is the
+ * number of 8-bit counters per row. Queries are capped at 2^32 - 1.
+ */
+template <typename T, typename hash_t> class SalsaCMSketch {
+
+  int32_t depth_;
+  int32_t width_;
+  int32_t stride_; // width_ rounded up, so merge groups never span two rows
+
+  hash_t *hash_fns_;
+
+  SalsaCounterArray counter_;
+
+public:
+  SalsaCMSketch(int32_t depth, int32_t width);
+  ~SalsaCMSketch();
+  SalsaCMSketch(const SalsaCMSketch &) = delete;
+  SalsaCMSketch &operator=(const SalsaCMSketch &) = delete;
+
+  template <int32_t key_len>
+  void update(const FlowKey<key_len> &flowkey, T val);
+  template <int32_t key_len> T query(const FlowKey<key_len> &flowkey) const;
+  size_t size() const;
+  void clear();
+};
+
+template <typename T, typename hash_t>
+SalsaCMSketch<T, hash_t>::SalsaCMSketch(int32_t depth, int32_t width)
+    : depth_(depth), width_(Util::NextPrime(width)),
+      stride_((width_ + 3) & ~3), counter_(depth_ * stride_) {
+
+  hash_fns_ = new hash_t[depth_];
+}
+
+template <typename T, typename hash_t>
+SalsaCMSketch<T, hash_t>::~SalsaCMSketch() {
+  delete[] hash_fns_;
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+void SalsaCMSketch<T, hash_t>::update(const FlowKey<key_len> &flowkey, T val) {
+  for (int32_t i = 0; i < depth_; ++i) {
+    int32_t index = hash_fns_[i](flowkey) % width_;
+    counter_.add(i * stride_ + index, val);
+  }
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+T SalsaCMSketch<T, hash_t>::query(const FlowKey<key_len> &flowkey) const {
+  uint32_t min_val = std::numeric_limits<uint32_t>::max();
+  for (int32_t i = 0; i < depth_; ++i) {
+    int32_t idx = hash_fns_[i](flowkey) % width_;
+    min_val = std::min(min_val, counter_.get(i * stride_ + idx));
+  }
+  return min_val;
+}
+
+template <typename T, typename hash_t>
+size_t SalsaCMSketch<T, hash_t>::size() const {
+  return sizeof(SalsaCMSketch<T, hash_t>)      // Instance
+         + depth_ * sizeof(hash_t)             // hash_fns
+         + counter_.size() - sizeof(counter_); // counter and merge bits
+}
+
+template <typename T, typename hash_t> void SalsaCMSketch<T, hash_t>::clear() {
+  counter_.clear();
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_SALSACMSKETCH_H
@@ -0,0 +1,104 @@
+#ifndef SKETCHLAB_CPP_SALSACUSKETCH_H
+#define SKETCHLAB_CPP_SALSACUSKETCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include "SalsaCounter.h"
+#include "hash.h"
+#include "util.h"
+
+namespace SketchLab {
+
+/*
+ * Conservative-update sketch on SALSA counters, see SalsaCMSketch. Max-merge
+ * of counters keeps every counter an upper bound, so the CU estimate stays
+ * one-sided after promotion. `width` is the number of 8-bit counters per row.
+ * update() keeps its counter indices on the stack, so depth is limited to
+ * Util::MAX_DEPTH.
+ */
+template <typename T, typename hash_t> class SalsaCUSketch {
+
+  int32_t depth_;
+  int32_t width_;
+  int32_t stride_; // width_ rounded up, so merge groups never span two rows
+
+  hash_t *hash_fns_;
+
+  SalsaCounterArray counter_;
+
+public:
+  SalsaCUSketch(int32_t depth, int32_t width);
+  ~SalsaCUSketch();
+  SalsaCUSketch(const SalsaCUSketch &) = delete;
+  SalsaCUSketch &operator=(const SalsaCUSketch &) = delete;
+
+  template <int32_t key_len>
+  void update(const FlowKey<key_len> &flowkey, T val);
+  template <int32_t key_len> T query(const FlowKey<key_len> &flowkey) const;
+  size_t size() const;
+  void clear();
+};
+
+template <typename T, typename hash_t>
+SalsaCUSketch<T, hash_t>::SalsaCUSketch(int32_t depth, int32_t width)
+    : depth_(depth), width_(Util::NextPrime(width)),
+      stride_((width_ + 3) & ~3), counter_(depth_ * stride_) {
+  if (depth_ <= 0 || depth_ > Util::MAX_DEPTH) {
+    throw std::invalid_argument("SalsaCUSketch: depth must be in [1, " +
+                                std::to_string(Util::MAX_DEPTH) + "]");
+  }
+
+  hash_fns_ = new hash_t[depth_];
+}
+
+template <typename T, typename hash_t>
+SalsaCUSketch<T, hash_t>::~SalsaCUSketch() {
+  delete[] hash_fns_;
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+void SalsaCUSketch<T, hash_t>::update(const FlowKey<key_len> &flowkey, T val) {
+  int32_t idx[Util::MAX_DEPTH];
+  uint32_t min_val = std::numeric_limits<uint32_t>::max();
+  for (int32_t i = 0; i < depth_; ++i) {
+    idx[i] = i * stride_ + hash_fns_[i](flowkey) % width_;
+    min_val = std::min(min_val, counter_.get(idx[i]));
+  }
+  uint64_t new_val = static_cast<uint64_t>(min_val) + val;
+  for (int32_t i = 0; i < depth_; ++i) {
+    if (counter_.get(idx[i]) < new_val) {
+      counter_.set(idx[i], new_val);
+    }
+  }
+}
+
+template <typename T, typename hash_t>
+template <int32_t key_len>
+T SalsaCUSketch<T, hash_t>::query(const FlowKey<key_len> &flowkey) const {
+  uint32_t min_val = std::numeric_limits<uint32_t>::max();
+  for (int32_t i = 0; i < depth_; ++i) {
+    int32_t idx = hash_fns_[i](flowkey) % width_;
+    min_val = std::min(min_val, counter_.get(i * stride_ + idx));
+  }
+  return min_val;
+}
+
+template <typename T, typename hash_t>
+size_t SalsaCUSketch<T, hash_t>::size() const {
+  return sizeof(SalsaCUSketch<T, hash_t>)     // Instance
+         + depth_ * sizeof(hash_t)            // hash_fns
+         + counter_.size() - sizeof(counter_); // counter and merge bits
+}
+
+template <typename T, typename hash_t> void SalsaCUSketch<T, hash_t>::clear() {
+  counter_.clear();
+}
+
+} // namespace SketchLab
+
+#endif // SKETCHLAB_CPP_SALSACUSKETCH_H
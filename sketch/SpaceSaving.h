@@ -1,76 +1,128 @@
 #ifndef SKETCHLAB_CPP_SPACESAVING_H
 #define SKETCHLAB_CPP_SPACESAVING_H
 
+#include "CounterHeap.h"
+#include "FlatHashMap.h"
 #include "hash.h"
 #include "util.h"
 
 #include <algorithm>
 #include <cstdint>
 #include <limits>
-#include <map>
+#include <vector>
 
 namespace SketchLab {
+/*
+ * Space-Saving (Metwally, Agrawal and El Abbadi, "Efficient computation of
+ * frequent and top-k elements in data streams", 2005).
+ *
+ * Updates are weighted, so instead of Stream-Summary's unit-step count
+ * buckets the counters form a CounterHeap, O(log k) per update. Entries (key,
+ * error) stay in their slot and are found through a SlotIndex, so nothing is
+ * allocated after construction and an eviction leaves no tombstone.
+ *
+ * A key that takes over the minimum counter inherits its count; that count
+ * is the key's error, an upper bound on its overestimation.
+ */
 template <typename T, int32_t key_len> class SpaceSaving {
 private:
-  std::map<FlowKey<key_len>, T> counter_;
+  struct Entry {
+    FlowKey<key_len> flowkey_;
+    T error_;
+    uint32_t hash_;
+  };
+
   int num_threshold_;
+  std::vector<Entry> entries_;
+  CounterHeap<T> heap_; // counts of entries_ by slot
+  SlotIndex index_;
+
+  int32_t find(const FlowKey<key_len> &flowkey, uint32_t hash) const {
+    return index_.find(hash, [&](int32_t slot) {
+      return entries_[slot].flowkey_ == flowkey;
+    });
+  }
 
 public:
-  SpaceSaving(int num_threshold) : num_threshold_(num_threshold) {}
-  ~SpaceSaving() {}
+  SpaceSaving(int num_threshold);
   void update(const FlowKey<key_len> &flowkey, T val);
   T query(const FlowKey<key_len> &flowkey) const;
-  std::map<FlowKey<key_len>, T> getHeavyHitters(const T threshold_val) const;
+  // upper bound on how much query(flowkey) overestimates, 0 if untracked
+  T queryError(const FlowKey<key_len> &flowkey) const;
+  FlatHashMap<key_len, T> getHeavyHitters(const T threshold_val) const;
   std::size_t size() const; // only estimated size
+  void clear();
 };
+
+template <typename T, int32_t key_len>
+SpaceSaving<T, key_len>::SpaceSaving(int num_threshold)
+    : num_threshold_(num_threshold), entries_(num_threshold),
+      heap_(num_threshold), index_(num_threshold) {}
+
 template <typename T, int32_t key_len>
 void SpaceSaving<T, key_len>::update(const FlowKey<key_len> &flowkey, T val) {
-  auto iter = counter_.find(flowkey);
-  if (iter != counter_.end()) {
-    iter->second += val;
-  } else if (counter_.size() < num_threshold_) {
-    counter_.emplace(flowkey, val);
+  uint32_t hash = static_cast<uint32_t>(FlatHash::HashKey(flowkey));
+  int32_t slot = find(flowkey, hash);
+  if (slot >= 0) {
+    heap_.add(slot, val);
+    return;
+  }
+  if (heap_.size() < num_threshold_) {
+    slot = heap_.size();
+    entries_[slot].error_ = 0;
+    heap_.push(slot, val);
   } else {
-    // find the min element
-    auto min_iter =
-        std::min_element(counter_.begin(), counter_.end(),
-                         [](const std::pair<FlowKey<key_len>, T> &left,
-                            const std::pair<FlowKey<key_len>, T> &right) {
-                           return left.second < right.second;
-                         });
-    counter_.emplace(flowkey, val + min_iter->second);
-    counter_.erase(min_iter);
+    // take over the min counter
+    slot = heap_.top().slot_;
+    index_.erase(entries_[slot].hash_, slot);
+    entries_[slot].error_ = heap_.top().count_;
+    heap_.add(slot, val);
   }
+  entries_[slot].flowkey_ = flowkey;
+  entries_[slot].hash_ = hash;
+  index_.insert(hash, slot);
 }
 
 template <typename T, int32_t key_len>
 T SpaceSaving<T, key_len>::query(const FlowKey<key_len> &flowkey) const {
-  auto iter = counter_.find(flowkey);
-  if (iter != counter_.end()) {
-    return iter->second;
+  int32_t slot =
+      find(flowkey, static_cast<uint32_t>(FlatHash::HashKey(flowkey)));
+  if (slot >= 0) {
+    return heap_.count(slot);
   } else {
     return 0;
   }
 }
 
 template <typename T, int32_t key_len>
-std::map<FlowKey<key_len>, T>
+T SpaceSaving<T, key_len>::queryError(const FlowKey<key_len> &flowkey) const {
+  int32_t slot =
+      find(flowkey, static_cast<uint32_t>(FlatHash::HashKey(flowkey)));
+  return slot >= 0 ? entries_[slot].error_ : 0;
+}
+
+template <typename T, int32_t key_len>
+FlatHashMap<key_len, T>
 SpaceSaving<T, key_len>::getHeavyHitters(const T val_threshold) const {
-  std::map<FlowKey<key_len>, T> heavy_hitters;
-  for (auto &kv : counter_) {
-    if (kv.second >= val_threshold) {
-      heavy_hitters.emplace(kv.first, kv.second);
+  FlatHashMap<key_len, T> heavy_hitters;
+  for (int32_t i = 0; i < heap_.size(); ++i) {
+    if (heap_[i].count_ >= val_threshold) {
+      heavy_hitters.emplace(entries_[heap_[i].slot_].flowkey_,
+                            heap_[i].count_);
     }
   }
   return heavy_hitters;
 }
-// only estimated size
-// 没有考虑map的每个节点的指针的大小
 template <typename T, int32_t key_len>
 std::size_t SpaceSaving<T, key_len>::size() const {
-  return (sizeof(FlowKey<key_len>) + sizeof(T)) *
-             num_threshold_ +
-         sizeof(SpaceSaving<T, key_len>);
+  return sizeof(SpaceSaving<T, key_len>) // Instance
+         + num_threshold_ * sizeof(Entry) // entries
+         + heap_.bytes()                  // heap_
+         + index_.bytes();                // index_
+}
+template <typename T, int32_t key_len> void SpaceSaving<T, key_len>::clear() {
+  heap_.clear();
+  index_.clear();
 }
 } // namespace SketchLab
-#endif
\ No newline at end of file
+#endif
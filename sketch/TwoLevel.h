@@ -1,15 +1,39 @@
 #ifndef SKETCHLAB_CPP_TWOLEVEL_H
 #define SKETCHLAB_CPP_TWOLEVEL_H
 
+#include "BlockedBloomFilter.h"
 #include "BloomFilter.h"
+#include "FlatHashMap.h"
 #include "hash.h"
 #include "util.h"
 
+#include <algorithm>
+#include <cstring>
 #include <vector>
 
 namespace SketchLab {
 
-template <typename hash_t> class TwoLevel {
+/*
+ * Two-level superspreader detection (Venkataraman et al., "New streaming
+ * algorithms for fast detection of superspreaders", 2005).
+ *
+ * Per new (src, dst) pair the sampling decisions (level 1 with r1, the level
+ * 2 gate with r2, and every level 2 table with 1 / gamma) are 16-bit fields
+ * of one hash of the pair, stretched with Util::Mix64 when there are more
+ * tables than fit in a word. The level 2 Bloom filters share one bit matrix
+ * with a row per position and a column per table; a source probes
+ * table_num_hash_ rows derived from one hash of it, so testing and setting
+ * all tables at once takes table_num_hash_ row reads, an AND, an OR and a
+ * popcount. The tables share probe positions: each keeps its false positive
+ * rate, but the rates are correlated, so a heavily filled matrix reports
+ * more false superspreaders than independent filters would. Keep the fill
+ * of table_nbits low.
+ *
+ * filter_t (BloomFilter<hash_t> or BlockedBloomFilter<hash_t>) is used for
+ * the distinct pair filter and level 1, and hashes on its own.
+ */
+template <typename hash_t, typename filter_t = BloomFilter<hash_t>>
+class TwoLevel {
 private:
   // distinct bf
   int32_t distinct_bf_num_hash_;
@@ -30,21 +54,21 @@ private:
   double gamma_;
   int32_t w_;
 
-  hash_t *hash_fns_;
+  // sampling thresholds on 16-bit hash fields
+  uint32_t edge1_, edge2_, edge3_;
 
-  BloomFilter<hash_t> *distinct_bf_;
-  BloomFilter<hash_t> *bf_;
-  BloomFilter<hash_t> **table_;
-  uint32_t *ss_;
+  hash_t *hash_fns_; // [0] pairs, [1] sources
 
-  union Key {
-    uint32_t src_dst_[2];
-    FlowKey<8> flowkey_;
-    Key(uint32_t src, uint32_t dst = 0) {
-      src_dst_[0] = src;
-      src_dst_[1] = dst;
-    }
-  };
+  filter_t *distinct_bf_;
+  filter_t *bf_;
+
+  int32_t rows_;
+  int32_t row_bytes_;
+  uint8_t *matrix_; // rows_ rows of table_count_ bits, one per table
+
+  FlatHashSet<4> ss_;
+
+  uint64_t sampleTables(uint64_t hash, int32_t first, int32_t n) const;
 
 public:
   TwoLevel(int distinct_bf_num_hash, int distinct_bf_nbits, int bf_num_hash,
@@ -61,123 +85,140 @@ public:
   void clear();
 };
 
-template <typename hash_t>
-TwoLevel<hash_t>::TwoLevel(int distinct_bf_num_hash, int distinct_bf_nbits,
-                           int bf_num_hash, int bf_nbits, int table_count,
-                           int table_num_hash, int table_nbits, int ss_width,
-                           double r1, double r2, double gamma, int w)
+template <typename hash_t, typename filter_t>
+TwoLevel<hash_t, filter_t>::TwoLevel(int distinct_bf_num_hash,
+                                     int distinct_bf_nbits, int bf_num_hash,
+                                     int bf_nbits, int table_count,
+                                     int table_num_hash, int table_nbits,
+                                     int ss_width, double r1, double r2,
+                                     double gamma, int w)
     : distinct_bf_num_hash_(distinct_bf_num_hash),
       distinct_bf_nbits_(distinct_bf_nbits), bf_num_hash_(bf_num_hash),
       bf_nbits_(bf_nbits), table_count_(table_count),
       table_num_hash_(table_num_hash), table_nbits_(table_nbits),
-      ss_width_(ss_width), r1_(r1), r2_(r2), gamma_(gamma), w_(w) {
-  hash_fns_ = new hash_t[table_count_ + 2];
+      ss_width_(ss_width), r1_(r1), r2_(r2), gamma_(gamma), w_(w),
+      ss_(ss_width, true) {
+  edge1_ = static_cast<uint32_t>(std::min(r1_, 1.) * 65536);
+  edge2_ = static_cast<uint32_t>(std::min(r2_, 1.) * 65536);
+  edge3_ = static_cast<uint32_t>(std::min(1 / gamma_, 1.) * 65536);
+
+  hash_fns_ = new hash_t[2];
 
   // distinct bf
-  distinct_bf_ =
-      new BloomFilter<hash_t>(distinct_bf_nbits_, distinct_bf_num_hash_);
+  distinct_bf_ = new filter_t(distinct_bf_nbits_, distinct_bf_num_hash_);
 
   // level 1
-  bf_ = new BloomFilter<hash_t>(bf_nbits_, bf_num_hash_);
+  bf_ = new filter_t(bf_nbits_, bf_num_hash_);
 
   // level 2
-  table_ = new BloomFilter<hash_t> *[table_count_];
-  for (int32_t i = 0; i < table_count_; ++i) {
-    table_[i] = new BloomFilter<hash_t>(table_nbits_, table_num_hash_);
-  }
-
-  ss_width_ = Util::NextPrime(ss_width_);
-  ss_ = new uint32_t[ss_width_]();
+  rows_ = Util::NextPrime(table_nbits_);
+  row_bytes_ = (table_count_ + 7) / 8;
+  matrix_ = new uint8_t[static_cast<size_t>(rows_) * row_bytes_]();
 }
 
-template <typename hash_t> TwoLevel<hash_t>::~TwoLevel() {
+template <typename hash_t, typename filter_t>
+TwoLevel<hash_t, filter_t>::~TwoLevel() {
   delete[] hash_fns_;
   delete distinct_bf_;
   delete bf_;
-  for (int32_t i = 0; i < table_count_; ++i) {
-    delete table_[i];
+  delete[] matrix_;
+}
+
+// bit i set iff table first + i samples the pair; n <= 64
+template <typename hash_t, typename filter_t>
+uint64_t TwoLevel<hash_t, filter_t>::sampleTables(uint64_t hash, int32_t first,
+                                                  int32_t n) const {
+  uint64_t mask = 0;
+  uint64_t word = 0;
+  for (int32_t i = 0; i < n; ++i) {
+    // fields 0 and 1 are the level 1 and level 2 decisions
+    int32_t field = first + i + 2;
+    if (i == 0 || (field & 3) == 0) {
+      word = Util::Mix64(hash + (field >> 2) * 0x9e3779b97f4a7c15ULL);
+    }
+    uint32_t u = (word >> (16 * (field & 3))) & 0xffff;
+    mask |= static_cast<uint64_t>(u < edge3_) << i;
   }
-  delete[] table_;
-  delete[] ss_;
+  return mask;
 }
 
-template <typename hash_t>
-void TwoLevel<hash_t>::insert(uint32_t src, uint32_t dst) {
-  Key key(src, dst);
-  int32_t edge1 = r1_ * 1000;
-  int32_t edge2 = r2_ * 1000;
-  int32_t edge3 = (1 / gamma_) * 1000;
-  int32_t count = 0;
-  uint32_t h1 = hash_fns_[0](key.flowkey_) % 1000;
-  uint32_t h2 = hash_fns_[1](key.flowkey_) % 1000;
-  uint32_t h3[table_count_];
-  for (int32_t i = 0; i < table_count_; ++i) {
-    h3[i] = hash_fns_[i + 2](key.flowkey_) % 1000;
+template <typename hash_t, typename filter_t>
+void TwoLevel<hash_t, filter_t>::insert(uint32_t src, uint32_t dst) {
+  FlowKey<8> pair(src, dst);
+  if (distinct_bf_->query(pair)) {
+    return;
   }
-  if (!distinct_bf_->query(key.flowkey_)) {
-    // step 1
-    if (h2 < edge2) {
-      if (bf_->query(FlowKey<4>(src))) {
-        for (int32_t i = 0; i < table_count_; ++i) {
-          if (h3[i] < edge3) {
-            table_[i]->insert(FlowKey<4>(src));
-            ++count;
-          } else {
-            count += table_[i]->query(FlowKey<4>(src));
-          }
-        }
-        if (count >= w_) {
-          int32_t ss_index = hash_fns_[0](FlowKey<4>(src)) % ss_width_;
-          for (int32_t i = 0; i < ss_width_; ++i) {
-            if (ss_[(ss_index + i) % ss_width_] == 0) {
-              ss_[(ss_index + i) % ss_width_] = src;
-              break;
-            } else {
-              if (ss_[(ss_index + i) % ss_width_] == src) {
-                break;
-              }
-            }
-          }
-        }
+  uint64_t hash = hash_fns_[0](pair);
+  uint64_t word = Util::Mix64(hash);
+  uint32_t h1 = word & 0xffff;
+  uint32_t h2 = (word >> 16) & 0xffff;
+  FlowKey<4> source(src);
+  // step 1
+  if (h2 < edge2_ && bf_->query(source)) {
+    // rows by double hashing of the source hash
+    uint64_t g = Util::Mix64(hash_fns_[1](source));
+    uint32_t first_row = (g >> 32) % rows_;
+    // rows_ is prime, so any non-zero step visits distinct rows
+    uint32_t step = rows_ > 1 ? 1 + static_cast<uint32_t>(g) % (rows_ - 1) : 0;
+    int32_t count = 0;
+    for (int32_t c = 0; c < row_bytes_; c += 8) {
+      int32_t n = std::min(8, row_bytes_ - c);
+      uint64_t sampled =
+          sampleTables(hash, 8 * c, std::min(64, table_count_ - 8 * c));
+      uint64_t held = ~0ULL;
+      uint32_t row = first_row;
+      for (int32_t j = 0; j < table_num_hash_; ++j) {
+        uint8_t *p = matrix_ + static_cast<size_t>(row) * row_bytes_ + c;
+        uint64_t bits = 0;
+        std::memcpy(&bits, p, n);
+        held &= bits;
+        bits |= sampled;
+        std::memcpy(p, &bits, n);
+        row += step;
+        row = row >= static_cast<uint32_t>(rows_) ? row - rows_ : row;
       }
+      // sampled tables count as inserted, the others as queried
+      count += Util::PopCount(held | sampled);
     }
-    // step 2
-    if (h1 < edge1) {
-      bf_->insert(FlowKey<4>(src));
+    if (count >= w_ && ss_.size() < static_cast<size_t>(ss_width_)) {
+      ss_.insert(source);
     }
-    distinct_bf_->insert(key.flowkey_);
   }
+  // step 2
+  if (h1 < edge1_) {
+    bf_->insert(source);
+  }
+  distinct_bf_->insert(pair);
 }
 
-template <typename hash_t>
-std::vector<uint32_t> TwoLevel<hash_t>::query() const {
+template <typename hash_t, typename filter_t>
+std::vector<uint32_t> TwoLevel<hash_t, filter_t>::query() const {
   std::vector<uint32_t> super_spreader;
-  for (int32_t i = 0; i < ss_width_; ++i) {
-    if (ss_[i]) {
-      super_spreader.push_back(ss_[i]);
-    }
+  super_spreader.reserve(ss_.size());
+  for (const FlowKey<4> &src : ss_) {
+    super_spreader.push_back(src.getIp());
   }
   return super_spreader;
 }
 
-template <typename hash_t> size_t TwoLevel<hash_t>::size() const {
-  return sizeof(TwoLevel<hash_t>)              // Instance
-         + (table_count_ + 2) * sizeof(hash_t) // hash_fns
-         + distinct_bf_->size()                // distinct_bf_
-         + bf_->size()                         // bf_
-         + table_count_ * table_[0]->size()    // table_
-         + ss_width_ * sizeof(uint32_t);       // ss_
+template <typename hash_t, typename filter_t>
+size_t TwoLevel<hash_t, filter_t>::size() const {
+  return sizeof(TwoLevel<hash_t, filter_t>)        // Instance
+         + 2 * sizeof(hash_t)                      // hash_fns
+         + distinct_bf_->size()                    // distinct_bf_
+         + bf_->size()                             // bf_
+         + static_cast<size_t>(rows_) * row_bytes_ // matrix_
+         + ss_.bytes();                            // ss_
 }
 
-template <typename hash_t> void TwoLevel<hash_t>::clear() {
+template <typename hash_t, typename filter_t>
+void TwoLevel<hash_t, filter_t>::clear() {
   distinct_bf_->clear();
   bf_->clear();
-  for (int32_t i = 0; i < table_count_; ++i) {
-    table_[i]->clear();
-  }
-  std::fill(ss_, ss_ + ss_width_, 0);
+  std::fill(matrix_, matrix_ + static_cast<size_t>(rows_) * row_bytes_, 0);
+  ss_.clear();
 }
 
 } // namespace SketchLab
 
-#endif // SKETCHLAB_CPP_TWOLEVEL_H
\ No newline at end of file
+#endif // SKETCHLAB_CPP_TWOLEVEL_H
@@ -0,0 +1,157 @@
+// Multi-writer Count-Min throughput: one shared ConcurrentCMSketch updated
+// with atomics, the same through per-thread Writer buffers, and per-thread
+// CMSketch shards merged afterwards.
+//
+//   bench_concurrent_cm [-t max_threads] [-n updates] [-d depth] [-w width]
+//
+// Thread counts run in powers of two up to max_threads (default: all
+// hardware threads). Every mode is checked against the exact count of the
+// heaviest flow; throughput only means something for threads <= cores.
+#include "CMSketch.h"
+#include "ConcurrentCMSketch.h"
+#include "hash.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace SketchLab;
+
+typedef uint64_t count_t;
+typedef Hash::MurmurHash hash_t;
+typedef FlowKey<13> Key;
+
+static double elapsedMs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Runs fn(t) on threads t = 0 .. num_threads - 1, returns the wall time
+template <typename Fn> static double runThreads(int num_threads, Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.emplace_back(fn, t);
+  }
+  for (std::thread &th : threads) {
+    th.join();
+  }
+  return elapsedMs(start);
+}
+
+static Key makeKey(uint32_t id) { return Key(id, ~id, 80, 443, 6); }
+
+// uniform: ids drawn from 1M flows; heavy: half the packets are flow 0;
+// zipf: rank r with probability ~ 1 / r over 1M flows
+static std::vector<Key> makeTrace(const char *kind, size_t n) {
+  std::mt19937_64 rng(1);
+  std::uniform_real_distribution<double> unit(0, 1);
+  std::vector<Key> keys;
+  keys.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    uint32_t id;
+    if (kind[0] == 'u') {
+      id = rng() % 1000000;
+    } else if (kind[0] == 'h') {
+      id = i % 2 == 0 ? 0 : 1 + rng() % 1000000;
+    } else {
+      id = static_cast<uint32_t>(std::pow(1e6, unit(rng))) - 1;
+    }
+    keys.push_back(makeKey(id));
+  }
+  return keys;
+}
+
+int main(int argc, char *argv[]) {
+  int max_threads = std::max(1u, std::thread::hardware_concurrency());
+  size_t n = 4000000;
+  int depth = 4, width = 1 << 20;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:d:w:")) != -1) {
+    switch (opt) {
+    case 't':
+      max_threads = std::max(1, atoi(optarg));
+      break;
+    case 'n':
+      n = strtoull(optarg, nullptr, 10);
+      break;
+    case 'd':
+      depth = atoi(optarg);
+      break;
+    case 'w':
+      width = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-t max_threads] [-n updates] [-d depth] "
+                      "[-w width]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  printf("hardware threads %u, %zu updates, depth %d, width %d\n",
+         std::thread::hardware_concurrency(), n, depth, width);
+  printf("%-8s %7s %14s %14s %14s %10s  %s\n", "trace", "threads",
+         "atomic Mops/s", "Writer Mops/s", "shards Mops/s", "merge ms",
+         "heavy flow: exact / atomic / Writer / shards");
+
+  const char *traces[] = {"uniform", "heavy", "zipf"};
+  for (const char *trace : traces) {
+    std::vector<Key> keys = makeTrace(trace, n);
+    const Key heavy = makeKey(0);
+    count_t exact = std::count(keys.begin(), keys.end(), heavy);
+
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      // thread t takes every threads-th packet, interleaving the trace
+      ConcurrentCMSketch<count_t, hash_t> shared(depth, width);
+      double atomic_ms = runThreads(threads, [&](int t) {
+        for (size_t i = t; i < n; i += threads) {
+          shared.update(keys[i], 1);
+        }
+      });
+
+      ConcurrentCMSketch<count_t, hash_t> buffered(depth, width);
+      double writer_ms = runThreads(threads, [&](int t) {
+        ConcurrentCMSketch<count_t, hash_t>::Writer<13> writer(buffered);
+        for (size_t i = t; i < n; i += threads) {
+          writer.update(keys[i], 1);
+        }
+      });
+
+      // full-width shards, copies of one sketch so they can be merged
+      CMSketch<count_t, hash_t> proto(depth, width);
+      std::vector<std::unique_ptr<CMSketch<count_t, hash_t>>> shards;
+      for (int t = 0; t < threads; ++t) {
+        shards.emplace_back(new CMSketch<count_t, hash_t>(proto));
+      }
+      double shard_ms = runThreads(threads, [&](int t) {
+        for (size_t i = t; i < n; i += threads) {
+          shards[t]->update(keys[i], 1);
+        }
+      });
+      auto merge_start = std::chrono::steady_clock::now();
+      for (int t = 1; t < threads; ++t) {
+        *shards[0] += *shards[t];
+      }
+      double merge_ms = elapsedMs(merge_start);
+
+      printf("%-8s %7d %14.1f %14.1f %14.1f %10.1f  %llu / %llu / %llu / "
+             "%llu\n",
+             trace, threads, n / atomic_ms / 1e3, n / writer_ms / 1e3,
+             n / (shard_ms + merge_ms) / 1e3, merge_ms,
+             static_cast<unsigned long long>(exact),
+             static_cast<unsigned long long>(shared.query(heavy)),
+             static_cast<unsigned long long>(buffered.query(heavy)),
+             static_cast<unsigned long long>(shards[0]->query(heavy)));
+    }
+  }
+  return 0;
+}
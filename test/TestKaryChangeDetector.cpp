@@ -0,0 +1,60 @@
+// Regression check: a cleared KaryChangeDetector must behave like a fresh one.
+#include "KaryChangeDetector.h"
+#include "hash.h"
+
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+using namespace SketchLab;
+
+typedef KaryChangeDetector<double, Hash::MurmurHash> Detector;
+
+// change() of a steady key and of a key that jumps in the last epoch, after
+// every epoch
+static std::vector<double> replay(Detector &detector) {
+  const FlowKey<4> steady(1u), jump(2u);
+  const int32_t epochs = 8;
+  std::vector<double> changes;
+  for (int32_t e = 0; e < epochs; ++e) {
+    detector.update(steady, 100);
+    detector.update(jump, e + 1 < epochs ? 10 : 1000);
+    detector.endEpoch();
+    changes.push_back(detector.change(steady));
+    changes.push_back(detector.change(jump));
+  }
+  return changes;
+}
+
+static bool check(const char *name, const Detector::Model &model) {
+  Detector detector(model, 4, 1024);
+  std::vector<double> fresh = replay(detector);
+  detector.clear();
+  std::vector<double> again = replay(detector);
+  bool ok = true;
+  for (size_t i = 0; i < fresh.size(); ++i) {
+    if (std::fabs(fresh[i] - again[i]) > 1e-6) {
+      fprintf(stderr, "%s: change %zu is %g after clear(), %g before\n", name,
+              i, again[i], fresh[i]);
+      ok = false;
+    }
+  }
+  // a steady key barely changes once the model is warmed up; the K-ary
+  // estimate spreads about 1 / width of the jump onto it
+  if (std::fabs(fresh[fresh.size() - 2]) > 5) {
+    fprintf(stderr, "%s: steady key changed by %g\n", name,
+            fresh[fresh.size() - 2]);
+    ok = false;
+  }
+  return ok;
+}
+
+int main() {
+  bool ok = true;
+  ok &= check("MA", Detector::Model::MovingAverage(3));
+  ok &= check("EWMA", Detector::Model::Ewma(0.5));
+  ok &= check("NSHW", Detector::Model::HoltWinters(0.5, 0.5));
+  ok &= check("ARIMA", Detector::Model::Arima(1, {0.5}, {0.3}));
+  printf("%s\n", ok ? "OK" : "FAILED");
+  return ok ? 0 : 1;
+}